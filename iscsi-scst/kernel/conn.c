@@ -91,39 +91,13 @@ static int print_digest_state(char *p, size_t size, unsigned long flags)
 	return pos;
 }
 
-static int print_busy_state(char *p, size_t size, struct iscsi_conn *conn)
+static int print_tx_coalesce_state(char *p, size_t size,
+	struct iscsi_conn *conn)
 {
 	int pos = 0;
-#ifdef ADAPTIVE_NAGLE
-	unsigned long read_tot, pct_nagle, avg_busy;
-
-	if (conn->closing) {
-		goto out;
-	}
-
-	read_tot = conn->stat_cpu_busy_count ?: 1;
-	pct_nagle = (100000 * conn->read_nagle + read_tot/2) / read_tot;
-	avg_busy = (100 * conn->stat_cpu_busy_count + conn->cpu_idles/2)
-						        / (conn->cpu_idles?:1);
-
-	pos += scnprintf(&p[pos], size - pos, "mode=%s busy=%lu",
-		 conn->tcp_nagle?"NAGLE":"NODELAY", conn->cpu_busy_count[0]);
-
-	pos += scnprintf(&p[pos], size - pos,
-		 " max_busy=%lu avg_busy=%lu.%02lu"
-		 " idles=%lu Nagle=%lu.%03lu%% (%lu/%lu)",
-		 conn->max_cpu_busy_count,
-		 avg_busy/100, avg_busy%100, conn->cpu_idles, pct_nagle/1000,
-		 pct_nagle%1000, conn->read_nagle, conn->stat_cpu_busy_count);
-
-	/* Reset cpu-busy stats each time we print them */
-	conn->max_cpu_busy_count = 0;
-	conn->stat_cpu_busy_count = 0;
-	conn->cpu_idles = 0;
-	conn->read_nagle = 0;
-	conn->read_nodelay = 0;
-
-out:
+#ifdef SCST_USERMODE_TX_GATHER
+	pos = scnprintf(p, size, "tx_pdus:%lu tx_coalesced:%lu tx_flushes:%lu",
+		conn->tx_pdus, conn->tx_coalesced, conn->tx_flushes);
 #endif
 	return pos;
 }
@@ -169,9 +143,8 @@ void conn_info_show(struct seq_file *seq, struct iscsi_session *session)
 			break;
 		}
 		seq_printf(seq, "\t\tcid:%u ip:%s ", conn->cid, buf);
-		if (print_busy_state(buf, sizeof(buf), conn)) {
+		if (print_tx_coalesce_state(buf, sizeof(buf), conn))
 			seq_printf(seq, "%s ", buf);
-		}
 		print_conn_state(buf, sizeof(buf), conn);
 		seq_printf(seq, "state:%s ", buf);
 		print_digest_state(buf, sizeof(buf), conn->hdigest_type);
@@ -465,7 +438,8 @@ void iscsi_make_conn_rd_active(struct iscsi_conn *conn)
 	conn->rd_data_ready = 1;
 
 	if (conn->rd_state == ISCSI_CONN_RD_STATE_IDLE) {
-#ifndef SCST_USERMODE			/* schedule conn_read_wakeup_handler */
+#if !defined(SCST_USERMODE) || defined(SCST_USERMODE_RD_THREADS)
+		/* Queue conn for the read threads of its pool */
 		struct iscsi_thread_pool *p = conn->conn_thr_pool;
 		conn_pool_rd_lock(p);
 		list_add_tail(&conn->rd_list_entry, &p->rd_list);
@@ -583,7 +557,8 @@ static void iscsi_data_ready(struct sock *sk, int len)
 
 	TRACE_ENTRY();
 
-#ifndef CONN_SIRQ_READ			/* read conn directly from event thread */
+#if !defined(CONN_SIRQ_READ) || defined(SCST_USERMODE_RD_THREADS)
+	/* Leave the read to the conn's read thread */
 	iscsi_make_conn_rd_active(conn);
 #else
 	/* Drive the receive directly out of the notification (SIRQ) handler */
@@ -671,6 +646,14 @@ static void conn_rsp_timer_fn(unsigned long arg)
 
 	TRACE_DBG("Timer (conn %p)", conn);
 
+#ifdef SCST_USERMODE_ZEROCOPY
+	/*
+	 * Requests pinned by zerocopy sends stay on write_timeout_list until
+	 * their completions are reaped, so reap before judging them timed out.
+	 */
+	iscsi_zc_reap(conn, false);
+#endif
+
 	spin_lock_bh(&conn->write_list_lock);
 
 	if (!list_empty(&conn->write_timeout_list)) {
@@ -941,6 +924,17 @@ static int conn_setup_sock(struct iscsi_conn *conn)
 		(void __force __user *)&opt, sizeof(opt));
 	set_fs(oldfs);
 
+#ifdef SCST_USERMODE_ZEROCOPY
+	/* Without kernel support we just keep copying Data-In into the socket */
+	if (setsockopt(conn->file->fd, SOL_SOCKET, SO_ZEROCOPY,
+		       &opt, sizeof(opt)) == 0)
+		conn->zc_enabled = 1;
+	else
+		PRINT_INFO("SO_ZEROCOPY unavailable for sid %llx (errno %d), "
+			"using copying sends", (unsigned long long int)session->sid,
+			errno);
+#endif
+
 out:
 	return res;
 }
@@ -952,6 +946,12 @@ void iscsi_tcp_conn_free(struct iscsi_conn *conn)
 	conn->sock = NULL;
 
 	free_page((unsigned long)conn->read_iov);
+#ifdef SCST_USERMODE_RX_BULK
+	kfree(conn->rx_buf);
+#endif
+#ifdef SCST_USERMODE_TX_GATHER
+	kfree(conn->tx_iov);
+#endif
 
 	kmem_cache_free(iscsi_conn_cache, conn);
 }
@@ -966,6 +966,20 @@ void conn_free(struct iscsi_conn *conn)
 	TRACE(TRACE_MGMT, "Freeing conn %p (sess=%p, %#Lx %u, initiator %s)",
 		conn, session, (unsigned long long int)session->sid, conn->cid,
 		session->scst_sess->initiator_name);
+#ifdef SCST_USERMODE_ZEROCOPY
+	TRACE(TRACE_MGMT, "conn %p: %lu zerocopy sends, %lu copied by kernel",
+		conn, conn->zc_sends, conn->zc_copied);
+	sBUG_ON(conn->zc_done_seq != conn->zc_next_seq);
+#endif
+#ifdef SCST_USERMODE_RX_BULK
+	TRACE(TRACE_MGMT, "conn %p: %lu PDUs received by %lu recvmsg() calls",
+		conn, conn->rx_pdus, conn->rx_recvs);
+#endif
+#ifdef SCST_USERMODE_TX_GATHER
+	TRACE(TRACE_MGMT, "conn %p: %lu PDUs sent, %lu of them coalesced with "
+		"the next, %lu flushes", conn, conn->tx_pdus, conn->tx_coalesced,
+		conn->tx_flushes);
+#endif
 
 	lockdep_assert_held(&conn->target->target_mutex);
 
@@ -1010,7 +1024,7 @@ int iscsi_init_conn(struct iscsi_session *session,
 		    struct iscsi_kern_conn_info *info,
 		    struct iscsi_conn *conn)
 {
-	int res;
+	int res, i;
 
 	atomic_set(&conn->conn_ref_cnt, 0);
 	conn->session = session;
@@ -1031,6 +1045,8 @@ int iscsi_init_conn(struct iscsi_session *session,
 	conn->target = session->target;
 	spin_lock_init(&conn->cmd_list_lock);
 	INIT_LIST_HEAD(&conn->cmd_list);
+	for (i = 0; i < ARRAY_SIZE(conn->itt_hash); i++)
+		INIT_LIST_HEAD(&conn->itt_hash[i]);
 	spin_lock_init(&conn->write_list_lock);
 	INIT_LIST_HEAD(&conn->write_list);
 	INIT_LIST_HEAD(&conn->write_timeout_list);
@@ -1041,6 +1057,9 @@ int iscsi_init_conn(struct iscsi_session *session,
 	INIT_LIST_HEAD(&conn->nop_req_list);
 	spin_lock_init(&conn->nop_req_list_lock);
 	spin_lock_init(&conn->rd_lock);
+#ifdef SCST_USERMODE_ZEROCOPY
+	spin_lock_init(&conn->zc_lock);
+#endif
 
 	conn->conn_thr_pool = session->sess_thr_pool;
 
@@ -1066,6 +1085,115 @@ int iscsi_init_conn(struct iscsi_session *session,
 }
 EXPORT_SYMBOL(iscsi_init_conn);
 
+#ifdef SCST_USERMODE
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#ifdef SCST_USERMODE_RD_THREADS
+/*
+ * Returns in shard the receive shard of base holding cpu: the CPUs of base
+ * split into iscsi_rd_shards groups, one per CPU by default. A cpu outside
+ * base gets the shards in turn.
+ */
+static void iscsi_rd_shard_mask(const cpumask_t *base, int cpu,
+	cpumask_t *shard)
+{
+	static unsigned int next;	/* racy, but it only spreads sessions */
+	int n = 0, idx = -1, shards, k, i, c;
+
+	for_each_cpu(c, base) {
+		if (c == cpu)
+			idx = n;
+		n++;
+	}
+
+	cpumask_clear(shard);
+	if (n == 0)
+		goto out;
+
+	shards = ((iscsi_rd_shards > 0) && (iscsi_rd_shards < n)) ?
+		 iscsi_rd_shards : n;
+	if (idx < 0)
+		k = next++ % shards;
+	else
+		k = idx * shards / n;
+
+	i = 0;
+	for_each_cpu(c, base) {
+		if (i * shards / n == k)
+			cpumask_set_cpu(c, shard);
+		i++;
+	}
+
+out:
+	return;
+}
+#endif
+
+/*
+ * Moves the session off its thread pool onto the pool of the CPUs closest to
+ * the NIC queue that receives the packets of its first connection, as told
+ * by SO_INCOMING_CPU:
+ *  - on a NUMA host, a session on all CPUs goes to the iSCSI and SCST threads
+ *    of that queue's node, so its data buffers are allocated and used there;
+ *  - with SCST_USERMODE_RD_THREADS, the session's CPUs are narrowed further to
+ *    the receive shard of that CPU, whose read and write threads then serve
+ *    only the connections of their own shard.
+ * Sessions with dedicated threads stay as they are.
+ */
+static void iscsi_sess_place(struct iscsi_session *session,
+	struct iscsi_conn *conn)
+{
+	struct iscsi_thread_pool *p = session->sess_thr_pool, *np = NULL;
+	cpumask_t mask;
+	socklen_t len = sizeof(int);
+	int cpu = -1, node = NUMA_NO_NODE;
+
+	if ((p == NULL) || p->dedicated || !list_empty(&session->conn_list))
+		goto out;
+
+	if ((getsockopt(conn->file->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+			&len) != 0) || (cpu < 0))
+		cpu = -1;
+
+	cpumask_copy(&mask, &p->cpu_mask);
+
+	if ((num_online_nodes() >= 2) && cpumask_full(&p->cpu_mask) &&
+	    (cpu >= 0)) {
+		node = cpu_to_node(cpu);
+		cpumask_copy(&mask, cpumask_of_node(node));
+	}
+
+#ifdef SCST_USERMODE_RD_THREADS
+	{
+		cpumask_t base;
+
+		cpumask_copy(&base, &mask);
+		iscsi_rd_shard_mask(&base, cpu, &mask);
+	}
+#endif
+
+	if (cpumask_equal(&mask, &p->cpu_mask))
+		goto out;
+
+	if ((iscsi_threads_pool_get(false, &mask, &np) != 0) || (np == NULL))
+		goto out;
+
+	session->sess_thr_pool = np;
+	conn->conn_thr_pool = np;
+	iscsi_threads_pool_put(p);
+	if (node != NUMA_NO_NODE)
+		scst_sess_set_numa_node(session->scst_sess, node);
+
+	TRACE(TRACE_MGMT, "Session sid %#Lx placed on pool %p (NUMA node %d, "
+		"CPU %d)", (unsigned long long int)session->sid, np, node, cpu);
+
+out:
+	return;
+}
+#endif
+
 /* target_mutex supposed to be locked */
 int iscsi_conn_alloc(struct iscsi_session *session,
 	struct iscsi_kern_conn_info *info, struct iscsi_conn **new_conn,
@@ -1095,12 +1223,33 @@ int iscsi_conn_alloc(struct iscsi_session *session,
 		goto out_err_free_conn;
 	}
 
+#ifdef SCST_USERMODE_TX_GATHER
+	conn->tx_iov = kmalloc(ISCSI_CONN_TX_IOV_MAX * sizeof(*conn->tx_iov),
+			       GFP_KERNEL);
+	if (conn->tx_iov == NULL) {
+		res = -ENOMEM;
+		goto out_free_iov;
+	}
+#endif
+
+#ifdef SCST_USERMODE_RX_BULK
+	conn->rx_buf = kmalloc(ISCSI_CONN_RX_BUF_SIZE, GFP_KERNEL);
+	if (conn->rx_buf == NULL) {
+		res = -ENOMEM;
+		goto out_free_iov;
+	}
+#endif
+
 	res = iscsi_init_conn(session, info, conn);
 	if (res != 0)
 		goto out_free_iov;
 
 	conn->file = fget(info->fd);
 
+#ifdef SCST_USERMODE
+	iscsi_sess_place(session, conn);
+#endif
+
 	res = conn_setup_sock(conn);
 	if (res != 0)
 		goto out_fput;
@@ -1122,6 +1271,12 @@ out_fput:
 	fput(conn->file);
 
 out_free_iov:
+#ifdef SCST_USERMODE_RX_BULK
+	kfree(conn->rx_buf);
+#endif
+#ifdef SCST_USERMODE_TX_GATHER
+	kfree(conn->tx_iov);
+#endif
 	free_page((unsigned long)conn->read_iov);
 
 out_err_free_conn:
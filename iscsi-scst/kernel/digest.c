@@ -24,9 +24,280 @@
 #include "digest.h"
 #include <linux/crc32c.h>
 
+#ifdef SCST_USERMODE
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/*
+ * Usermode CRC32C: the SSE4.2 crc32 instruction with PCLMUL, if the CPU has
+ * them, otherwise slicing-by-8, selected at startup by iscsi_crc32c_init().
+ */
+#define CRC32C_POLY		0x82f63b78	/* reflected */
+
+/* Block sizes of the 3-way interleaved hardware CRC, multiples of 8 bytes */
+#define CRC32C_HW_BLK_MAX	2048
+#define CRC32C_HW_BLK_MIN	64
+
+static u32 crc32c_sw_table[8][256];
+
+/*
+ * Constants to shift a CRC by 1 and 2 blocks of i*8 bytes with PCLMUL, for
+ * block size i*8, i.e. x^(8*8*i - 33) and x^(2*8*8*i - 33) mod P, see
+ * crc32c_shift().
+ */
+static u64 crc32c_hw_k[CRC32C_HW_BLK_MAX / 8 + 1][2];
+
+static u32 (*crc32c_fn)(u32 crc, void *dst, const void *src, size_t len);
+
+/* Returns a(x) * b(x) mod P, reflected */
+static u32 crc32c_multmodp(u32 a, u32 b)
+{
+	u32 m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* Returns x^n mod P, reflected */
+static u32 crc32c_xpow(u64 n)
+{
+	u32 p = 1U << 31, sq = 1U << 30;	/* x^0 and x^1 */
+
+	while (n != 0) {
+		if (n & 1)
+			p = crc32c_multmodp(sq, p);
+		sq = crc32c_multmodp(sq, sq);
+		n >>= 1;
+	}
+	return p;
+}
+
+/* Slicing-by-8 */
+static u32 crc32c_sw(u32 crc, void *dst, const void *src, size_t len)
+{
+	const u8 *p = src;
+	u8 *d = dst;
+
+	if (d != NULL)
+		memcpy(d, p, len);
+
+	while ((len != 0) && ((unsigned long)p & 7)) {
+		crc = crc32c_sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		u64 v;
+
+		memcpy(&v, p, 8);
+		v = le64_to_cpu(v) ^ crc;
+		crc = crc32c_sw_table[7][v & 0xff] ^
+		      crc32c_sw_table[6][(v >> 8) & 0xff] ^
+		      crc32c_sw_table[5][(v >> 16) & 0xff] ^
+		      crc32c_sw_table[4][(v >> 24) & 0xff] ^
+		      crc32c_sw_table[3][(v >> 32) & 0xff] ^
+		      crc32c_sw_table[2][(v >> 40) & 0xff] ^
+		      crc32c_sw_table[1][(v >> 48) & 0xff] ^
+		      crc32c_sw_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- != 0)
+		crc = crc32c_sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef __x86_64__
+
+#define CRC32C_HW_TARGET	__attribute__((target("sse4.2,pclmul")))
+
+/*
+ * Returns crc shifted over len zero bytes for k = x^(8*len - 33) mod P: the
+ * carry-less product is crc * k * x, the crc32 instruction multiplies it by
+ * x^32 and reduces mod P.
+ */
+static inline CRC32C_HW_TARGET u32 crc32c_shift(u32 crc, u64 k)
+{
+	__m128i v = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+					 _mm_cvtsi64_si128(k), 0);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(v));
+}
+
+static inline CRC32C_HW_TARGET u64 crc32c_hw_load(void *dst,
+	const u8 *src)
+{
+	u64 v;
+
+	memcpy(&v, src, 8);
+	if (dst != NULL)
+		memcpy(dst, &v, 8);
+	return v;
+}
+
+/*
+ * SSE4.2 crc32 instruction has latency of 3 cycles, but throughput of 1 per
+ * cycle, so large buffers are done in 3 interleaved streams over consecutive
+ * blocks, which are then merged by PCLMUL shifts. Copies, if dst not NULL,
+ * in the same pass.
+ */
+static inline __attribute__((always_inline)) CRC32C_HW_TARGET
+u32 __crc32c_hw(u32 crc, u8 *d, const u8 *p, size_t len)
+{
+	while ((len != 0) && ((unsigned long)p & 7)) {
+		if (d != NULL)
+			*d++ = *p;
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+	while (len >= 3 * CRC32C_HW_BLK_MIN) {
+		size_t blk = min_t(size_t, (len / 24) * 8, CRC32C_HW_BLK_MAX);
+		u64 c0 = crc, c1 = 0, c2 = 0;
+		const u8 *end = p + blk;
+
+		for (; p < end; p += 8) {
+			c0 = _mm_crc32_u64(c0, crc32c_hw_load(d, p));
+			c1 = _mm_crc32_u64(c1, crc32c_hw_load(
+				d ? d + blk : NULL, p + blk));
+			c2 = _mm_crc32_u64(c2, crc32c_hw_load(
+				d ? d + 2 * blk : NULL, p + 2 * blk));
+			if (d != NULL)
+				d += 8;
+		}
+		crc = crc32c_shift(c0, crc32c_hw_k[blk / 8][1]) ^
+		      crc32c_shift(c1, crc32c_hw_k[blk / 8][0]) ^ c2;
+		p += 2 * blk;
+		if (d != NULL)
+			d += 2 * blk;
+		len -= 3 * blk;
+	}
+
+	while (len >= 8) {
+		crc = _mm_crc32_u64(crc, crc32c_hw_load(d, p));
+		p += 8;
+		if (d != NULL)
+			d += 8;
+		len -= 8;
+	}
+	while (len-- != 0) {
+		if (d != NULL)
+			*d++ = *p;
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+
+	return crc;
+}
+
+static CRC32C_HW_TARGET u32 crc32c_hw(u32 crc, void *dst, const void *src,
+	size_t len)
+{
+	if (dst == NULL)
+		return __crc32c_hw(crc, NULL, src, len);
+	else
+		return __crc32c_hw(crc, dst, src, len);
+}
+
+#endif /* __x86_64__ */
+
+/*
+ * Selects the fastest CRC32C implementation this CPU can run. The hardware
+ * one is used only if it agrees with the software one.
+ */
+static void crc32c_select(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		u32 c = i;
+
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_sw_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_sw_table[j][i] = crc32c_sw_table[0][
+				crc32c_sw_table[j - 1][i] & 0xff] ^
+				(crc32c_sw_table[j - 1][i] >> 8);
+
+	crc32c_fn = crc32c_sw;
+
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2") &&
+	    __builtin_cpu_supports("pclmul")) {
+		static u8 buf[3 * CRC32C_HW_BLK_MAX + 77], copy[sizeof(buf)];
+		bool ok = true;
+
+		for (i = 1; i <= CRC32C_HW_BLK_MAX / 8; i++) {
+			crc32c_hw_k[i][0] = crc32c_xpow(64ULL * i - 33);
+			crc32c_hw_k[i][1] = crc32c_xpow(128ULL * i - 33);
+		}
+
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = i * 7 + (i >> 8);
+
+		for (i = 0; ok && (i < sizeof(buf) - 1); i += 61) {
+			u32 crc = crc32c_sw(~0, NULL, buf + 1, i);
+
+			ok = (crc32c_hw(~0, NULL, buf + 1, i) == crc) &&
+			     (crc32c_hw(~0, copy, buf + 1, i) == crc) &&
+			     (memcmp(copy, buf + 1, i) == 0);
+		}
+
+		if (ok)
+			crc32c_fn = crc32c_hw;
+		else
+			PRINT_WARNING("%s", "Hardware CRC32C failed self-test, "
+				"using software CRC32C");
+	}
+#endif
+}
+
+void iscsi_crc32c_init(void)
+{
+	crc32c_select();
+#ifdef __x86_64__
+	PRINT_INFO("Using %s CRC32C", (crc32c_fn == crc32c_hw) ?
+		"SSE4.2/PCLMUL" : "software");
+#else
+	PRINT_INFO("%s", "Using software CRC32C");
+#endif
+}
+
+u32 iscsi_crc32c(u32 crc, const void *p, size_t len)
+{
+	return crc32c_fn(crc, NULL, p, len);
+}
+
+/* Copies len bytes from src to dst, computing their CRC32C in the same pass */
+u32 iscsi_crc32c_copy(u32 crc, void *dst, const void *src, size_t len)
+{
+	return crc32c_fn(crc, dst, src, len);
+}
+
+#undef crc32c
+#define crc32c(crc, p, len)	iscsi_crc32c((crc), (p), (len))
+#endif /* SCST_USERMODE */
+
+#if defined(CONFIG_LIBCRC32C_MODULE) || defined(CONFIG_LIBCRC32C) || \
+	defined(SCST_USERMODE)
+#define ISCSI_HAVE_CRC32C
+#endif
+
 void digest_alg_available(int *val)
 {
-#if defined(CONFIG_LIBCRC32C_MODULE) || defined(CONFIG_LIBCRC32C)
+#ifdef ISCSI_HAVE_CRC32C
 	int crc32c = 1;
 #else
 	int crc32c = 0;
@@ -70,7 +341,7 @@ static __be32 evaluate_crc32_from_sg(struct scatterlist *sg, int nbytes,
 	}
 #endif
 
-#if defined(CONFIG_LIBCRC32C_MODULE) || defined(CONFIG_LIBCRC32C)
+#ifdef ISCSI_HAVE_CRC32C
 	{
 		int pad_bytes = ((nbytes + 3) & -4) - nbytes;
 
@@ -206,8 +477,13 @@ int digest_rx_data(struct iscsi_cmnd *cmnd)
 		goto out;
 	}
 
-	crc = digest_data(req, cmnd->pdu.datasize, offset,
-			cmnd->conn->rpadding);
+#ifdef SCST_USERMODE_RX_BULK
+	if (cmnd->rx_ddigest_fused)
+		crc = cmnd->rx_ddigest;
+	else
+#endif
+		crc = digest_data(req, cmnd->pdu.datasize, offset,
+				cmnd->conn->rpadding);
 
 	if (unlikely(crc != cmnd->ddigest)) {
 		PRINT_ERROR("RX data digest failed, stable pages disabled?");
@@ -28,4 +28,10 @@ extern int digest_rx_data(struct iscsi_cmnd *cmnd);
 extern void digest_tx_header(struct iscsi_cmnd *cmnd);
 extern void digest_tx_data(struct iscsi_cmnd *cmnd);
 
+#ifdef SCST_USERMODE
+extern void iscsi_crc32c_init(void);
+extern u32 iscsi_crc32c(u32 crc, const void *p, size_t len);
+extern u32 iscsi_crc32c_copy(u32 crc, void *dst, const void *src, size_t len);
+#endif
+
 #endif /* __ISCSI_DIGEST_H__ */
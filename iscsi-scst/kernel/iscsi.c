@@ -59,6 +59,11 @@ static struct kmem_cache *iscsi_thread_pool_cache;
 
 static struct iscsi_thread_pool *iscsi_main_thread_pool;
 
+#ifdef SCST_USERMODE_RD_THREADS
+/* Number of receive shards per node, 0 for one per CPU (conn.c) */
+int iscsi_rd_shards;
+#endif
+
 struct kmem_cache *iscsi_conn_cache;
 struct kmem_cache *iscsi_sess_cache;
 
@@ -331,6 +336,7 @@ void iscsi_cmnd_init(struct iscsi_conn *conn, struct iscsi_cmnd *cmnd,
 
 		INIT_LIST_HEAD(&cmnd->rsp_cmd_list);
 		INIT_LIST_HEAD(&cmnd->rx_ddigest_cmd_list);
+		INIT_LIST_HEAD(&cmnd->itt_hash_entry);
 		cmnd->target_task_tag = ISCSI_RESERVED_TAG_CPU32;
 
 		spin_lock_bh(&conn->cmd_list_lock);
@@ -351,7 +357,8 @@ struct iscsi_cmnd *cmnd_alloc(struct iscsi_conn *conn,
 	iscsi_cmnd_init(conn, cmnd, parent);
 
 	if (parent == NULL) {
-#if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION)
+#if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION) || \
+    defined(SCST_USERMODE_ZEROCOPY)
 		atomic_set(&cmnd->net_ref_cnt, 0);
 #endif
 	}
@@ -454,6 +461,8 @@ void cmnd_done(struct iscsi_cmnd *cmnd)
 
 		spin_lock_bh(&conn->cmd_list_lock);
 		list_del(&cmnd->cmd_list_entry);
+		if (!list_empty(&cmnd->itt_hash_entry))
+			list_del(&cmnd->itt_hash_entry);
 		spin_unlock_bh(&conn->cmd_list_lock);
 
 		conn_put(conn);
@@ -1328,12 +1337,31 @@ static void update_stat_sn(struct iscsi_cmnd *cmnd)
 	return;
 }
 
+/*
+ * Makes a SCSI command request findable by its ITT. Called once its BHS
+ * has been received, cmd_list itself is filled before the ITT is known.
+ */
+static void cmnd_insert_itt_hash(struct iscsi_cmnd *cmnd)
+{
+	struct iscsi_conn *conn = cmnd->conn;
+	__be32 itt = cmnd->pdu.bhs.itt;
+
+	spin_lock_bh(&conn->cmd_list_lock);
+	list_add_tail(&cmnd->itt_hash_entry,
+		&conn->itt_hash[cmnd_hashfn((__force u32)itt)]);
+	spin_unlock_bh(&conn->cmd_list_lock);
+	return;
+}
+
 static struct iscsi_cmnd *cmnd_find_itt_get(struct iscsi_conn *conn, __be32 itt)
 {
 	struct iscsi_cmnd *cmnd, *found_cmnd = NULL;
+	struct list_head *head;
+
+	head = &conn->itt_hash[cmnd_hashfn((__force u32)itt)];
 
 	spin_lock_bh(&conn->cmd_list_lock);
-	list_for_each_entry(cmnd, &conn->cmd_list, cmd_list_entry) {
+	list_for_each_entry(cmnd, head, itt_hash_entry) {
 		if ((cmnd->pdu.bhs.itt == itt) && !cmnd_get_check(cmnd)) {
 			found_cmnd = cmnd;
 			break;
@@ -3242,6 +3270,7 @@ int cmnd_rx_start(struct iscsi_cmnd *cmnd)
 
 	switch (cmnd_opcode(cmnd)) {
 	case ISCSI_OP_SCSI_CMD:
+		cmnd_insert_itt_hash(cmnd);
 		res = scsi_cmnd_start(cmnd);
 		if (unlikely(res < 0))
 			goto out;
@@ -3390,7 +3419,8 @@ static void iscsi_tcp_preprocessing_done(struct iscsi_cmnd *req)
 		cmnd_get(req);
 		req->scst_state = ISCSI_CMD_STATE_AFTER_PREPROC;
 
-#ifndef CONN_LOCAL_READ			/* try reading data from pp_done callback */
+#if !defined(CONN_LOCAL_READ) || defined(SCST_USERMODE_RD_THREADS)
+		/* Leave the read to the conn's read thread */
 		iscsi_make_conn_rd_active(req->conn);
 #else
 		conn_rd_lock(req->conn);
@@ -3460,6 +3490,9 @@ static void iscsi_try_local_processing(struct iscsi_cmnd *req)
 			if (rc <= 0)
 				break;
 		} while (req->not_processed_rsp_cnt != 0);
+#ifdef SCST_USERMODE_TX_GATHER
+		iscsi_tx_flush(conn);
+#endif
 
 		spin_lock_bh(&p->wr_lock);
 #ifdef CONFIG_SCST_EXTRACHECKS
@@ -4310,7 +4343,7 @@ create:
 
 	list_add_tail(&p->thread_pools_list_entry, &iscsi_thread_pools_list);
 
-#ifdef SCST_USERMODE			/* only create writer threads */
+#if defined(SCST_USERMODE) && !defined(SCST_USERMODE_RD_THREADS)
 	j = 1;		    /* only create writer threads */
 #else
 	j = 0;		    /* create reader and writer threads */
@@ -4379,6 +4412,23 @@ static int __init iscsi_init(void)
 	sg_init_table(&dummy_sg, 1);
 	sg_set_page(&dummy_sg, dummy_page, PAGE_SIZE, 0);
 
+#ifdef SCST_USERMODE
+	iscsi_crc32c_init();
+#endif
+
+#ifdef SCST_USERMODE_RD_THREADS
+	{
+		const char *env = getenv("SCSTU_ISCSI_RD_SHARDS");
+		unsigned long v;
+
+		if ((env != NULL) && (kstrtoul(env, 0, &v) == 0) &&
+		    (v <= INT_MAX))
+			iscsi_rd_shards = v;
+		PRINT_INFO("iSCSI receive shards: %d%s", iscsi_rd_shards,
+			   iscsi_rd_shards ? "" : " (one per CPU)");
+	}
+#endif
+
 	iscsi_cmnd_abort_mempool = mempool_create_kmalloc_pool(2500,
 		sizeof(struct iscsi_cmnd_abort_params));
 	if (iscsi_cmnd_abort_mempool == NULL) {
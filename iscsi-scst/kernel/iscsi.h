@@ -133,6 +133,16 @@ struct iscsi_target {
 
 	unsigned int tgt_enabled:1;
 
+#ifdef SCST_USERMODE_TX_GATHER
+	/*
+	 * Response coalescing tunables, read locklessly by the write threads:
+	 * a PDU is held back with MSG_MORE while more PDUs are queued on its
+	 * connection, up to tx_coalesce_pdus PDUs or tx_coalesce_bytes bytes.
+	 */
+	unsigned int tx_coalesce_pdus;
+	unsigned int tx_coalesce_bytes;
+#endif
+
 #ifndef CONFIG_SCST_PROC
 	/* Protected by target_mutex */
 	struct list_head attrs_list;
@@ -198,6 +208,44 @@ struct iscsi_session {
 
 #define ISCSI_CONN_IOV_MAX			(PAGE_SIZE/sizeof(struct iovec))
 
+#ifdef SCST_USERMODE_TX_GATHER
+/* BHS + header digest + data pages (+1 if unaligned) + padding + data digest */
+#define ISCSI_CONN_TX_IOV_MAX			(ISCSI_CONN_IOV_MAX + 5)
+/* Defaults of the per-target response coalescing limits, see iscsi_tx_coalesce() */
+#define ISCSI_TX_COALESCE_PDUS			16
+#define ISCSI_TX_COALESCE_BYTES			(64 * 1024)
+#endif
+
+#ifdef SCST_USERMODE_RX_BULK
+/* Bytes asked from the socket by each recvmsg() into the rx_buf */
+#define ISCSI_CONN_RX_BUF_SIZE			(256 * 1024)
+/* Larger rests of a PDU are received directly into their buffers */
+#define ISCSI_RX_DIRECT_MIN_SIZE		(64 * 1024)
+#endif
+
+#ifdef SCST_USERMODE_ZEROCOPY
+#ifndef SCST_USERMODE_TX_GATHER
+#error SCST_USERMODE_ZEROCOPY requires SCST_USERMODE_TX_GATHER
+#endif
+/* MSG_ZEROCOPY sends per connection awaiting completion (power of 2) */
+#define ISCSI_CONN_ZC_RING_SIZE			256
+/* Smaller PDUs are cheaper to copy than to pin and complete */
+#define ISCSI_ZEROCOPY_MIN_SIZE			(16 * 1024)
+/* In case the system headers predate Linux 4.14 */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY				60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY				0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY			5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED		1
+#endif
+#endif
+
 #define ISCSI_CONN_RD_STATE_IDLE		0
 #define ISCSI_CONN_RD_STATE_IN_LIST		1
 #define ISCSI_CONN_RD_STATE_PROCESSING		2
@@ -227,6 +275,12 @@ struct iscsi_conn {
 	/* Protected by cmd_list_lock */
 	struct list_head cmd_list; /* in/outcoming pdus */
 
+	/*
+	 * SCSI command requests of cmd_list by ITT, for task management.
+	 * Protected by cmd_list_lock.
+	 */
+	struct list_head itt_hash[1 << ISCSI_HASH_ORDER];
+
 	atomic_t conn_ref_cnt;
 
 	spinlock_t write_list_lock;
@@ -263,6 +317,43 @@ struct iscsi_conn {
 	u32 write_size;
 	u32 write_offset;
 	int write_state;
+#ifdef SCST_USERMODE_TX_GATHER
+	/* Whole PDU gathered for a single sendmsg() */
+	struct iovec *tx_iov;
+	int tx_iov_idx;			/* first entry not yet fully sent */
+	int tx_iov_cnt;			/* entries in use */
+	u32 tx_size;			/* bytes remaining to send */
+	/* Response coalescing, see iscsi_tx_coalesce() */
+	unsigned int tx_more:1;		/* send the current PDU with MSG_MORE */
+	u32 tx_held_pdus;		/* PDUs sent with MSG_MORE since a push */
+	u32 tx_held_bytes;
+	/* stats */
+	unsigned long tx_pdus;		/* PDUs sent gathered */
+	unsigned long tx_coalesced;	/* of which sent with MSG_MORE */
+	unsigned long tx_flushes;	/* pushes forced when going idle */
+#endif
+#ifdef SCST_USERMODE_ZEROCOPY
+	/*
+	 * Commands whose data are pinned by MSG_ZEROCOPY sends, indexed by
+	 * the send's completion sequence number. Protected by zc_lock.
+	 */
+	spinlock_t zc_lock;
+	struct iscsi_cmnd *zc_ring[ISCSI_CONN_ZC_RING_SIZE];
+	u32 zc_next_seq;		/* seq of the next zerocopy send */
+	u32 zc_done_seq;		/* oldest seq not yet completed */
+	unsigned int zc_enabled:1;	/* SO_ZEROCOPY set on the socket */
+	/*
+	 * tx_iov entries [tx_data_first, tx_data_end) hold the SG data, the
+	 * only part of a PDU sent with MSG_ZEROCOPY: the header, digests and
+	 * padding live in the response cmnd, freed without waiting for the
+	 * zerocopy completion, so they are always copied.
+	 */
+	int tx_data_first;
+	int tx_data_end;
+	/* stats */
+	unsigned long zc_sends;
+	unsigned long zc_copied;	/* completions reporting a copy */
+#endif
 
 	/* Both don't need any protection */
 	struct file *file;
@@ -294,18 +385,6 @@ struct iscsi_conn {
 	#define conn_rd_lock(conn)	spin_lock_bh(  &(conn)->rd_lock)
 	#define conn_rd_unlock(conn)	spin_unlock_bh(&(conn)->rd_lock)
 
-#ifdef ADAPTIVE_NAGLE
-	uint8_t tcp_nagle;		/* current socket TCP_NODELAY state */
-	unsigned long cpu_busy_count[4];    /* reads done in IDLE-BUSY cycle */
-	unsigned int cpu_busy_idx;
-	/* stats */
-	unsigned long cpu_idles;	    /* since last stats print */
-	unsigned long max_cpu_busy_count;   /* since last stats print */
-	unsigned long stat_cpu_busy_count;  /* since last stats print */
-	unsigned long read_nodelay;	    /* reads done while NODELAY set */
-	unsigned long read_nagle;	    /* reads done while NODELAY unset */
-#endif
-
 	struct list_head rd_list_entry;
 
 #ifdef CONFIG_SCST_EXTRACHECKS
@@ -329,6 +408,18 @@ struct iscsi_conn {
 #endif
 	struct task_struct *rx_task;
 	uint32_t rpadding;
+#ifdef SCST_USERMODE_RX_BULK
+	/* Received, but not yet parsed bytes are rx_buf[rx_head..rx_tail) */
+	char *rx_buf;
+	u32 rx_head;
+	u32 rx_tail;
+	/* Data digest of the PDU being received, while rx_crc_on */
+	u32 rx_crc;
+	unsigned int rx_crc_on:1;
+	/* stats */
+	unsigned long rx_recvs;		/* recvmsg() calls */
+	unsigned long rx_pdus;		/* PDUs received */
+#endif
 
 	struct iscsi_target *target;
 
@@ -423,6 +514,10 @@ struct iscsi_cmnd {
 	unsigned int force_cleanup_done:1;
 	unsigned int dec_active_cmds:1;
 	unsigned int ddigest_checked:1;
+#ifdef SCST_USERMODE_RX_BULK
+	/* rx_ddigest was computed while the data were received */
+	unsigned int rx_ddigest_fused:1;
+#endif
 	/*
 	 * Used to prevent release of original req while its related DATA OUT
 	 * cmd is receiving data, i.e. stays between data_out_start() and
@@ -522,7 +617,8 @@ struct iscsi_cmnd {
 	};
 
 	atomic_t ref_cnt;
-#if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION)
+#if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION) || \
+    defined(SCST_USERMODE_ZEROCOPY)
 	atomic_t net_ref_cnt;
 #endif
 
@@ -538,8 +634,12 @@ struct iscsi_cmnd {
 	u32 target_task_tag;
 	__be32 hdigest;
 	__be32 ddigest;
+#ifdef SCST_USERMODE_RX_BULK
+	__be32 rx_ddigest;
+#endif
 
 	struct list_head cmd_list_entry;
+	struct list_head itt_hash_entry;
 	struct list_head nop_req_list_entry;
 
 	unsigned int not_received_data_len;
@@ -589,6 +689,9 @@ extern int set_scst_preliminary_status_rsp(struct iscsi_cmnd *req,
 extern int iscsi_threads_pool_get(bool dedicated, const cpumask_t *cpu_mask,
 	struct iscsi_thread_pool **out_pool);
 extern void iscsi_threads_pool_put(struct iscsi_thread_pool *p);
+#ifdef SCST_USERMODE_RD_THREADS
+extern int iscsi_rd_shards;
+#endif
 
 /* conn.c */
 #ifndef CONFIG_SCST_PROC
@@ -614,10 +717,16 @@ extern void __iscsi_write_space_ready(struct iscsi_conn *conn);
 
 /* nthread.c */
 extern int iscsi_send(struct iscsi_conn *conn);
+#ifdef SCST_USERMODE_TX_GATHER
+extern void iscsi_tx_flush(struct iscsi_conn *conn);
+#endif
 #if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION)
 extern void iscsi_get_page_callback(struct page *page);
 extern void iscsi_put_page_callback(struct page *page);
 #endif
+#ifdef SCST_USERMODE_ZEROCOPY
+extern void iscsi_zc_reap(struct iscsi_conn *conn, bool force);
+#endif
 extern int scst_try_one_rd(struct iscsi_conn * conn);
 extern int istrd(void *arg);
 extern int istwr(void *arg);
@@ -28,6 +28,9 @@
 #include "iscsi_trace_flag.h"
 #include "iscsi.h"
 #include "digest.h"
+#ifdef SCST_USERMODE_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
 
 /* Read data states */
 enum rx_state {
@@ -54,6 +57,9 @@ enum tx_state {
 	TX_INIT_DDIGEST,
 	TX_DDIGEST,
 	TX_END,
+#ifdef SCST_USERMODE_TX_GATHER
+	TX_GATHERED,
+#endif
 };
 
 #if defined(CONFIG_TCP_ZERO_COPY_TRANSFER_COMPLETION_NOTIFICATION)
@@ -164,6 +170,15 @@ out:
 	TRACE_EXIT();
 	return;
 }
+#elif defined(SCST_USERMODE_ZEROCOPY)
+static void iscsi_check_closewait(struct iscsi_conn *conn)
+{
+	/*
+	 * Once the socket is closed the kernel has dropped its references to
+	 * our pages, whether or not we have seen the notifications for them.
+	 */
+	iscsi_zc_reap(conn, conn->sock->sk->sk_state == TCP_CLOSE);
+}
 #else
 static inline void iscsi_check_closewait(struct iscsi_conn *conn) {};
 #endif
@@ -531,6 +546,15 @@ static void close_conn(struct iscsi_conn *conn)
 			__iscsi_write_space_ready(conn);
 
 			iscsi_check_closewait(conn);
+#ifdef SCST_USERMODE_ZEROCOPY
+			/*
+			 * The emulated sk_state might never reach TCP_CLOSE,
+			 * but after iscsit_conn_close() nothing more can be
+			 * sent, so don't let the pins hold conn_ref_cnt.
+			 */
+			if (shut_expired)
+				iscsi_zc_reap(conn, true);
+#endif
 		}
 	}
 
@@ -637,6 +661,20 @@ static inline void iscsi_conn_init_read(struct iscsi_conn *conn,
 	return;
 }
 
+/* Enters RX_DATA state, in which the PDU's data are received */
+static inline void iscsi_conn_rx_data(struct iscsi_conn *conn)
+{
+	conn->read_state = RX_DATA;
+#ifdef SCST_USERMODE_RX_BULK
+	/* Compute the data digest while copying the data from rx_buf */
+	if ((conn->ddigest_type & DIGEST_NONE) == 0) {
+		conn->rx_crc = ~0;
+		conn->rx_crc_on = 1;
+	}
+#endif
+	return;
+}
+
 static void iscsi_conn_prepare_read_ahs(struct iscsi_conn *conn,
 	struct iscsi_cmnd *cmnd)
 {
@@ -690,6 +728,117 @@ out:
 }
 EXPORT_SYMBOL(iscsi_get_send_cmnd);
 
+#ifdef SCST_USERMODE_RX_BULK
+/*
+ * Copies bytes from conn->rx_buf into the buffers of the current receive.
+ * Returns number of bytes left to receive.
+ */
+static int iscsi_rx_buf_copy(struct iscsi_conn *conn)
+{
+	struct msghdr *msg = &conn->read_msg;
+	u32 avail = conn->rx_tail - conn->rx_head;
+	int res;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	size_t n = min_t(size_t, avail, msg->msg_iter.count);
+
+	if (n != 0) {
+		if (conn->rx_crc_on)
+			conn->rx_crc = iscsi_crc32c(conn->rx_crc,
+					conn->rx_buf + conn->rx_head, n);
+		copy_to_iter(conn->rx_buf + conn->rx_head, n, &msg->msg_iter);
+		conn->rx_head += n;
+	}
+	res = msg->msg_iter.count;
+#else
+	/* Adjust msg_iov and msg_iovlen as sock_recvmsg() does */
+	while ((avail != 0) && (conn->read_size != 0)) {
+		struct iovec *iov = msg->msg_iov;
+		size_t n = min_t(size_t, avail, iov->iov_len);
+
+		if (conn->rx_crc_on)
+			conn->rx_crc = iscsi_crc32c_copy(conn->rx_crc,
+				iov->iov_base, conn->rx_buf + conn->rx_head, n);
+		else
+			memcpy(iov->iov_base, conn->rx_buf + conn->rx_head, n);
+		iov->iov_base += n;
+		iov->iov_len -= n;
+		conn->rx_head += n;
+		conn->read_size -= n;
+		avail -= n;
+		if ((iov->iov_len == 0) && (conn->read_size != 0)) {
+			msg->msg_iov++;
+			msg->msg_iovlen--;
+		}
+	}
+	res = conn->read_size;
+#endif
+
+	if (conn->rx_head == conn->rx_tail) {
+		conn->rx_head = 0;
+		conn->rx_tail = 0;
+	}
+	return res;
+}
+
+/*
+ * Receives from the socket into conn->rx_buf as much as it holds, up to
+ * ISCSI_CONN_RX_BUF_SIZE, then takes from there data for the current receive,
+ * so with small PDUs a single recvmsg() brings several of them. Returns
+ * number of bytes left to receive or <0 for error. If that is at least
+ * ISCSI_RX_DIRECT_MIN_SIZE and the data digest isn't computed on the fly,
+ * rx_buf is empty and the caller should receive the rest directly.
+ */
+static int iscsi_rx_bulk(struct iscsi_conn *conn)
+{
+	int res, left;
+
+	left = iscsi_rx_buf_copy(conn);
+
+	while ((left != 0) &&
+	       ((left < ISCSI_RX_DIRECT_MIN_SIZE) || conn->rx_crc_on)) {
+		EXTRACHECKS_BUG_ON(conn->rx_tail != 0);
+
+		conn->rx_recvs++;
+		res = (int)UMC_kernelize64(recv(conn->file->fd, conn->rx_buf,
+			ISCSI_CONN_RX_BUF_SIZE, MSG_DONTWAIT | MSG_NOSIGNAL));
+		TRACE_DBG("conn %p, left %d, res %d", conn, left, res);
+
+		if (res > 0) {
+			conn->rx_tail = res;
+			left = iscsi_rx_buf_copy(conn);
+			/* Short read, the socket is drained */
+			if (res < ISCSI_CONN_RX_BUF_SIZE)
+				break;
+			continue;
+		}
+
+		switch (res) {
+		case -EAGAIN:
+			TRACE_DBG("EAGAIN received for conn %p", conn);
+			goto out_left;
+		case -EINTR:
+			continue;
+		default:
+			if (!conn->closing) {
+				PRINT_ERROR("recvmsg() failed: %d (conn %p)",
+					res, conn);
+				mark_conn_closed(conn);
+			}
+			if (res == 0)
+				res = -EIO;
+			goto out;
+		}
+	}
+
+out_left:
+	res = left;
+
+out:
+	return res;
+}
+#endif
+
 /* Returns number of bytes left to receive or <0 for error */
 static int do_recv(struct iscsi_conn *conn)
 {
@@ -715,6 +864,13 @@ static int do_recv(struct iscsi_conn *conn)
 	 * it again.
 	 */
 
+#ifdef SCST_USERMODE_RX_BULK
+	res = iscsi_rx_bulk(conn);
+	if ((res < ISCSI_RX_DIRECT_MIN_SIZE) || conn->rx_crc_on)
+		goto out;
+	/* Large rest of a Data-Out payload, receive it directly */
+#endif
+
 restart:
 	msg = &conn->read_msg;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
@@ -725,6 +881,9 @@ restart:
 	first_len = first_iov->iov_len;
 #endif
 
+#ifdef SCST_USERMODE_RX_BULK
+	conn->rx_recvs++;
+#endif
 	oldfs = get_fs();
 	set_fs(get_ds());
 	res = sock_recvmsg(conn->sock, msg,
@@ -791,11 +950,16 @@ static int iscsi_rx_check_ddigest(struct iscsi_conn *conn)
 	if (res == 0) {
 		conn->read_state = RX_END;
 
+#ifdef SCST_USERMODE_RX_BULK
+		if ((cmnd->pdu.datasize <= 16*1024) || cmnd->rx_ddigest_fused) {
+#else
 		if (cmnd->pdu.datasize <= 16*1024) {
+#endif
 			/*
 			 * It's cache hot, so let's compute it inline. The
 			 * choice here about what will expose more latency:
 			 * possible cache misses or the digest calculation.
+			 * If computed while received, only compare it.
 			 */
 			TRACE_DBG("cmnd %p, opcode %x: checking RX "
 				"ddigest inline", cmnd, cmnd_opcode(cmnd));
@@ -900,7 +1064,7 @@ static int process_read_io(struct iscsi_conn *conn, int *closed)
 				if (cmnd->pdu.datasize == 0)
 					conn->read_state = RX_END;
 				else
-					conn->read_state = RX_DATA;
+					iscsi_conn_rx_data(conn);
 			} else if (res > 0)
 				conn->read_state = RX_CMD_CONTINUE;
 			else
@@ -921,7 +1085,7 @@ static int process_read_io(struct iscsi_conn *conn, int *closed)
 				if (cmnd->pdu.datasize == 0)
 					conn->read_state = RX_END;
 				else
-					conn->read_state = RX_DATA;
+					iscsi_conn_rx_data(conn);
 			}
 			break;
 
@@ -956,6 +1120,9 @@ static int process_read_io(struct iscsi_conn *conn, int *closed)
 			}
 			conn->read_cmnd = NULL;
 			conn->read_state = RX_INIT_BHS;
+#ifdef SCST_USERMODE_RX_BULK
+			conn->rx_pdus++;
+#endif
 
 			cmnd_rx_end(cmnd);
 
@@ -994,6 +1161,14 @@ static int process_read_io(struct iscsi_conn *conn, int *closed)
 			break;
 
 		case RX_INIT_DDIGEST:
+#ifdef SCST_USERMODE_RX_BULK
+			if (conn->rx_crc_on) {
+				conn->rx_crc_on = 0;
+				cmnd->rx_ddigest =
+					(__force __be32)~cpu_to_le32(conn->rx_crc);
+				cmnd->rx_ddigest_fused = 1;
+			}
+#endif
 			iscsi_conn_init_read(conn, &cmnd->ddigest, sizeof(u32));
 			conn->read_state = RX_CHECK_DDIGEST;
 			/* go through */
@@ -1039,131 +1214,6 @@ out:
 	return res;
 }
 
-#ifdef ADAPTIVE_NAGLE	    /* Dynamically enable and disable Nagle mode */
-
-/* XXX I expect the ADAPTIVE_NAGLE logic to require some modification to work
- * well when SCST is resident in the kernel and the scst_do_job_rd() function is
- * in use; because in that configuration one thread can service multiple
- * sessions from that function, only going to sleep (and subsequently incurring
- * the scheduling latency) when all sessions become idle concurrently.
- *
- * The algorithm here assumes the differing model seen in the usermode build,
- * where there is one Session Thread per session, which sleeps when the session
- * is idle.  I *would* expect the logic here to show the same benefit in the
- * kernel for the case where the server is handling a single session using a
- * single reader thread.
- *
- * Probably the algorithm could be modified to also handle the shared session-
- * thread model used in the kernel.  I would expect its benefits to be most
- * visible in kernel-based SCST when running a single session to the target.
- */
-#ifndef SCST_USERMODE
-#warning ADAPTIVE_NAGLE being compiled without SCST_USERMODE (success unlikely)
-#endif
-
-/* TUNE: These affect workloads with a CPU-bound Session Thread.  Tuned for
- * reasonable behavior at all three CPU-bound I/O sizes (512, 1024, 1536 byte)
- * using single-session Read over 1Gb Ethernet MTU=9000 CPU 2400 MHz.  Some
- * compromise between I/O sizes in the tuning, leaving room for more clever
- * decision criteria.  I would not expect it to depend on network bandwidth or
- * CPU speed, as those seem inherent in the "CPU-bound" test.  Probably these
- * should be adjustable via sysfs/procfs.  XXX
- *
- * nagle_threshold = 0	implies always running in Nagle mode, NO flush on IDLE
- *
- * nagle_threshold = 1 and
- * nagle_margin = 0	implies always running in Nagle mode, flush on IDLE
- *
- * nagle_threshold > 1	implies sometimes running in Nagle mode
- *
- * nagle_threshold = oo	implies never running in Nagle mode
- */
-static unsigned long nagle_threshold = 96;  /* count to enter Nagle mode */
-static unsigned long nagle_margin = 40;	    /* additional count to stay there */
-
-/* Set Adaptive Nagle parameters for test purposes */
-static unsigned char params_set = 0;
-static inline void set_params(void)
-{
-	if (params_set) return;
-	params_set = 1;
-
-	string_t s1;
-	if ((s1=getenv("nagle_threshold"))) nagle_threshold = atol(s1);
-	PRINT_INFO("nagle_threshold=%lu", nagle_threshold);
-	if ((s1=getenv("nagle_margin"))) nagle_margin = atol(s1);
-	PRINT_INFO("nagle_margin=%lu", nagle_margin);
-}
-
-/* Disable Nagle's algorithm */
-static inline void enable_tcp_nodelay(struct socket * sock)
-{
-	mm_segment_t const oldfs = get_fs();
-	set_fs(get_ds());
-	int opt = 1;
-	sock->ops->setsockopt(sock, SOL_TCP, TCP_NODELAY,
-			      (void __force __user *)&opt, sizeof(opt));
-	set_fs(oldfs);
-}
-
-/* Enable Nagle's algorithm */
-static inline void disable_tcp_nodelay(struct socket * sock)
-{
-	mm_segment_t const oldfs = get_fs();
-	set_fs(get_ds());
-	int opt = 0;
-	sock->ops->setsockopt(sock, SOL_TCP, TCP_NODELAY,
-			      (void __force __user *)&opt, sizeof(opt));
-	set_fs(oldfs);
-}
-
-/* conn->cpu_busy_count[] holds the maximum busy_counts attained by the last few
- * IDLE-BUSY cycles.  cpu_busy_idx points at the "current" count, with counts of
- * prior cycles recorded circularly in the array starting from there.
- *
- * cpu_busy_count_ptr(conn, 0) returns a pointer to the count for the current
- * cycle; cpu_busy_count_ptr(conn, 1) for the last previous cycle, etc.
- */
-static inline uint64_t * cpu_busy_count_ptr(struct iscsi_conn * conn, unsigned int idx)
-{
-    assert(idx < ARRAY_SIZE(conn->cpu_busy_count));
-    return &conn->cpu_busy_count[(conn->cpu_busy_idx + idx) % ARRAY_SIZE(conn->cpu_busy_count)];
-}
-
-/* Return the busy_count for the current IDLE-BUSY cycle */
-static inline uint64_t cpu_busy_count_get(struct iscsi_conn * conn)
-{
-    return *cpu_busy_count_ptr(conn, 0);
-}
-
-/* Increment and return the busy_count for the current IDLE-BUSY cycle */
-static inline uint64_t cpu_busy_count_incr(struct iscsi_conn * conn)
-{
-    return ++*cpu_busy_count_ptr(conn, 0);
-}
-
-/* Advance circular history index for a new IDLE-BUSY cycle -- decrementing it
- * so positive offsets from it refer to increasingly remote cycles.
- */
-static inline void cpu_busy_count_new(struct iscsi_conn * conn)
-{
-    conn->cpu_busy_idx = (conn->cpu_busy_idx ?: ARRAY_SIZE(conn->cpu_busy_count)) - 1;
-    *cpu_busy_count_ptr(conn, 0) = 0;
-}
-
-/* Return the average busy count of the last few IDLE-BUSY cycles */
-static inline uint64_t cpu_busy_count_avg(struct iscsi_conn * conn)
-{
-    uint64_t sum = 0;
-    int i;
-    for (i = 0; i < ARRAY_SIZE(conn->cpu_busy_count); i++) {
-	sum += *cpu_busy_count_ptr(conn, i);
-    }
-    return sum / ARRAY_SIZE(conn->cpu_busy_count);
-}
-
-#endif
-
 /* Called under CONN->rd_lock and BHs disabled, but will drop it inside, then
  * reacquire.  Returns -1 if conn closed (if so do not reference it further).
  *
@@ -1205,16 +1255,18 @@ int scst_try_one_rd(struct iscsi_conn * conn)
 #endif
 	conn_rd_unlock(conn);	/* we own conn read by _STATE_PROCESSING now */
 
-#ifdef ADAPTIVE_NAGLE
-	set_params();		//XXX
-#endif
-
 	rc = process_read_io(conn, &closed);
 		/*** Note that conn may now no longer exist ***/
 
 	if (unlikely(closed)) return -1;
 	/* conn still exists */
 
+#ifdef SCST_USERMODE_ZEROCOPY
+	/* Release Data-In buffers the initiator has acknowledged by now */
+	if (conn->zc_done_seq != conn->zc_next_seq)
+		iscsi_zc_reap(conn, false);
+#endif
+
 	conn_rd_lock(conn);	/* relock the conn */
 
 	if (unlikely(conn->conn_tm_active)) {
@@ -1231,68 +1283,8 @@ int scst_try_one_rd(struct iscsi_conn * conn)
 	/* Modify state from PROCESSING and return held lock to caller */
 	if ((rc == 0) || conn->rd_data_ready) {	    /*** Received a message ***/
 	    conn->rd_state = rd_state_previous;
-#ifdef ADAPTIVE_NAGLE
-	    cpu_busy_count_incr(conn);	/* tally another read since last idle */
-	    /* highest number of ops between two idles since last stat print */
-	    if (conn->max_cpu_busy_count < cpu_busy_count_get(conn)) {
-		conn->max_cpu_busy_count = cpu_busy_count_get(conn);
-	    }
-	    ++conn->stat_cpu_busy_count;    /* another read since stat print */
-	    if (conn->tcp_nagle) {
-		/* tally another read in Nagle mode since last stat print */
-		++conn->read_nagle;
-	    } else {
-		/* tally another read in NODELAY mode since last stat print */
-		++conn->read_nodelay;
-		/* We are currently in NODELAY mode -- if we seem to be
-		 * streaming, enable Nagle's algorithm, which will remain
-		 * enabled until the next time we go idle wanting another
-		 * incoming request.  Until then the Session Thread will be
-		 * CPU-bound.
-		 *
-		 * To avoid entering Nagle mode too early due to spikes in the
-		 * busy_count:  not only must we cross the threshold, the
-		 * previous few cycles must have averaged at least half the
-		 * threshold.
-		 *
-		 * XXX BUG: cycles that started in Nagle mode from the outset
-		 * should count all their cycles against the margin, which is
-		 * the survival count needed while running in Nagle mode to stay
-		 * there when going IDLE.
-		 */
-		if (cpu_busy_count_get(conn) >= nagle_threshold &&
-			(nagle_threshold == 0 ||
-			    cpu_busy_count_avg(conn) >= (nagle_threshold + nagle_margin) / 2)) {
-		    disable_tcp_nodelay(conn->sock);	/* enable Nagle's algorithm */
-		    conn->tcp_nagle = 1;
-		}
-	    }
-#endif
 	} else {				    /*** Awaiting a message ***/
 	    conn->rd_state = ISCSI_CONN_RD_STATE_IDLE;
-#ifdef ADAPTIVE_NAGLE
-	    /* End of a string of work -- flush any partial output packets */
-	    if (conn->tcp_nagle && nagle_threshold > 0) {
-		/* Disable Nagle and flush accumulating partial packet */
-		enable_tcp_nodelay(conn->sock);
-		/* This uses memory of last few IDLE-BUSY cycles to facilitate
-		 * early return to Nagle mode of a generally-CPU-bound stream
-		 * resuming after a temporary interruption.  Often there will be
-		 * a pattern with most of QD arriving in one cycle and one or
-		 * two other OPs arriving in a cycle by themselves.  If this
-		 * cycle or any of the last few cycles survived *beyond the
-		 * margin* after Nagle's mode was enabled, leave it enabled so
-		 * the next cycle will begin with it that way from the outset.
-		 */
-		if (	    *cpu_busy_count_ptr(conn, 0) >= nagle_threshold + nagle_margin ||
-			    *cpu_busy_count_ptr(conn, 1) >= nagle_threshold + nagle_margin ||
-			    *cpu_busy_count_ptr(conn, 2) >= nagle_threshold + nagle_margin) {
-		    disable_tcp_nodelay(conn->sock);	/* reenable Nagle */
-		} else conn->tcp_nagle = 0;
-	    }
-	    ++conn->cpu_idles;	      /* idle periods since last stats print */
-	    cpu_busy_count_new(conn); /* advance the busy_count history index */
-#endif
 	}
 
 	TRACE_EXIT();
@@ -1308,7 +1300,9 @@ static void scst_do_job_rd(struct iscsi_thread_pool *p)
 	__releases(&rd_lock)
 {
 	TRACE_ENTRY();
+#ifndef SCST_USERMODE_RD_THREADS
 	SCST_USERMODE_NOT();
+#endif
 	/*
 	 * We delete/add to tail connections to maintain fairness between them.
 	 *
@@ -1466,6 +1460,193 @@ static void check_net_priv(struct iscsi_cmnd *cmd, struct page *page)
 	}
 	return;
 }
+#elif defined(SCST_USERMODE_ZEROCOPY)
+/*
+ * Usermode has no page callbacks: net_ref_cnt is taken per MSG_ZEROCOPY send
+ * and dropped when the socket error queue reports that send completed.
+ */
+static inline void __iscsi_get_page_callback(struct iscsi_cmnd *cmd)
+{
+	TRACE_NET_PAGE("cmd %p, new net_ref_cnt %d",
+		cmd, atomic_read(&cmd->net_ref_cnt)+1);
+
+	if (atomic_inc_return(&cmd->net_ref_cnt) == 1) {
+		TRACE_NET_PAGE("getting cmd %p", cmd);
+		cmnd_get(cmd);
+	}
+}
+
+static inline void __iscsi_put_page_callback(struct iscsi_cmnd *cmd)
+{
+	TRACE_NET_PAGE("cmd %p, new net_ref_cnt %d", cmd,
+		atomic_read(&cmd->net_ref_cnt)-1);
+
+	if (atomic_dec_and_test(&cmd->net_ref_cnt))
+		cmnd_put(cmd);
+}
+
+static inline void check_net_priv(struct iscsi_cmnd *cmd, struct page *page) {}
+
+/* Advance zc_done_seq past completed slots. Called under zc_lock. */
+static inline void iscsi_zc_advance(struct iscsi_conn *conn)
+{
+	while (conn->zc_done_seq != conn->zc_next_seq &&
+	       conn->zc_ring[conn->zc_done_seq &
+			     (ISCSI_CONN_ZC_RING_SIZE - 1)] == NULL)
+		conn->zc_done_seq++;
+}
+
+/* Release the commands pinned by zerocopy sends lo through hi inclusive */
+static void iscsi_zc_complete(struct iscsi_conn *conn, u32 lo, u32 hi)
+{
+	u32 seq;
+
+	TRACE_NET_PAGE("conn %p, zerocopy completion %u..%u", conn, lo, hi);
+
+	for (seq = lo; seq - lo <= hi - lo; seq++) {
+		struct iscsi_cmnd **slot =
+			&conn->zc_ring[seq & (ISCSI_CONN_ZC_RING_SIZE - 1)];
+		struct iscsi_cmnd *cmd;
+
+		spin_lock_bh(&conn->zc_lock);
+		cmd = *slot;
+		*slot = NULL;
+		iscsi_zc_advance(conn);
+		spin_unlock_bh(&conn->zc_lock);
+
+		if (cmd != NULL)
+			__iscsi_put_page_callback(cmd);
+		if (seq == hi)
+			break;
+	}
+}
+
+/*
+ * Drain the MSG_ZEROCOPY completion notifications from the socket error
+ * queue. With force, also release every send still outstanding -- only
+ * allowed once the socket can no longer touch our pages.
+ */
+void iscsi_zc_reap(struct iscsi_conn *conn, bool force)
+{
+	TRACE_ENTRY();
+
+	if (!conn->zc_enabled)
+		goto out;
+
+	while (conn->zc_done_seq != conn->zc_next_seq) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		struct sock_extended_err *serr;
+		struct cmsghdr *cm;
+		int res;
+
+		res = (int)UMC_kernelize64(recvmsg(conn->file->fd, &msg,
+						MSG_ERRQUEUE | MSG_DONTWAIT));
+		if (res < 0) {
+			if (res == -EINTR)
+				continue;
+			break;	/* -EAGAIN: nothing more queued */
+		}
+
+		cm = CMSG_FIRSTHDR(&msg);
+		if (cm == NULL ||
+		    !((cm->cmsg_level == SOL_IP &&
+		       cm->cmsg_type == IP_RECVERR) ||
+		      (cm->cmsg_level == SOL_IPV6 &&
+		       cm->cmsg_type == IPV6_RECVERR)))
+			continue;
+
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_errno != 0 ||
+		    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+			PRINT_WARNING("Unexpected error queue entry on conn "
+				"%p: errno %u, origin %u", conn,
+				serr->ee_errno, serr->ee_origin);
+			continue;
+		}
+
+		/* The kernel fell back to copying, e.g. on loopback */
+		if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			conn->zc_copied += serr->ee_data - serr->ee_info + 1;
+
+		iscsi_zc_complete(conn, serr->ee_info, serr->ee_data);
+	}
+
+	if (force && conn->zc_done_seq != conn->zc_next_seq) {
+		TRACE_CONN_CLOSE_DBG("conn %p, forcing zerocopy completion "
+			"%u..%u", conn, conn->zc_done_seq,
+			conn->zc_next_seq - 1);
+		iscsi_zc_complete(conn, conn->zc_done_seq,
+				  conn->zc_next_seq - 1);
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/* Whether the data of the PDU being sent are worth a zerocopy send */
+static inline bool iscsi_zc_wanted(struct iscsi_conn *conn)
+{
+	return conn->zc_enabled &&
+	       (conn->write_cmnd->pdu.datasize >= ISCSI_ZEROCOPY_MIN_SIZE);
+}
+
+/*
+ * Reserve the completion slot for the next zerocopy send and pin ref_cmd in
+ * it. Returns false if the data should be copied instead.
+ */
+static bool iscsi_zc_begin(struct iscsi_conn *conn,
+			   struct iscsi_cmnd *ref_cmd)
+{
+	bool res;
+
+	if (!iscsi_zc_wanted(conn))
+		return false;
+
+	if (conn->zc_next_seq - conn->zc_done_seq >= ISCSI_CONN_ZC_RING_SIZE)
+		iscsi_zc_reap(conn, false);
+
+	__iscsi_get_page_callback(ref_cmd);
+
+	spin_lock_bh(&conn->zc_lock);
+	res = conn->zc_next_seq - conn->zc_done_seq < ISCSI_CONN_ZC_RING_SIZE;
+	if (res)
+		conn->zc_ring[conn->zc_next_seq &
+			      (ISCSI_CONN_ZC_RING_SIZE - 1)] = ref_cmd;
+	spin_unlock_bh(&conn->zc_lock);
+
+	if (!res)
+		__iscsi_put_page_callback(ref_cmd);
+	return res;
+}
+
+/* Commit (sent) or cancel the slot reserved by iscsi_zc_begin() */
+static void iscsi_zc_end(struct iscsi_conn *conn, struct iscsi_cmnd *ref_cmd,
+			 bool sent)
+{
+	struct iscsi_cmnd **slot =
+		&conn->zc_ring[conn->zc_next_seq & (ISCSI_CONN_ZC_RING_SIZE - 1)];
+	bool put = false;
+
+	spin_lock_bh(&conn->zc_lock);
+	if (sent) {
+		/* The kernel numbers each successful zerocopy send */
+		conn->zc_next_seq++;
+		conn->zc_sends++;
+	} else {
+		put = (*slot != NULL);
+		*slot = NULL;
+	}
+	iscsi_zc_advance(conn);
+	spin_unlock_bh(&conn->zc_lock);
+
+	if (put)
+		__iscsi_put_page_callback(ref_cmd);
+}
 #else
 static inline void check_net_priv(struct iscsi_cmnd *cmd, struct page *page) {}
 static inline void __iscsi_get_page_callback(struct iscsi_cmnd *cmd) {}
@@ -1603,6 +1784,9 @@ static int write_data(struct iscsi_conn *conn)
 	int length, offset, idx;
 	int flags, res, count, sg_size;
 	bool do_put = false, ref_cmd_to_parent;
+#ifdef SCST_USERMODE
+	int span;
+#endif
 
 	TRACE_ENTRY();
 
@@ -1774,6 +1958,22 @@ retry:
   #define page_info(page) page_to_pfn(page)
 #else
   #define page_info(page) ((page)->index)
+#endif
+#ifdef SCST_USERMODE
+		/*
+		 * Send the following data segments in the same call as long
+		 * as they continue this one in memory, e.g. when the buffer
+		 * comes from the SGV arena.
+		 */
+		span = 0;
+		while ((sg != write_cmnd->rsp_sg) && (length < size) &&
+		       (idx + span + 1 < ref_cmd->sg_cnt) &&
+		       ((u8 *)page_address(page) + offset + length ==
+			(u8 *)page_address(sg_page(&sg[idx + span + 1])) +
+				sg[idx + span + 1].offset)) {
+			span++;
+			length += sg[idx + span].length;
+		}
 #endif
 		sendsize = min(size, length);
 		if (size <= sendsize) {
@@ -1826,6 +2026,9 @@ retry1:
 		size -= res;
 
 		if (res == sendsize) {
+#ifdef SCST_USERMODE
+			idx += span;
+#endif
 			idx++;
 			EXTRACHECKS_BUG_ON(idx >= ref_cmd->sg_cnt);
 			page = sg_page(&sg[idx]);
@@ -1999,6 +2202,305 @@ static int iscsi_do_send(struct iscsi_conn *conn, int state)
 	return res;
 }
 
+#ifdef SCST_USERMODE_TX_GATHER
+/*
+ * Describe the whole PDU in conn->tx_iov: the header iovecs already set up by
+ * cmnd_tx_start() and init_tx_hdigest(), every data segment, the padding and
+ * the data digest, coalescing adjacent segments. Returns false if the PDU
+ * can't be gathered, in which case the caller falls back to sending it piece
+ * by piece through the TX_BHS_DATA state machine.
+ */
+static bool iscsi_tx_gather(struct iscsi_conn *conn, struct iscsi_cmnd *cmnd)
+{
+	static const uint32_t padding;
+	struct iovec *iov = conn->tx_iov;
+	struct scatterlist *sg = cmnd->sg;
+	int size = cmnd->pdu.datasize;
+	int cnt = 0, i, idx, offset, length, pad;
+	u32 total = 0;
+
+	iscsi_extracheck_is_wr_thread(conn);
+
+	for (i = 0; i < conn->write_iop_used; i++) {
+		iov[cnt] = conn->write_iop[i];
+		total += iov[cnt].iov_len;
+		cnt++;
+	}
+#ifdef SCST_USERMODE_ZEROCOPY
+	conn->tx_data_first = conn->tx_data_end = cnt;
+#endif
+
+	if (size == 0)
+		goto out;
+
+	/* Let write_data() complain about it */
+	if (unlikely(sg == NULL))
+		return false;
+
+	/* Same assumptions about the scatterlists as in write_data() */
+	if (sg != cmnd->rsp_sg) {
+		offset = conn->write_offset + sg[0].offset;
+		idx = offset >> PAGE_SHIFT;
+		offset &= ~PAGE_MASK;
+		length = PAGE_SIZE - offset;
+	} else {
+		idx = 0;
+		offset = conn->write_offset;
+		while (offset >= sg[idx].length) {
+			offset -= sg[idx].length;
+			idx++;
+		}
+		length = sg[idx].length - offset;
+		offset += sg[idx].offset;
+	}
+
+	while (size > 0) {
+		u8 *addr = (u8 *)page_address(sg_page(&sg[idx])) + offset;
+
+		length = min(size, length);
+		/* Never merge data into the header iovecs */
+		if ((cnt > conn->write_iop_used) &&
+		    (addr == iov[cnt-1].iov_base + iov[cnt-1].iov_len)) {
+			iov[cnt-1].iov_len += length;
+		} else {
+			/* Keep room for the padding and the data digest */
+			if (unlikely(cnt >= (int)ISCSI_CONN_TX_IOV_MAX - 2))
+				return false;
+			iov[cnt].iov_base = addr;
+			iov[cnt].iov_len = length;
+			cnt++;
+		}
+		total += length;
+		size -= length;
+		if (size > 0) {
+			idx++;
+			offset = sg[idx].offset;
+			length = sg[idx].length;
+		}
+	}
+
+#ifdef SCST_USERMODE_ZEROCOPY
+	conn->tx_data_end = cnt;
+#endif
+
+	pad = ((cmnd->pdu.datasize + 3) & -4) - cmnd->pdu.datasize;
+	if (pad != 0) {
+		iov[cnt].iov_base = (void *)&padding;
+		iov[cnt].iov_len = pad;
+		total += pad;
+		cnt++;
+	}
+
+	if (conn->ddigest_type != DIGEST_NONE) {
+		iov[cnt].iov_base = &cmnd->ddigest;
+		iov[cnt].iov_len = sizeof(u32);
+		total += sizeof(u32);
+		cnt++;
+	}
+
+out:
+	TRACE_WRITE("Gathered cmnd %p into %d iovecs, %u bytes", cmnd, cnt,
+		total);
+	conn->tx_iov_idx = 0;
+	conn->tx_iov_cnt = cnt;
+	conn->tx_size = total;
+	return true;
+}
+
+/*
+ * Push the PDU gathered by iscsi_tx_gather() with as few sendmsg() calls as
+ * the socket buffer allows, resuming at tx_iov_idx after a partial write.
+ */
+static int write_data_gathered(struct iscsi_conn *conn)
+{
+	struct iscsi_cmnd *write_cmnd = conn->write_cmnd;
+	struct iscsi_cmnd *ref_cmd;
+	struct iovec *iop;
+	int res, rest, count, sent = 0;
+	bool ref_cmd_to_parent;
+
+	TRACE_ENTRY();
+
+	iscsi_extracheck_is_wr_thread(conn);
+
+	if (!write_cmnd->own_sg) {
+		ref_cmd = write_cmnd->parent_req;
+		ref_cmd_to_parent = true;
+	} else {
+		ref_cmd = write_cmnd;
+		ref_cmd_to_parent = false;
+	}
+
+	req_add_to_write_timeout_list(write_cmnd->parent_req);
+
+	iop = &conn->tx_iov[conn->tx_iov_idx];
+	count = conn->tx_iov_cnt - conn->tx_iov_idx;
+
+	while (conn->tx_size > 0) {
+		struct msghdr msg = {
+			.msg_iov = iop,
+			.msg_iovlen = count,
+		};
+		int flags = MSG_DONTWAIT | MSG_NOSIGNAL |
+			    (conn->tx_more ? MSG_MORE : 0);
+#ifdef SCST_USERMODE_ZEROCOPY
+		bool zc = false;
+
+		/*
+		 * Send the header part, the data and the trailing padding and
+		 * digest each with their own sendmsg(), only the data zerocopy.
+		 */
+		if (iscsi_zc_wanted(conn)) {
+			int idx = iop - conn->tx_iov;
+
+			if (idx < conn->tx_data_first) {
+				msg.msg_iovlen = conn->tx_data_first - idx;
+			} else if (idx < conn->tx_data_end) {
+				msg.msg_iovlen = conn->tx_data_end - idx;
+				zc = iscsi_zc_begin(conn, ref_cmd);
+			}
+			if ((int)msg.msg_iovlen < count)
+				flags |= MSG_MORE;
+			if (zc)
+				flags |= MSG_ZEROCOPY;
+		}
+#endif
+
+		res = (int)UMC_kernelize64(sendmsg(conn->file->fd, &msg,
+						    flags));
+#ifdef SCST_USERMODE_ZEROCOPY
+		if (zc)
+			iscsi_zc_end(conn, ref_cmd, res > 0);
+#endif
+		TRACE_WRITE("sid %#Lx, cid %u, res %d, iov_cnt %d, tx_size %u",
+			    (unsigned long long int)conn->session->sid,
+			    conn->cid, res, count, conn->tx_size);
+		if (unlikely(res <= 0)) {
+			if (res == -EINTR)
+				continue;
+			if (res == -EAGAIN)
+				break;
+			goto out_err;
+		}
+
+		sent += res;
+		conn->tx_size -= res;
+		rest = res;
+		while (count > 0 && (typeof(rest))iop->iov_len <= rest) {
+			rest -= iop->iov_len;
+			iop++;
+			count--;
+		}
+		if (rest) {
+			iop->iov_base += rest;
+			iop->iov_len -= rest;
+		}
+	}
+
+	conn->tx_iov_idx = iop - conn->tx_iov;
+	res = sent ? sent : -EAGAIN;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_err:
+#ifndef CONFIG_SCST_DEBUG
+	if (!conn->closing) {
+#else
+	{
+#endif
+		PRINT_ERROR("error %d at sid:cid %#Lx:%u, cmnd %p", res,
+			    (unsigned long long int)conn->session->sid,
+			    conn->cid, conn->write_cmnd);
+	}
+	if (ref_cmd_to_parent &&
+	    ((ref_cmd->scst_cmd != NULL) || (ref_cmd->scst_aen != NULL))) {
+		if (ref_cmd->scst_state == ISCSI_CMD_STATE_AEN)
+			scst_set_aen_delivery_status(ref_cmd->scst_aen,
+				SCST_AEN_RES_FAILED);
+		else
+			scst_set_delivery_status(ref_cmd->scst_cmd,
+				SCST_CMD_DELIVERY_FAILED);
+	}
+	goto out;
+}
+
+static int iscsi_do_send_gathered(struct iscsi_conn *conn)
+{
+	int res;
+
+	iscsi_extracheck_is_wr_thread(conn);
+
+	res = write_data_gathered(conn);
+	if (res > 0) {
+		if (!conn->tx_size) {
+			conn->write_iop = NULL;
+			conn->write_iop_used = 0;
+			conn->write_size = 0;
+			conn->write_state = TX_END;
+		}
+	} else
+		res = exit_tx(conn, res);
+
+	return res;
+}
+
+/*
+ * Response coalescing: while more PDUs are queued behind the one just
+ * gathered, send it with MSG_MORE, so that TCP packs it with the following
+ * ones rather than pushing a segment per PDU. The last PDU queued goes without
+ * MSG_MORE and pushes the whole batch, so a PDU with nothing queued behind it,
+ * as at QD1, is never held back. The target's tx_coalesce_pdus and
+ * tx_coalesce_bytes bound a batch; tx_coalesce_pdus <= 1 disables it.
+ */
+static void iscsi_tx_coalesce(struct iscsi_conn *conn)
+{
+	struct iscsi_target *target = conn->target;
+
+	iscsi_extracheck_is_wr_thread(conn);
+
+	conn->tx_pdus++;
+	conn->tx_more = !list_empty(&conn->write_list) &&
+		(conn->tx_held_pdus + 1 < READ_ONCE(target->tx_coalesce_pdus)) &&
+		(conn->tx_held_bytes + conn->tx_size <
+				READ_ONCE(target->tx_coalesce_bytes));
+
+	if (conn->tx_more) {
+		conn->tx_coalesced++;
+		conn->tx_held_pdus++;
+		conn->tx_held_bytes += conn->tx_size;
+	} else {
+		conn->tx_held_pdus = 0;
+		conn->tx_held_bytes = 0;
+	}
+}
+
+/*
+ * Called by the write side before it goes idle. Pushes PDUs still held by
+ * MSG_MORE when the PDU they were held for never got sent, e.g. because it
+ * was taken off the write list by an abort. Setting TCP_NODELAY, which
+ * conn_setup_sock() already set, pushes the pending segments.
+ */
+void iscsi_tx_flush(struct iscsi_conn *conn)
+{
+	int opt = 1;
+
+	iscsi_extracheck_is_wr_thread(conn);
+
+	if (likely(conn->tx_held_pdus == 0) || test_write_ready(conn))
+		return;
+
+	TRACE_WRITE("Flushing %u held PDUs (conn %p)", conn->tx_held_pdus,
+		conn);
+
+	setsockopt(conn->file->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	conn->tx_held_pdus = 0;
+	conn->tx_held_bytes = 0;
+	conn->tx_flushes++;
+}
+#endif /* SCST_USERMODE_TX_GATHER */
+
 /*
  * No locks, conn is wr processing.
  *
@@ -2028,6 +2530,17 @@ int iscsi_send(struct iscsi_conn *conn)
 		cmnd_tx_start(cmnd);
 		if (!(conn->hdigest_type & DIGEST_NONE))
 			init_tx_hdigest(cmnd);
+#ifdef SCST_USERMODE_TX_GATHER
+		if (iscsi_tx_gather(conn, cmnd)) {
+			iscsi_tx_coalesce(conn);
+			conn->write_state = TX_GATHERED;
+			res = iscsi_do_send_gathered(conn);
+			break;
+		}
+		/* Sent piece by piece, its end pushes anything held before it */
+		conn->tx_held_pdus = 0;
+		conn->tx_held_bytes = 0;
+#endif
 		conn->write_state = TX_BHS_DATA;
 		/* fall-through */
 	case TX_BHS_DATA:
@@ -2058,6 +2571,11 @@ int iscsi_send(struct iscsi_conn *conn)
 	case TX_DDIGEST:
 		res = tx_ddigest(cmnd, TX_END);
 		break;
+#ifdef SCST_USERMODE_TX_GATHER
+	case TX_GATHERED:
+		res = iscsi_do_send_gathered(conn);
+		break;
+#endif
 	default:
 		PRINT_CRIT_ERROR("%d %d %x", res, conn->write_state,
 			cmnd_opcode(cmnd));
@@ -2124,6 +2642,9 @@ static void scst_do_job_wr(struct iscsi_thread_pool *p)
 		conn_get(conn);
 
 		rc = iscsi_send(conn);
+#ifdef SCST_USERMODE_TX_GATHER
+		iscsi_tx_flush(conn);
+#endif
 
 		spin_lock_bh(&p->wr_lock);
 #ifdef CONFIG_SCST_EXTRACHECKS
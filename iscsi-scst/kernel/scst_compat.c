@@ -35,6 +35,7 @@
 extern errno_t UMC_INIT_init_scst(void);			/* scst_main.c */
 extern errno_t UMC_INIT_init_scst_vdisk_driver(void);		/* scst_vdisk.c */
 extern errno_t UMC_INIT_iscsi_init(void);			/* iscsi.c */
+extern errno_t UMC_INIT_scstu_loop_init(void);			/* usermode/scstu_loop.c */
 
 extern void SCST_param_create_num_threads(void);
 extern void SCST_param_create_scst_vdisk_ID(void);
@@ -92,6 +93,9 @@ SCST_init(const char *dev, int readonly)
     err = UMC_INIT_iscsi_init();		/* iscsi.c */
     verify_noerr(err, "iscsi_init");
 
+    err = UMC_INIT_scstu_loop_init();		/* scstu_loop.c */
+    verify_noerr(err, "scstu_loop_init");
+
     SCST_param_create_num_threads();
     SCST_param_create_scst_vdisk_ID();
     SCST_param_create_scst_threads();
@@ -136,6 +140,7 @@ extern void SCST_param_remove_forcibly_close_sessions(void);
 extern void UMC_EXIT_exit_scst(void);
 extern void UMC_EXIT_exit_scst_vdisk_driver(void);
 extern void UMC_EXIT_iscsi_exit(void);
+extern void UMC_EXIT_scstu_loop_exit(void);
 
 static int SCST_nl_fdwrite = -1;    /* kernel end of nl_fd socket */
 
@@ -154,6 +159,7 @@ SCST_exit(void)
     SCST_param_remove_scst_max_dev_cmd_mem();
     SCST_param_remove_forcibly_close_sessions();
 
+    UMC_EXIT_scstu_loop_exit();
     UMC_EXIT_iscsi_exit();
     UMC_EXIT_exit_scst_vdisk_driver();
     UMC_EXIT_exit_scst();
@@ -96,6 +96,10 @@ static int iscsi_target_create(struct iscsi_kern_target_info *info, u32 tid,
 #ifndef CONFIG_SCST_PROC
 	INIT_LIST_HEAD(&target->attrs_list);
 #endif
+#ifdef SCST_USERMODE_TX_GATHER
+	target->tx_coalesce_pdus = ISCSI_TX_COALESCE_PDUS;
+	target->tx_coalesce_bytes = ISCSI_TX_COALESCE_BYTES;
+#endif
 
 	target->scst_tgt = scst_register_target(&iscsi_template, target->name);
 	if (!target->scst_tgt) {
@@ -503,8 +507,140 @@ out:
 static struct kobj_attribute iscsi_tgt_attr_tid =
 	__ATTR(tid, S_IRUGO, iscsi_tgt_tid_show, NULL);
 
+#ifdef SCST_USERMODE_TX_GATHER
+
+static ssize_t iscsi_tgt_tx_coalesce_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int res = -E_TGT_PRIV_NOT_YET_SET;
+	struct scst_tgt *scst_tgt;
+	struct iscsi_target *tgt;
+	unsigned int val, def;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (!tgt)
+		goto out;
+
+	if (strcmp(attr->attr.name, "tx_coalesce_pdus") == 0) {
+		val = READ_ONCE(tgt->tx_coalesce_pdus);
+		def = ISCSI_TX_COALESCE_PDUS;
+	} else {
+		val = READ_ONCE(tgt->tx_coalesce_bytes);
+		def = ISCSI_TX_COALESCE_BYTES;
+	}
+
+	res = sprintf(buf, "%u\n%s", val,
+		(val != def) ? SCST_SYSFS_KEY_MARK "\n" : "");
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static ssize_t iscsi_tgt_tx_coalesce_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res = -E_TGT_PRIV_NOT_YET_SET;
+	struct scst_tgt *scst_tgt;
+	struct iscsi_target *tgt;
+	unsigned long val;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (!tgt)
+		goto out;
+
+	res = kstrtoul(buf, 0, &val);
+	if ((res == 0) && (val > UINT_MAX))
+		res = -ERANGE;
+	if (res != 0) {
+		PRINT_ERROR("Bad value \"%.*s\" for %s", (int)count, buf,
+			attr->attr.name);
+		goto out;
+	}
+
+	if (strcmp(attr->attr.name, "tx_coalesce_pdus") == 0)
+		WRITE_ONCE(tgt->tx_coalesce_pdus, val);
+	else
+		WRITE_ONCE(tgt->tx_coalesce_bytes, val);
+
+	PRINT_INFO("Target %s: %s set to %lu", tgt->name, attr->attr.name,
+		val);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute iscsi_tgt_attr_tx_coalesce_pdus =
+	__ATTR(tx_coalesce_pdus, S_IRUGO | S_IWUSR,
+	       iscsi_tgt_tx_coalesce_show, iscsi_tgt_tx_coalesce_store);
+
+static struct kobj_attribute iscsi_tgt_attr_tx_coalesce_bytes =
+	__ATTR(tx_coalesce_bytes, S_IRUGO | S_IWUSR,
+	       iscsi_tgt_tx_coalesce_show, iscsi_tgt_tx_coalesce_store);
+
+/* Totals over the target's current connections */
+static ssize_t iscsi_tgt_tx_coalesce_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	int res = -E_TGT_PRIV_NOT_YET_SET;
+	struct scst_tgt *scst_tgt;
+	struct iscsi_target *tgt;
+	struct iscsi_session *session;
+	struct iscsi_conn *conn;
+	unsigned long pdus = 0, coalesced = 0, flushes = 0;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (!tgt)
+		goto out;
+
+	res = mutex_lock_interruptible(&tgt->target_mutex);
+	if (res != 0)
+		goto out;
+
+	list_for_each_entry(session, &tgt->session_list, session_list_entry) {
+		list_for_each_entry(conn, &session->conn_list,
+				    conn_list_entry) {
+			pdus += READ_ONCE(conn->tx_pdus);
+			coalesced += READ_ONCE(conn->tx_coalesced);
+			flushes += READ_ONCE(conn->tx_flushes);
+		}
+	}
+
+	mutex_unlock(&tgt->target_mutex);
+
+	res = sprintf(buf, "pdus %lu coalesced %lu batches %lu flushes %lu\n",
+		pdus, coalesced, pdus - coalesced, flushes);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute iscsi_tgt_attr_tx_coalesce_stats =
+	__ATTR(tx_coalesce_stats, S_IRUGO, iscsi_tgt_tx_coalesce_stats_show,
+	       NULL);
+
+#endif /* SCST_USERMODE_TX_GATHER */
+
 const struct attribute *iscsi_tgt_attrs[] = {
 	&iscsi_tgt_attr_tid.attr,
+#ifdef SCST_USERMODE_TX_GATHER
+	&iscsi_tgt_attr_tx_coalesce_pdus.attr,
+	&iscsi_tgt_attr_tx_coalesce_bytes.attr,
+	&iscsi_tgt_attr_tx_coalesce_stats.attr,
+#endif
 	NULL,
 };
 
@@ -40,6 +40,8 @@
 #include <linux/wait.h>
 #include <linux/cpumask.h>
 #include <linux/dlm.h>
+#include <linux/rbtree.h>
+#include <linux/hash.h>
 #ifdef CONFIG_SCST_MEASURE_LATENCY
 #include <linux/log2.h>
 #endif
@@ -1914,6 +1916,13 @@ struct scst_session {
 	/* session's async flags */
 	unsigned long sess_aflags;
 
+	/*
+	 * NUMA node, where the target driver receives this session's commands,
+	 * or NUMA_NO_NODE. With scst_node_threads the session's commands are
+	 * processed, and their data buffers allocated, by a thread of this node.
+	 */
+	int sess_numa_node_id;
+
 	/*
 	 * Hash list for tgt_dev's for this session with size and fn. It isn't
 	 * hlist_entry, because we need ability to go over the list in the
@@ -1934,6 +1943,15 @@ struct scst_session {
 
 	spinlock_t sess_list_lock; /* protects sess_cmd_list, etc */
 
+	/*
+	 * Non-internal commands of sess_cmd_list hashed by tag, in the same
+	 * order, to find them for ABORT TASK. Protected by sess_list_lock.
+	 */
+#define	SESS_CMD_TAG_HASH_ORDER 8
+#define	SESS_CMD_TAG_HASH_SIZE (1 << SESS_CMD_TAG_HASH_ORDER)
+#define	SESS_CMD_TAG_HASH_FN(tag) hash_64(tag, SESS_CMD_TAG_HASH_ORDER)
+	struct list_head sess_cmd_tag_hash[SESS_CMD_TAG_HASH_SIZE];
+
 	atomic_t refcnt;		/* get/put counter */
 
 	/*
@@ -2063,6 +2081,17 @@ struct scst_pr_abort_all_pending_mgmt_cmds_counter {
 /*
  * Structure to control commands' queuing and threads pool processing the queue
  */
+/*
+ * Commands scheduling counters of the processing threads, see threads_stats
+ * in the SCST root sysfs directory.
+ */
+struct scst_thr_stats {
+	unsigned long shared_cmds;	/* taken from active_cmd_list */
+	unsigned long local_cmds;	/* taken from own thr_active_cmd_list */
+	unsigned long stolen_cmds;	/* taken from other threads' lists */
+	unsigned long shared_lock_contended; /* cmd_list_lock was busy */
+};
+
 struct scst_cmd_threads {
 	spinlock_t cmd_list_lock;
 	struct list_head active_cmd_list; /* commands queue */
@@ -2081,6 +2110,15 @@ struct scst_cmd_threads {
 	int nr_threads; /* number of processing threads */
 	struct list_head threads_list; /* processing threads */
 
+	/*
+	 * Set, if a thread's thr_active_cmd_list might have commands for idle
+	 * threads to steal. Hint only, hence no locking.
+	 */
+	bool steal_hint;
+
+	/* Counters of the already stopped threads, protected by thr_lock */
+	struct scst_thr_stats stopped_thr_stats;
+
 	struct list_head lists_list_entry;
 };
 
@@ -2149,6 +2187,27 @@ struct scst_orig_sg_data {
 	int orig_entry_offs, orig_entry_len;
 };
 
+/*
+ * Index of commands by the LBA range they access, see scst_lba_index_first()
+ * for the lookup. Protected by the lock of the structure containing it.
+ */
+struct scst_lba_index {
+	/* Sorted by starting LBA */
+	struct rb_root root;
+
+	/* Number of entries per ilog2() of the length in blocks */
+	unsigned int order_count[64];
+
+	/* Highest order with entries, 0 if empty */
+	int max_order;
+};
+
+struct scst_lba_index_node {
+	struct rb_node rb;
+	struct scst_cmd *cmd;
+	int order;
+};
+
 /*
  * SCST command, analog of I_T_L_Q nexus or task
  */
@@ -2228,6 +2287,14 @@ struct scst_cmd {
 	/* Set if cmd is on dev's exec_cmd_list */
 	unsigned int on_dev_exec_list:1;
 
+	/*
+	 * Set if cmd is in dev's dev_exec_lba_index, dev_exec_cwr_index or
+	 * on its dev_exec_nolba_cmd_list respectively
+	 */
+	unsigned int dev_exec_lba_indexed:1;
+	unsigned int dev_exec_cwr_indexed:1;
+	unsigned int dev_exec_nolba_listed:1;
+
 	/* Set if this cmd passed check for SCSI atomicity */
 	unsigned int scsi_atomicity_checked:1;
 
@@ -2384,6 +2451,9 @@ struct scst_cmd {
 	/* List entry for sess's sess_cmd_list */
 	struct list_head sess_cmd_list_entry;
 
+	/* List entry for sess's sess_cmd_tag_hash */
+	struct list_head sess_cmd_tag_hash_entry;
+
 	/*
 	 * Used to found the cmd by scst_find_cmd_by_tag(). Set by the
 	 * target driver on the cmd's initialization time
@@ -2399,6 +2469,11 @@ struct scst_cmd {
 	/* List entry for dev's dev_exec_cmd_list */
 	struct list_head dev_exec_cmd_list_entry;
 
+	/* Entries in dev's indexes of dev_exec_cmd_list */
+	struct scst_lba_index_node dev_exec_lba_node;
+	struct scst_lba_index_node dev_exec_cwr_node;
+	struct list_head dev_exec_nolba_cmd_list_entry;
+
 	/*
 	 * Array of blocked by this cmd SCSI atomic cmds with size
 	 * scsi_atomic_blocked_cmds_count. Protected by dev->dev_lock.
@@ -2548,6 +2623,9 @@ struct scst_cmd {
 	 */
 	int scsi_atomic_blocked_cmds_count;
 
+	/* When this cmd was blocked for SCSI atomicity, in us */
+	uint64_t scsi_atomic_blocked_start;
+
 	/* List entry for dev's blocked_cmd_list */
 	struct list_head blocked_cmd_list_entry;
 
@@ -2719,6 +2797,10 @@ struct scst_dev_registrant {
 	struct list_head aux_list_entry;
 	__be64 rollback_key;
 
+	/* Whether and with which key this registrant is in the PR journal */
+	unsigned int jnl_synced:1;
+	__be64 jnl_key;
+
 	/* For registrant information managed via the DLM. */
 	int dlm_idx;
 	struct scst_lksb lksb;
@@ -2958,6 +3040,26 @@ struct scst_device {
 	 */
 	struct list_head dev_exec_cmd_list;
 
+	/*
+	 * Indexes of dev_exec_cmd_list for the SCSI atomicity checks: LBA
+	 * valid cmds, COMPARE AND WRITE cmds, and cmds without a valid LBA
+	 * which COMPARE AND WRITE must still be atomic against. Only kept
+	 * once dev_exec_indexed set by the first SCSI atomic cmd, so devices
+	 * never getting any don't pay for them. Protected by dev_lock.
+	 */
+	int dev_exec_indexed;
+	struct scst_lba_index dev_exec_lba_index;
+	struct scst_lba_index dev_exec_cwr_index;
+	struct list_head dev_exec_nolba_cmd_list;
+
+	/*
+	 * Number of cmds delayed behind overlapping SCSI atomic ones, and
+	 * their total and maximum time blocked in us. Protected by dev_lock.
+	 */
+	uint64_t dev_scsi_atomic_blocked_cmds;
+	uint64_t dev_scsi_atomic_blocked_us;
+	uint64_t dev_scsi_atomic_blocked_max_us;
+
 	/* Memory limits for this device */
 	struct scst_mem_lim dev_mem_lim;
 
@@ -3068,6 +3170,17 @@ struct scst_device {
 	char *pr_file_name;
 	char *pr_file_name1;
 
+	/*
+	 * Journal of the PR changes since the last snapshot in pr_file_name,
+	 * NULL if pr_file_name is a block device. pr_jnl_size is the journal
+	 * size, or 0 if the next sync must write a new snapshot. Removed
+	 * journaled registrants are kept on pr_jnl_removed_list till the
+	 * next sync. Protected by dev_pr_mutex.
+	 */
+	char *pr_jnl_file_name;
+	loff_t pr_jnl_size;
+	struct list_head pr_jnl_removed_list;
+
 	/**************************************************************/
 
 	/* List of blocked commands, protected by dev_lock. */
@@ -3239,6 +3352,13 @@ struct scst_tgt_dev {
 	/* Reference to registrant to find quicker */
 	struct scst_dev_registrant *registrant;
 
+	/*
+	 * PR verdict for this I_T nexus: SCST_PR_VERDICT_ALL or the op_flags
+	 * of the commands allowed in the presence of the current persistent
+	 * reservation. Set under dev_pr_mutex and dev_lock, read locklessly.
+	 */
+	unsigned int pr_verdict;
+
 	/* List entry in dev->dev_tgt_dev_list */
 	struct list_head dev_tgt_dev_list_entry;
 
@@ -3919,6 +4039,17 @@ static inline void scst_sess_set_tgt_priv(struct scst_session *sess,
 	sess->sess_tgt_priv = val;
 }
 
+/*
+ * Sets NUMA node, on which the target driver receives the session's commands,
+ * so SCST processes them on the same node. Can be called at any time, the
+ * new node is used for the commands received after it.
+ */
+static inline void scst_sess_set_numa_node(struct scst_session *sess,
+					   int nodeid)
+{
+	sess->sess_numa_node_id = nodeid;
+}
+
 uint16_t scst_lookup_tg_id(struct scst_device *dev, struct scst_tgt *tgt);
 enum scst_tg_state scst_get_alua_state(struct scst_device *dev, struct scst_tgt *tgt);
 bool scst_alua_configured(struct scst_device *dev);
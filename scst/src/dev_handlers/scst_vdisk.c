@@ -58,6 +58,11 @@
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
 #endif
+#ifdef SCST_USERMODE
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
 
 #define LOG_PREFIX			"dev_vdisk"
 
@@ -266,8 +271,25 @@ struct scst_vdisk_dev {
 	enum scst_dif_mode dif_mode;
 	int dif_type;
 	__be64 dif_static_app_tag_combined;
+
+	/*
+	 * Last mapped extent [start, end) in bytes found in lba_status_fd by
+	 * GET LBA STATUS. Writes can only grow mapped extents, so only
+	 * unmapping, zeroing or resizing invalidates it. Protected by
+	 * lba_status_lock.
+	 */
+	spinlock_t lba_status_lock;
+	struct file *lba_status_fd;
+	loff_t lba_status_start, lba_status_end;
 };
 
+static inline void vdisk_lba_status_invalidate(struct scst_vdisk_dev *virt_dev)
+{
+	spin_lock(&virt_dev->lba_status_lock);
+	virt_dev->lba_status_fd = NULL;
+	spin_unlock(&virt_dev->lba_status_lock);
+}
+
 struct vdisk_cmd_params {
 	struct scatterlist small_sg[4];
 	struct iovec *iv;
@@ -498,6 +520,17 @@ static ssize_t vdev_dif_filename_show(struct kobject *kobj,
 
 static ssize_t vcdrom_sysfs_filename_store(struct kobject *kobj,
 	struct kobj_attribute *attr, const char *buf, size_t count);
+#ifdef SCST_USERMODE_TCMU
+/* Implemented in scstu_tcmu.c */
+static ssize_t vdisk_tcmu_latency_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_tcmu_latency_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t vdisk_tcmu_timing_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf);
+static ssize_t vdisk_tcmu_timing_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count);
+#endif
 
 static struct kobj_attribute vdev_active_attr =
 	__ATTR(active, S_IRUGO, vdev_sysfs_active_show, NULL);
@@ -588,6 +621,14 @@ static struct kobj_attribute vdev_dif_filename_attr =
 static struct kobj_attribute vcdrom_filename_attr =
 	__ATTR(filename, S_IRUGO|S_IWUSR, vdev_sysfs_filename_show,
 		vcdrom_sysfs_filename_store);
+#ifdef SCST_USERMODE_TCMU
+static struct kobj_attribute vdisk_tcmu_latency_attr =
+	__ATTR(tcmu_latency, S_IWUSR|S_IRUGO, vdisk_tcmu_latency_show,
+	       vdisk_tcmu_latency_store);
+static struct kobj_attribute vdisk_tcmu_timing_attr =
+	__ATTR(tcmu_timing, S_IWUSR|S_IRUGO, vdisk_tcmu_timing_show,
+	       vdisk_tcmu_timing_store);
+#endif
 
 static const struct attribute *vdisk_fileio_attrs[] = {
 	&vdev_size_ro_attr.attr,
@@ -647,6 +688,10 @@ static const struct attribute *vdisk_blockio_attrs[] = {
 	&vdev_usn_attr.attr,
 	&vdev_inq_vend_specific_attr.attr,
 	&vdisk_tp_attr.attr,
+#ifdef SCST_USERMODE_TCMU
+	&vdisk_tcmu_latency_attr.attr,
+	&vdisk_tcmu_timing_attr.attr,
+#endif
 	NULL,
 };
 
@@ -2386,7 +2431,6 @@ static const struct scst_opcode_descriptor scst_op_descr_format_unit = {
 	.od_cdb_usage_bits = { FORMAT_UNIT, 0xF0, 0, 0, 0, SCST_OD_DEFAULT_CONTROL_BYTE },
 };
 
-#if 0
 static const struct scst_opcode_descriptor scst_op_descr_get_lba_status = {
 	.od_opcode = SERVICE_ACTION_IN_16,
 	.od_serv_action = SAI_GET_LBA_STATUS,
@@ -2400,7 +2444,6 @@ static const struct scst_opcode_descriptor scst_op_descr_get_lba_status = {
 			       0xFF, 0xFF, 0xFF, 0xFF, 0,
 			       SCST_OD_DEFAULT_CONTROL_BYTE },
 };
-#endif
 
 static const struct scst_opcode_descriptor scst_op_descr_allow_medium_removal = {
 	.od_opcode = ALLOW_MEDIUM_REMOVAL,
@@ -2884,7 +2927,7 @@ static vdisk_op_fn nullio_ops[256] = {
 };
 
 #define VDISK_OPCODE_DESCRIPTORS					\
-	/* &scst_op_descr_get_lba_status, */				\
+	&scst_op_descr_get_lba_status,					\
 	&scst_op_descr_read_capacity16,					\
 	&scst_op_descr_write_same10,					\
 	&scst_op_descr_write_same16,					\
@@ -3869,6 +3912,7 @@ static int vdisk_unmap_file_range(struct scst_cmd *cmd,
 	TRACE_DBG("Fallocating range %lld, len %lld",
 		(unsigned long long)off, (unsigned long long)len);
 
+	vdisk_lba_status_invalidate(virt_dev);
 	res = fd->f_op->fallocate(fd,
 		FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
 	if (unlikely(res != 0)) {
@@ -3972,6 +4016,161 @@ out:
 	return res;
 }
 
+#ifdef SCST_USERMODE_TCMU
+/* Implemented in scstu_tcmu.c */
+static int vdisk_tcmu_zero_range(struct scst_cmd *cmd, loff_t off, loff_t len);
+#endif
+
+/*
+ * Returns 0 on success, -EOPNOTSUPP if the file can't zero a range in place
+ * (sense not set, the caller should write the zeroes instead) or another
+ * negative error code with sense set. With @sync the zeroed range is made
+ * durable before returning, since fallocate() ignores O_DSYNC.
+ */
+static int vdisk_zero_file_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, loff_t off, loff_t len,
+	struct file *fd, bool sync)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+	if ((fd == NULL) || (fd->f_op->fallocate == NULL)) {
+		res = -EOPNOTSUPP;
+		goto out;
+	}
+
+	TRACE_DBG("Zeroing range %lld, len %lld",
+		(unsigned long long)off, (unsigned long long)len);
+
+	vdisk_lba_status_invalidate(virt_dev);
+	res = fd->f_op->fallocate(fd,
+		FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len);
+	if (unlikely(res != 0) && (res != -EOPNOTSUPP)) {
+		PRINT_ERROR("fallocate(ZERO_RANGE) for %lld, len %lld "
+			"failed: %d", (unsigned long long)off,
+			(unsigned long long)len, res);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_write_error));
+		res = -EIO;
+		goto out;
+	}
+
+	if (sync && (res == 0)) {
+		res = vfs_fsync_range(fd, off, off + len - 1, 1);
+		if (unlikely(res != 0)) {
+			PRINT_ERROR("fsync of zeroed range %lld, len %lld "
+				"failed: %d", (unsigned long long)off,
+				(unsigned long long)len, res);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+			res = -EIO;
+		}
+	}
+#else
+	res = -EOPNOTSUPP;
+	goto out;
+#endif
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Zero @blocks blocks starting at @start_lba without moving any data
+ * through SCST. Same return convention as vdisk_zero_file_range().
+ */
+static int vdisk_zero_range(struct scst_cmd *cmd,
+	struct scst_vdisk_dev *virt_dev, uint64_t start_lba, uint64_t blocks,
+	bool sync)
+{
+	int res;
+	loff_t off = start_lba << cmd->dev->block_shift;
+	loff_t len = blocks << cmd->dev->block_shift;
+
+	TRACE_ENTRY();
+
+	if ((start_lba > virt_dev->nblocks) ||
+	    ((start_lba + blocks) > virt_dev->nblocks)) {
+		PRINT_ERROR("Device %s: attempt to write beyond max "
+			"size", virt_dev->name);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		res = -EINVAL;
+		goto out;
+	}
+
+	TRACE_DBG("Zeroing lba %lld (blocks %lld)",
+		(unsigned long long)start_lba, (unsigned long long)blocks);
+
+	if (virt_dev->nullio) {
+		/* No backing file: the zeroes go nowhere, as NULLIO writes do */
+		res = 0;
+	} else if (virt_dev->blockio) {
+#if defined(SCST_USERMODE_TCMU)
+		res = vdisk_tcmu_zero_range(cmd, off, len);
+#elif defined(SCST_USERMODE)
+		/* fallocate(2) on a block device is BLKZEROOUT */
+		res = vdisk_zero_file_range(cmd, virt_dev, off, len,
+			virt_dev->fd, sync);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+		struct inode *inode = file_inode(virt_dev->fd);
+
+		res = blkdev_issue_zeroout(inode->i_bdev, off >> 9, len >> 9,
+			cmd->cmd_gfp_mask, BLKDEV_ZERO_NOFALLBACK);
+		if (unlikely(res != 0) && (res != -EOPNOTSUPP)) {
+			PRINT_ERROR("blkdev_issue_zeroout() for "
+				"LBA %lld, blocks %lld failed: %d",
+				(unsigned long long)start_lba,
+				(unsigned long long)blocks, res);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_write_error));
+			res = -EIO;
+		}
+#else
+		res = -EOPNOTSUPP;
+#endif
+	} else {
+		res = vdisk_zero_file_range(cmd, virt_dev, off, len,
+			virt_dev->fd, sync);
+	}
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Returns true if the single block of a WRITE SAME data-out buffer is all
+ * zeroes, so the command can be turned into a zero-range request.
+ */
+static bool vdisk_write_same_zero_pattern(struct scst_cmd *cmd)
+{
+	uint8_t *buf;
+	int i, length;
+	bool res = true;
+
+	length = scst_get_buf_first(cmd, &buf);
+	if (unlikely(length < (1 << cmd->dev->block_shift))) {
+		res = false;
+		goto out_put;
+	}
+
+	for (i = 0; i < length; i++) {
+		if (buf[i] != 0) {
+			res = false;
+			break;
+		}
+	}
+
+out_put:
+	if (length > 0)
+		scst_put_buf(cmd, buf);
+	return res;
+}
+
 static void vdisk_exec_write_same_unmap(struct vdisk_cmd_params *p)
 {
 	int rc;
@@ -4050,13 +4249,33 @@ static enum compl_status_e vdisk_exec_write_same(struct vdisk_cmd_params *p)
 		goto out;
 	}
 
-	if (cmd->cdb[ctrl_offs] & 0x8)
+	if (cmd->cdb[ctrl_offs] & 0x8) {
 		vdisk_exec_write_same_unmap(p);
-	else {
-		scst_write_same(cmd, NULL);
-		res = RUNNING_ASYNC;
+		goto out;
+	}
+
+	/*
+	 * A zero pattern without LBDATA/PBDATA is by far the most common
+	 * WRITE SAME (mkfs, VM image provisioning), so let the backend zero
+	 * the range in place instead of replicating the block through
+	 * scst_write_same().
+	 */
+	if ((cmd->sg_cnt == 1) && ((cmd->cdb[ctrl_offs] & 0x6) == 0) &&
+	    (cmd->dev->dev_dif_mode == SCST_DIF_MODE_NONE) &&
+	    ((uint64_t)cmd->data_len <= cmd->dev->max_write_same_len) &&
+	    vdisk_write_same_zero_pattern(cmd)) {
+		struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+		int rc = vdisk_zero_range(cmd, virt_dev, cmd->lba,
+			cmd->data_len >> cmd->dev->block_shift,
+			(p->fua || virt_dev->wt_flag) && !virt_dev->nv_cache);
+
+		if (rc != -EOPNOTSUPP)
+			goto out;
 	}
 
+	scst_write_same(cmd, NULL);
+	res = RUNNING_ASYNC;
+
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -5516,11 +5735,198 @@ out:
 	return CMD_SUCCEEDED;
 }
 
+#ifdef SCST_USERMODE_TCMU
+/* Implemented in scstu_tcmu.c */
+static int64_t vdisk_tcmu_get_lba_status(struct scst_vdisk_dev *virt_dev,
+	loff_t off, loff_t len, bool *mapped);
+#endif
+
+/*
+ * Finds how many bytes starting at @off, at most @len, are all mapped or
+ * all deallocated in the file (*mapped). Returns that length or a negative
+ * error code. A file that can't tell, e.g. a block device on kernels whose
+ * block_llseek() rejects SEEK_DATA, is reported all mapped.
+ */
+static int64_t vdisk_file_lba_status(struct scst_vdisk_dev *virt_dev,
+	loff_t off, loff_t len, bool *mapped)
+{
+	struct file *fd = virt_dev->fd;
+	int64_t res;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	loff_t data, hole;
+#endif
+
+	TRACE_ENTRY();
+
+	*mapped = true;
+
+	spin_lock(&virt_dev->lba_status_lock);
+	if ((virt_dev->lba_status_fd == fd) &&
+	    (off >= virt_dev->lba_status_start) &&
+	    (off < virt_dev->lba_status_end)) {
+		res = min(virt_dev->lba_status_end - off, len);
+		spin_unlock(&virt_dev->lba_status_lock);
+		goto out;
+	}
+	spin_unlock(&virt_dev->lba_status_lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	data = vfs_llseek(fd, off, SEEK_DATA);
+	if ((data == -EINVAL) || (data == -EOPNOTSUPP)) {
+		res = len;
+		goto out;
+	} else if (data == -ENXIO) {
+		/* Nothing but a hole up to EOF */
+		*mapped = false;
+		res = len;
+		goto out;
+	} else if (data < 0) {
+		res = data;
+		goto out;
+	} else if (data > off) {
+		*mapped = false;
+		res = min(data - off, len);
+		goto out;
+	}
+
+	hole = vfs_llseek(fd, off, SEEK_HOLE);
+	if ((hole == -EINVAL) || (hole == -EOPNOTSUPP)) {
+		res = len;
+		goto out;
+	} else if (hole < 0) {
+		res = hole;
+		goto out;
+	}
+
+	spin_lock(&virt_dev->lba_status_lock);
+	virt_dev->lba_status_fd = fd;
+	virt_dev->lba_status_start = off;
+	virt_dev->lba_status_end = hole;
+	spin_unlock(&virt_dev->lba_status_lock);
+
+	res = min(hole - off, len);
+#else
+	res = len;
+#endif
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Maximum number of LBA status descriptors returned by GET LBA STATUS */
+#define VDISK_MAX_LBA_STATUS_DESCS	64
+
+/* SBC-3 GET LBA STATUS command */
 static enum compl_status_e vdisk_exec_get_lba_status(struct vdisk_cmd_params *p)
 {
-	/* Changing it don't forget to add it to vdisk_opcode_descriptors! */
-	scst_set_invalid_field_in_cdb(p->cmd, 1,
-			0 | SCST_INVAL_FIELD_BIT_OFFS_VALID);
+	struct scst_cmd *cmd = p->cmd;
+	struct scst_vdisk_dev *virt_dev = cmd->dev->dh_priv;
+	int block_shift = cmd->dev->block_shift;
+	uint64_t lba = cmd->lba, nblocks = virt_dev->nblocks;
+	uint8_t *address, *buf, *d = NULL;
+	int32_t length;
+	int ndescs = 0, max_descs;
+
+	TRACE_ENTRY();
+
+	if (unlikely(lba >= nblocks)) {
+		TRACE_DBG("GET LBA STATUS: LBA %lld beyond capacity %lld",
+			(unsigned long long)lba, (unsigned long long)nblocks);
+		scst_set_cmd_error(cmd,
+			SCST_LOAD_SENSE(scst_sense_block_out_range_error));
+		goto out;
+	}
+
+	length = scst_get_buf_full_sense(cmd, &address);
+	if (unlikely(length <= 0))
+		goto out;
+
+	max_descs = clamp_t(int, (length - 8) / 16, 1,
+			    VDISK_MAX_LBA_STATUS_DESCS);
+	buf = kzalloc(8 + 16 * max_descs, cmd->cmd_gfp_mask);
+	if (buf == NULL) {
+		PRINT_ERROR("Unable to allocate GET LBA STATUS buffer "
+			"(%d descriptors)", max_descs);
+		scst_set_busy(cmd);
+		goto out_put;
+	}
+
+	while (lba < nblocks) {
+		uint64_t blocks = min_t(uint64_t, nblocks - lba, 0xFFFFFFFFU);
+		int64_t ext;
+		bool mapped;
+
+		if (virt_dev->nullio) {
+			mapped = true;
+			ext = blocks << block_shift;
+#ifdef SCST_USERMODE_TCMU
+		} else if (virt_dev->blockio) {
+			ext = vdisk_tcmu_get_lba_status(virt_dev,
+				lba << block_shift, blocks << block_shift,
+				&mapped);
+#endif
+		} else {
+			ext = vdisk_file_lba_status(virt_dev,
+				lba << block_shift, blocks << block_shift,
+				&mapped);
+		}
+		if (unlikely(ext < 0)) {
+			if (ndescs != 0)
+				break;
+			PRINT_ERROR("GET LBA STATUS for dev %s, LBA %lld "
+				"failed: %lld", virt_dev->name,
+				(unsigned long long)lba, (long long)ext);
+			scst_set_cmd_error(cmd,
+				SCST_LOAD_SENSE(scst_sense_read_error));
+			goto out_free;
+		}
+
+		/*
+		 * A block only partially deallocated is still mapped, so
+		 * deallocated extents round down and mapped ones up.
+		 */
+		if (mapped)
+			blocks = (ext + (1 << block_shift) - 1) >> block_shift;
+		else
+			blocks = ext >> block_shift;
+		if (blocks == 0) {
+			mapped = true;
+			blocks = 1;
+		}
+		blocks = min(blocks, nblocks - lba);
+
+		if ((d != NULL) && ((d[12] == 0) == mapped) &&
+		    (get_unaligned_be32(&d[8]) + blocks <= 0xFFFFFFFFU)) {
+			put_unaligned_be32(get_unaligned_be32(&d[8]) + blocks,
+				&d[8]);
+		} else {
+			if (ndescs == max_descs)
+				break;
+			d = &buf[8 + 16 * ndescs++];
+			put_unaligned_be64(lba, &d[0]);
+			put_unaligned_be32(blocks, &d[8]);
+			d[12] = mapped ? 0 : 1;	/* PROVISIONING STATUS */
+		}
+		lba += blocks;
+	}
+
+	/* PARAMETER DATA LENGTH */
+	put_unaligned_be32(4 + 16 * ndescs, &buf[0]);
+
+	length = min_t(int32_t, length, 8 + 16 * ndescs);
+	memcpy(address, buf, length);
+	if (length < cmd->resp_data_len)
+		scst_set_resp_data_len(cmd, length);
+
+out_free:
+	kfree(buf);
+
+out_put:
+	scst_put_buf_full(cmd, address);
+
+out:
+	TRACE_EXIT();
 	return CMD_SUCCEEDED;
 }
 
@@ -7795,6 +8201,7 @@ static int vdisk_resync_size(struct scst_vdisk_dev *virt_dev)
 
 	virt_dev->file_size = file_size;
 	virt_dev->nblocks = virt_dev->file_size >> virt_dev->dev->block_shift;
+	vdisk_lba_status_invalidate(virt_dev);
 
 	virt_dev->size_key = 0;
 
@@ -7900,6 +8307,7 @@ static int vdev_create_node(struct scst_dev_type *devt,
 	}
 
 	spin_lock_init(&virt_dev->flags_lock);
+	spin_lock_init(&virt_dev->lba_status_lock);
 
 	virt_dev->vdev_devt = devt;
 
@@ -7992,13 +8400,67 @@ static void vdev_destroy(struct scst_vdisk_dev *virt_dev)
 
 #ifndef CONFIG_SCST_PROC
 
+#ifdef SCST_USERMODE
+/*
+ * Returns the NUMA node of the block device backing filename, e.g. of the
+ * NVMe controller of a namespace, or NUMA_NO_NODE.
+ */
+static int vdev_blockdev_node(const char *filename)
+{
+	static const char * const suffixes[] = {
+		"/device/numa_node",		/* disk */
+		"/device/device/numa_node",	/* NVMe namespace */
+		"/../device/numa_node",		/* partition */
+		"/../device/device/numa_node",
+	};
+	char path[128];
+	struct stat st;
+	int i, nodeid = NUMA_NO_NODE;
+	FILE *f;
+
+	if ((stat(filename, &st) != 0) || !S_ISBLK(st.st_mode))
+		goto out;
+
+	for (i = 0; i < ARRAY_SIZE(suffixes); i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u%s",
+			 major(st.st_rdev), minor(st.st_rdev), suffixes[i]);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if (fscanf(f, "%d", &nodeid) != 1)
+			nodeid = NUMA_NO_NODE;
+		fclose(f);
+		/* numa_node is -1 on non-NUMA hosts */
+		if (node_online(nodeid))
+			break;
+		nodeid = NUMA_NO_NODE;
+	}
+
+out:
+	return nodeid;
+}
+#endif
+
 static void vdev_check_node(struct scst_vdisk_dev **pvirt_dev, int orig_nodeid)
 {
 	struct scst_vdisk_dev *virt_dev = *pvirt_dev;
-	int nodeid = virt_dev->numa_node_id;
+	int nodeid;
 
 	TRACE_ENTRY();
 
+#ifdef SCST_USERMODE
+	/* Place the LUN on the node of its device, unless numa_node_id set */
+	if ((virt_dev->numa_node_id == NUMA_NO_NODE) &&
+	    (virt_dev->filename != NULL) && (num_online_nodes() > 1)) {
+		virt_dev->numa_node_id = vdev_blockdev_node(virt_dev->filename);
+		if (virt_dev->numa_node_id != NUMA_NO_NODE)
+			PRINT_INFO("Device %s is on NUMA node %d", virt_dev->name,
+				virt_dev->numa_node_id);
+	}
+#endif
+
+	nodeid = virt_dev->numa_node_id;
+
 	if (virt_dev->numa_node_id != orig_nodeid) {
 		struct scst_vdisk_dev *v;
 		TRACE_MEM("Realloc virt_dev %s on node %d", virt_dev->name, nodeid);
@@ -8763,6 +9225,7 @@ static int vcdrom_change(struct scst_vdisk_dev *virt_dev,
 
 	virt_dev->file_size = err;
 	virt_dev->nblocks = virt_dev->file_size >> virt_dev->dev->block_shift;
+	vdisk_lba_status_invalidate(virt_dev);
 	if (!virt_dev->cdrom_empty)
 		virt_dev->media_changed = 1;
 
@@ -8921,6 +9384,7 @@ static int vdev_size_process_store(struct scst_sysfs_work_item *work)
 	if ((new_size & ((1 << virt_dev->blk_shift) - 1)) == 0) {
 		virt_dev->file_size = new_size;
 		virt_dev->nblocks = virt_dev->file_size >> dev->block_shift;
+		vdisk_lba_status_invalidate(virt_dev);
 		virt_dev->size_key = 1;
 	} else {
 		res = -EINVAL;
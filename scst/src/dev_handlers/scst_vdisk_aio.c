@@ -6,14 +6,18 @@
  * with the BLOCKIO option ignore the BLOCKIO option and use FILEIO instead.
  *
  * When compiled with both SCST_USERMODE and SCST_USERMODE_AIO, we take over
- * implementation of BLOCKIO either here (using AIO-based MTE service) or in
- * scstu_tcmu.c (using a tcmu-runner backstore handler).
+ * implementation of BLOCKIO either here (using AIO-based MTE service), in
+ * scstu_tcmu.c (using a tcmu-runner backstore handler), or in
+ * scst_vdisk_uring.c (using io_uring).
  */
 #ifdef SCST_USERMODE
 #ifdef SCST_USERMODE_AIO
 #ifdef SCST_USERMODE_TCMU
 #include "scstu_tcmu.c"	/* build for use with tcmu-runner backstore handler */
 
+#elif defined(SCST_USERMODE_URING)
+#include "scst_vdisk_uring.c"	/* build for use with io_uring */
+
 #else /********************  Remainder of this file  ********************/
       /*********  implements blockio using MTE aio(7) facility  *********/
 #include "mtelib.h"
@@ -347,6 +351,6 @@ vdisk_fsync_blockio(loff_t loff,
 	return res;
 }
 
-#endif /* SCST_USERMODE_TCMU */
+#endif /* SCST_USERMODE_TCMU / SCST_USERMODE_URING */
 #endif /* SCST_USERMODE_AIO */
 #endif /* SCST_USERMODE */
@@ -0,0 +1,516 @@
+/* scst_vdisk_uring.c
+ * SCST_USERMODE support for async disk I/O using io_uring(7)
+ *
+ * #included by scst_vdisk_aio.c when compiled with SCST_USERMODE_URING, as an
+ * alternative implementor of blockio_exec_rw() and vdisk_fsync_blockio() to
+ * the MTE aio service.
+ *
+ * One ring is shared by all BLOCKIO LUNs.  Each LUN's file descriptor is
+ * installed in the ring's registered file table when its first tgt_dev is
+ * attached.  All the ops of one SCSI command are queued under a single hold
+ * of the submission lock and submitted with one io_uring_enter(2).  A single
+ * reaper thread applies the completions.
+ *
+ * FUA writes are issued with RWF_DSYNC.
+ */
+#ifdef SCST_USERMODE
+#ifdef SCST_USERMODE_URING
+#include <liburing.h>
+
+/* Configuration for the io_uring BLOCKIO Implementor */
+static struct vdisk_uring_cfg {
+    /* Submission queue entries; the completion queue gets twice as many */
+    unsigned int    sq_entries;
+
+    /* Nonzero to have a kernel thread poll the submission queue, going to
+     * sleep after this many milliseconds without submissions.  Saves the
+     * io_uring_enter(2) per command at the cost of a busy kernel thread. */
+    unsigned int    sqpoll_idle_ms;
+
+    /* Size of the registered file table (maximum BLOCKIO LUNs) */
+    unsigned int    max_files;
+} const uring_cfg = {
+    .sq_entries = 1024,			//XXXX TUNE
+    .sqpoll_idle_ms = 0,		/* SQPOLL off */
+    .max_files = 256,
+};
+
+#define VDISK_URING_MAXIOV 64		//XXXX TUNE
+
+typedef struct vdisk_uring_op {
+    struct list_head	    op_list_entry;	/* on submit batch */
+    struct scst_blockio_work * blockio_work;	/* read and write */
+    struct scst_cmd	  * cmd;		/* fsync (may be NULL) */
+    struct completion     * op_done;		/* for synchronous fsync */
+    void		 (* done)(struct vdisk_uring_op *, int res);
+    uint64_t		    seekpos;
+    size_t		    len;
+    uint32_t		    niov;
+    bool		    is_write;
+    bool		    fua;
+    struct iovec	    iov[VDISK_URING_MAXIOV];
+} vdisk_uring_op_t;
+
+/* Per-LUN state, hung on virt_dev->aio_private */
+typedef struct vdisk_uring_file {
+    int			    fd;
+    int			    idx;		/* registered file table index */
+    /* stats */
+    atomic64_t		    nreads;
+    atomic64_t		    nwrites;
+    atomic64_t		    nfsyncs;
+    atomic64_t		    nerrors;
+} vdisk_uring_file_t;
+
+static struct io_uring uring;
+static bool uring_sqpoll;
+static DEFINE_SPINLOCK(uring_sq_lock);	/* serializes SQ producers */
+static unsigned long * uring_file_map;	/* registered file slots in use */
+static struct kmem_cache * uring_op_cache;
+
+static struct task_struct * uring_reaper;
+static DECLARE_COMPLETION(uring_reaper_done);
+static volatile bool uring_stopping;
+
+/* Apply completions until uring_stopping is set and the wakeup NOP arrives */
+static int
+vdisk_uring_reaper(void * unused)
+{
+    while (!uring_stopping) {
+	struct io_uring_cqe * cqe;
+	unsigned head, ncqe = 0;
+	int rc = io_uring_wait_cqe(&uring, &cqe);
+	if (rc < 0) {
+	    expect_eq(rc, -EINTR, "io_uring_wait_cqe");
+	    continue;
+	}
+
+	io_uring_for_each_cqe(&uring, head, cqe) {
+	    vdisk_uring_op_t * op = io_uring_cqe_get_data(cqe);
+	    ncqe++;
+	    if (op)			/* NULL is the wakeup NOP */
+		op->done(op, cqe->res);
+	}
+
+	io_uring_cq_advance(&uring, ncqe);
+    }
+
+    complete(&uring_reaper_done);
+    return 0;
+}
+
+/* Get an SQE, pushing queued entries to the kernel if the SQ is full */
+static inline struct io_uring_sqe *
+vdisk_uring_get_sqe(void)
+{
+    struct io_uring_sqe * sqe;
+
+    lockdep_assert_held(&uring_sq_lock);
+
+    while (!(sqe = io_uring_get_sqe(&uring))) {
+	int rc = io_uring_submit(&uring);
+	if (rc < 0 && rc != -EAGAIN && rc != -EBUSY)
+	    expect_noerr(rc, "io_uring_submit");
+    }
+    return sqe;
+}
+
+static void
+init_scst_vdisk_aio(void)
+{
+    struct io_uring_params params = { };
+    int rc;
+
+    if (uring_cfg.sqpoll_idle_ms) {
+	params.flags |= IORING_SETUP_SQPOLL;
+	params.sq_thread_idle = uring_cfg.sqpoll_idle_ms;
+    }
+    params.flags |= IORING_SETUP_CQSIZE;
+    params.cq_entries = 2 * uring_cfg.sq_entries;
+
+    rc = io_uring_queue_init_params(uring_cfg.sq_entries, &uring, &params);
+    if (rc == -EPERM && (params.flags & IORING_SETUP_SQPOLL)) {
+	/* SQPOLL needs privilege on older kernels */
+	sys_warning("io_uring SQPOLL not permitted -- continuing without it");
+	params.flags &= ~IORING_SETUP_SQPOLL;
+	rc = io_uring_queue_init_params(uring_cfg.sq_entries, &uring, &params);
+    }
+    verify_noerr(rc, "io_uring_queue_init_params");
+    uring_sqpoll = !!(params.flags & IORING_SETUP_SQPOLL);
+
+    if (!(params.features & IORING_FEAT_NODROP))
+	sys_warning("io_uring lacks IORING_FEAT_NODROP -- completions may be lost"
+		    " if more than %u are outstanding", params.cq_entries);
+
+    /* Sparse table of registered files, filled in as LUNs attach */
+    {
+	int * fds = vmalloc(uring_cfg.max_files * sizeof(*fds));
+	unsigned int i;
+	for (i = 0; i < uring_cfg.max_files; i++)
+	    fds[i] = -1;
+	rc = io_uring_register_files(&uring, fds, uring_cfg.max_files);
+	verify_noerr(rc, "io_uring_register_files");
+	vfree(fds);
+    }
+    uring_file_map = vzalloc(BITS_TO_LONGS(uring_cfg.max_files) * sizeof(long));
+
+    assert_eq(uring_op_cache, NULL);
+    uring_op_cache = kmem_cache_create(
+			"uring_op_cache",
+			sizeof(struct vdisk_uring_op),
+			0,		/* use default alignment */
+			IGNORED,	/* gfp */
+			IGNORED);	/* constructer */
+
+    uring_stopping = false;
+    uring_reaper = kthread_run(vdisk_uring_reaper, NULL, "vdisk_uring");
+    verify(!IS_ERR(uring_reaper));
+
+    sys_notice("vdisk io_uring: sq_entries=%u cq_entries=%u sqpoll=%d max_files=%u",
+	       params.sq_entries, params.cq_entries, uring_sqpoll, uring_cfg.max_files);
+}
+
+static void
+exit_scst_vdisk_aio(void)
+{
+    struct io_uring_sqe * sqe;
+
+    /* Wake the reaper with a NOP so it notices uring_stopping */
+    uring_stopping = true;
+    spin_lock(&uring_sq_lock);
+    sqe = vdisk_uring_get_sqe();
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+    io_uring_submit(&uring);
+    spin_unlock(&uring_sq_lock);
+
+    wait_for_completion(&uring_reaper_done);
+    uring_reaper = NULL;
+
+    io_uring_unregister_files(&uring);
+    io_uring_queue_exit(&uring);
+
+    vfree(uring_file_map);
+    uring_file_map = NULL;
+
+    kmem_cache_destroy(uring_op_cache);
+    uring_op_cache = NULL;
+}
+
+/* Calls vdisk_attach_tgt() and then installs the file in the ring */
+static int
+vdisk_aio_attach_tgt(struct scst_tgt_dev *tgt_dev)
+{
+    TRACE_ENTRY();
+    lockdep_assert_held(&scst_mutex);
+
+    int ret = vdisk_attach_tgt(tgt_dev);
+
+    if (ret == E_OK) {
+	struct scst_vdisk_dev * virt_dev = tgt_dev->dev->dh_priv;
+	if (virt_dev->blockio && !virt_dev->aio_private) {
+	    vdisk_uring_file_t * uf;
+	    int idx = find_first_zero_bit(uring_file_map, uring_cfg.max_files);
+	    if (idx >= (int)uring_cfg.max_files) {
+		PRINT_ERROR("vdisk_uring: no free registered file slot for %s",
+			    virt_dev->name);
+		ret = -EMFILE;
+		goto fail;
+	    }
+
+	    uf = vzalloc(sizeof(*uf));
+	    uf->fd = virt_dev->fd->fd;
+	    uf->idx = idx;
+
+	    int rc = io_uring_register_files_update(&uring, idx, &uf->fd, 1);
+	    if (rc < 0) {
+		PRINT_ERROR("vdisk_uring: register %s fd=%d slot=%d failed: %d",
+			    virt_dev->name, uf->fd, idx, rc);
+		vfree(uf);
+		ret = rc;
+		goto fail;
+	    }
+
+	    set_bit(idx, uring_file_map);
+	    virt_dev->aio_private = uf;
+	    sys_notice("vdisk_aio_attach_tgt: %s size=%ld uring slot %d",
+		       virt_dev->name, virt_dev->file_size, idx);
+	}
+    }
+
+out:
+    TRACE_EXIT_RES(ret);
+    return ret;
+fail:
+    vdisk_detach_tgt(tgt_dev);
+    goto out;
+}
+
+/* Does what vdisk_detach_tgt() does, and also removes the file from the ring */
+static void
+vdisk_aio_detach_tgt(struct scst_tgt_dev *tgt_dev)
+{
+    struct scst_vdisk_dev * virt_dev = tgt_dev->dev->dh_priv;
+    TRACE_ENTRY();
+    lockdep_assert_held(&scst_mutex);
+    assert(virt_dev->blockio);
+
+    if (--virt_dev->tgt_dev_cnt == 0) {
+	vdisk_uring_file_t * uf = virt_dev->aio_private;
+	int fd = -1;
+
+	sys_notice("vdisk_aio_detach_tgt: %s reads=%"PRIu64" writes=%"PRIu64
+		   " fsyncs=%"PRIu64" errors=%"PRIu64, virt_dev->name,
+		   atomic64_read(&uf->nreads), atomic64_read(&uf->nwrites),
+		   atomic64_read(&uf->nfsyncs), atomic64_read(&uf->nerrors));
+
+	/* No ops remain outstanding once the last tgt_dev is detached */
+	int rc = io_uring_register_files_update(&uring, uf->idx, &fd, 1);
+	expect_eq(rc, 1, "io_uring_register_files_update");
+	clear_bit(uf->idx, uring_file_map);
+
+	vfree(uf);
+	virt_dev->aio_private = NULL;
+	vdisk_close_fd(virt_dev);
+    }
+
+    TRACE_EXIT();
+}
+
+static void
+uring_rw_done(vdisk_uring_op_t * op, int res)
+{
+    struct scst_blockio_work * blockio_work = op->blockio_work;
+    struct scst_vdisk_dev * virt_dev = blockio_work->cmd->dev->dh_priv;
+    vdisk_uring_file_t * uf = virt_dev->aio_private;
+    bool is_write = op->is_write;
+    errno_t error = E_OK;
+
+    if (unlikely(res < 0))
+	error = res;
+    else if (unlikely((size_t)res != op->len))
+	error = -EIO;			/* short read or write */
+
+    atomic64_inc(is_write ? &uf->nwrites : &uf->nreads);
+    kmem_cache_free(uring_op_cache, op);
+
+    if (unlikely(error != 0)) {
+	unsigned long flags;
+
+	atomic64_inc(&uf->nerrors);
+	PRINT_ERROR_RATELIMITED(
+		"io_uring for cmd %p finished with error %d (res %d)",
+		blockio_work->cmd, error, res);
+
+	/* To protect from several ops of one command finishing simultaneously */
+	spin_lock_irqsave(&vdev_err_lock, flags);
+
+	if (is_write)
+		scst_set_cmd_error(blockio_work->cmd,
+			SCST_LOAD_SENSE(scst_sense_write_error));
+	else
+		scst_set_cmd_error(blockio_work->cmd,
+			SCST_LOAD_SENSE(scst_sense_read_error));
+
+	spin_unlock_irqrestore(&vdev_err_lock, flags);
+    }
+
+    blockio_check_finish(blockio_work);
+}
+
+/* Queue the ops of one command to the ring and submit them together */
+static void
+uring_submit_batch(vdisk_uring_file_t * uf, struct list_head * batch)
+{
+    vdisk_uring_op_t * op, * next;
+
+    spin_lock(&uring_sq_lock);
+
+    list_for_each_entry_safe(op, next, batch, op_list_entry) {
+	struct io_uring_sqe * sqe = vdisk_uring_get_sqe();
+
+	list_del(&op->op_list_entry);
+
+	if (op->is_write) {
+	    io_uring_prep_writev(sqe, uf->idx, op->iov, op->niov, op->seekpos);
+	    if (op->fua)
+		sqe->rw_flags = RWF_DSYNC;
+	} else {
+	    io_uring_prep_readv(sqe, uf->idx, op->iov, op->niov, op->seekpos);
+	}
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data(sqe, op);
+    }
+
+    int rc = io_uring_submit(&uring);
+
+    spin_unlock(&uring_sq_lock);
+
+    /* Anything not consumed now stays queued for the next submit */
+    if (unlikely(rc < 0) && rc != -EAGAIN && rc != -EBUSY)
+	expect_noerr(rc, "io_uring_submit");
+}
+
+static void
+blockio_exec_rw(struct vdisk_cmd_params *p, bool is_write, bool fua)
+{
+    struct scst_cmd *cmd = p->cmd;
+    gfp_t gfp_mask = cmd->cmd_gfp_mask;
+
+    TRACE_ENTRY();
+
+    struct scst_device *dev = cmd->dev;
+    struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+    vdisk_uring_file_t * uf = virt_dev->aio_private;
+    WARN_ON(virt_dev->nullio);
+    bool dif = virt_dev->blk_integrity &&
+	       (scst_get_dif_action(scst_get_dev_dif_actions(cmd->cmd_dif_actions))
+							    != SCST_DIF_ACTION_NONE);
+    WARN_ONCE(dif, "XXX No DIF support for io_uring");
+
+    uint8_t * buf;
+    size_t length = scst_get_buf_first(cmd, &buf);	/* first segment of I/O buffer */
+
+    if (WARN_ONCE((length % 512) != 0 || ((uintptr_t)buf % 512) != 0,
+		  "Refused io_uring with invalid length %d and/or address %p.\n",
+		  length, buf)) {
+	scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_hardw_error));
+	goto put_out;
+    }
+
+    {
+	struct scst_blockio_work * blockio_work =
+			    kmem_cache_alloc(blockio_work_cachep, gfp_mask);
+	blockio_work->cmd = cmd;
+	/* Start with extra ref to block completion until we are done with the submit */
+	atomic_set(&blockio_work->bios_inflight, 1);
+
+	u64 seekpos = scst_cmd_get_lba(cmd) << dev->block_shift;
+	struct vdisk_uring_op * op = NULL;
+	LIST_HEAD(batch);
+
+	/* Translate the segments of the I/O buffer into iov entries,
+	 * coalescing adjacent buffer segments -- when we have accumulated the
+	 * maximum number of entries, or we have exhausted the list of buffer
+	 * segments, add another op to the batch.
+	 */
+	while (length > 0) {
+	    if (!op) {
+		op = kmem_cache_alloc(uring_op_cache, gfp_mask);
+		op->blockio_work = blockio_work;
+		op->done = uring_rw_done;
+		op->is_write = is_write;
+		op->fua = is_write && fua;
+		op->seekpos = seekpos;
+		op->len = 0;
+		op->niov = 0;
+	    }
+
+	    op->len += length;
+
+	    assert_lt(op->niov, ARRAY_SIZE(op->iov));
+	    if (op->niov > 0 &&
+		    buf == op->iov[op->niov-1].iov_base + op->iov[op->niov-1].iov_len) {
+		/* coalesce with previous entry */
+		op->iov[op->niov-1].iov_len += length;
+	    } else {
+		/* fill in a new entry */
+		op->iov[op->niov].iov_base = buf;
+		op->iov[op->niov].iov_len = length;
+		++op->niov;
+	    }
+
+	    scst_put_buf(cmd, buf);		 /* release current segment */
+	    length = scst_get_buf_next(cmd, &buf);	/* get next segment */
+
+	    if (op->niov >= ARRAY_SIZE(op->iov) || length == 0) {
+		assert_eq(op->len % 512, 0);
+		atomic_inc(&blockio_work->bios_inflight);
+		list_add_tail(&op->op_list_entry, &batch);
+		seekpos += op->len;
+		op = NULL;
+	    }
+	}
+
+	uring_submit_batch(uf, &batch);
+
+	blockio_check_finish(blockio_work); /* release extra ref we took on bios_inflight */
+    }
+
+out:
+    TRACE_EXIT();
+    return;
+
+put_out:
+    scst_put_buf(cmd, buf);
+    cmd->completed = 1;
+    cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, SCST_CONTEXT_SAME);
+    goto out;
+}
+
+static void
+uring_fsync_done(vdisk_uring_op_t * op, int res)
+{
+    struct scst_cmd * cmd = op->cmd;
+
+    TRACE_ENTRY();
+
+    if (unlikely(res < 0)) {
+	PRINT_ERROR("FLUSH io_uring failed: %d (cmd %p)", res, cmd);
+	if (cmd)
+	    scst_set_cmd_error(cmd, SCST_LOAD_SENSE(scst_sense_write_error));
+    }
+
+    if (cmd) {
+	cmd->completed = 1;
+	cmd->scst_cmd_done(cmd, SCST_CMD_STATE_DEFAULT, scst_estimate_context());
+    }
+
+    if (op->op_done) complete(op->op_done);
+    kmem_cache_free(uring_op_cache, op);
+
+    TRACE_EXIT();
+}
+
+static int
+vdisk_fsync_blockio(loff_t loff,
+		    loff_t len, struct scst_device *dev, gfp_t gfp_flags,
+		    struct scst_cmd *cmd, bool async)
+{
+	int res = E_OK;
+	struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+	vdisk_uring_file_t * uf = virt_dev->aio_private;
+	struct io_uring_sqe * sqe;
+
+	TRACE_ENTRY();
+	EXTRACHECKS_BUG_ON(!virt_dev->blockio);
+	WARN_ONCE(virt_dev->dif_fd != NULL, "XXX No DIF support for io_uring");
+	/** !!! CAUTION !!!: cmd can be NULL here!  **/
+
+	DECLARE_COMPLETION_ONSTACK(completion);
+
+	struct vdisk_uring_op * op = kmem_cache_alloc(uring_op_cache, gfp_flags);
+	op->cmd = cmd;
+	op->done = uring_fsync_done;
+	op->op_done = async ? NULL : &completion;
+	atomic64_inc(&uf->nfsyncs);
+
+	spin_lock(&uring_sq_lock);
+	sqe = vdisk_uring_get_sqe();
+	io_uring_prep_fsync(sqe, uf->idx, IORING_FSYNC_DATASYNC);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data(sqe, op);
+	io_uring_submit(&uring);
+	spin_unlock(&uring_sq_lock);
+					    /*** op may be gone now ***/
+
+	if (!async) {
+	    wait_for_completion(&completion);
+	}
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+#endif /* SCST_USERMODE_URING */
+#endif /* SCST_USERMODE */
@@ -2,15 +2,14 @@
  * Shim to run tcmu-runner handlers under an SCST_USERMODE build
  * Copyright 2017 David A. Butterfield
  *
- * Supports connection of a single tcmu-runner handler plugin.
+ * Supports connection of several tcmu-runner handler plugins at once, selected per-LUN by the
+ * "subtype/" prefix of the LUN's filename (e.g. "qcow/path/img" or "ram/@").
  * This supports Read/Write/Flush only -- the handler will receive NO callbacks to handle_cmd()
  */
 #ifdef SCST_USERMODE
 #ifdef SCST_USERMODE_TCMU
-#include <sys/time.h>
-#include <sys/resource.h>
-
-#define SCSTU_TIMING 1	/* XXX move to Makefile */
+#include <time.h>
+#include <dlfcn.h>
 
 #include "../../usermode/scstu_tcmu.h"
 
@@ -81,35 +80,66 @@ thread_assimilate(void)
     if (!current) _thread_assimilate();
 }
 
-/* XXX Only one handler can be registered at a time for now */
-static struct tcmur_handler * scstu_tcmu_handler;
+/******** Handler registry ********/
+
+/* Several handlers can be registered at once, each under its own subtype ("ram", "qcow", ...).
+ * Registration happens at init/exit time only (under scst_mutex or single-threaded startup),
+ * so the registry is not locked against concurrent lookups.
+ */
+#define SCSTU_TCMU_MAX_HANDLERS	8
+
+static struct tcmur_handler * scstu_tcmu_handlers[SCSTU_TCMU_MAX_HANDLERS];
+static unsigned int scstu_tcmu_nhandlers;
+
+/* dlopen(3) handles of the handler plugins loaded at init */
+static void * scstu_tcmu_dlhandles[SCSTU_TCMU_MAX_HANDLERS];
+static unsigned int scstu_tcmu_ndlhandles;
+
+static struct tcmur_handler *
+scstu_tcmu_handler_find(string_t subtype, size_t len)
+{
+    unsigned int i;
+    for (i = 0; i < scstu_tcmu_nhandlers; i++) {
+	struct tcmur_handler * handler = scstu_tcmu_handlers[i];
+	if (strlen(handler->subtype) == len && !strncmp(handler->subtype, subtype, len))
+	    return handler;
+    }
+    return NULL;
+}
 
 errno_t
 tcmur_register_handler(struct tcmur_handler * handler)
 {
-    if (scstu_tcmu_handler == handler) {
-	assert(handler->registered);
+    if (!handler->subtype || !strlen(handler->subtype) || strchr(handler->subtype, '/')) {
+	sys_warning("handler %s has bad subtype '%s'", handler->name, handler->subtype ?: "");
+	return -EINVAL;
+    }
+    if (scstu_tcmu_handler_find(handler->subtype, strlen(handler->subtype))) {
 	return -EEXIST;
     }
     if (handler->registered) {
 	return -EBADFD;	    /* messed-up state */
     }
-    if (scstu_tcmu_handler != NULL) {
+    if (scstu_tcmu_nhandlers >= ARRAY_SIZE(scstu_tcmu_handlers)) {
 	return -EBUSY;
     }
 
     handler->registered = true;
-    scstu_tcmu_handler = handler;
+    scstu_tcmu_handlers[scstu_tcmu_nhandlers++] = handler;
+    sys_notice("registered tcmu handler '%s' (%s)", handler->subtype, handler->name);
     return E_OK;
 }
 
 bool
 tcmur_unregister_handler(struct tcmur_handler * handler)
 {
-    if (handler != scstu_tcmu_handler) {
+    unsigned int i;
+    for (i = 0; i < scstu_tcmu_nhandlers; i++)
+	if (scstu_tcmu_handlers[i] == handler)
+	    break;
+
+    if (i == scstu_tcmu_nhandlers) {
 	sys_warning("unregister nonexistent handler %s", handler->name);
-	if (scstu_tcmu_handler)
-	    sys_warning("registered handler is %s", scstu_tcmu_handler->name);
 	return false;
     }
     if (!handler->registered) {
@@ -117,134 +147,387 @@ tcmur_unregister_handler(struct tcmur_handler * handler)
     }
 
     handler->registered = false;
-    scstu_tcmu_handler = NULL;
+    /* Keep the registration order -- the first handler registered is the default */
+    memmove(&scstu_tcmu_handlers[i], &scstu_tcmu_handlers[i+1],
+	    (scstu_tcmu_nhandlers - i - 1) * sizeof(scstu_tcmu_handlers[0]));
+    scstu_tcmu_handlers[--scstu_tcmu_nhandlers] = NULL;
     return true;
 }
 
-/* Track time spent in OP requests and completion callbacks -- keep these inline and fast */
+/* Select the handler for a LUN from its filename, which has the form "subtype/config", e.g.
+ * "qcow/path/img" -- the handler receives the config string starting at the '/', exactly as
+ * it would have when it was the only handler.  A filename with no recognized subtype prefix
+ * (including any filename starting with '/') goes to the first handler registered; but only
+ * if that is unambiguous, i.e. there is exactly one handler.
+ */
+static struct tcmur_handler *
+scstu_tcmu_handler_lookup(string_t filename, string_t * cfgp)
+{
+    struct tcmur_handler * handler;
+    string_t slash = strchr(filename, '/');
+
+    if (slash && slash != filename) {
+	handler = scstu_tcmu_handler_find(filename, slash - filename);
+	if (handler) {
+	    *cfgp = slash;
+	    return handler;
+	}
+    }
+
+    if (scstu_tcmu_nhandlers == 1) {
+	*cfgp = filename;
+	return scstu_tcmu_handlers[0];
+    }
 
-static inline void
-scstu_call_begin(struct tcmu_device * td, struct timeval * u, struct timeval * s)
+    tcmu_err("%s: no tcmu handler subtype prefix (\"subtype/config\") in filename\n", filename);
+    return NULL;
+}
+
+/* Call handler_init() in a plugin built as a shared object, which registers its handler(s) */
+static errno_t
+scstu_tcmu_plugin_load(string_t path)
 {
-#ifdef SCSTU_TIMING
-    struct rusage ru;
-    int rc = getrusage(RUSAGE_THREAD, &ru);
-    if (likely(rc == 0)) {
-	*u = ru.ru_utime;
-	*s = ru.ru_stime;
-    } else {
-	timerclear(u);
-	timerclear(s);
+    int (*plugin_init)(void);
+    void * dlh;
+    errno_t err;
+
+    if (scstu_tcmu_ndlhandles >= ARRAY_SIZE(scstu_tcmu_dlhandles)) {
+	sys_warning("too many tcmu handler plugins, skipping %s", path);
+	return -EBUSY;
     }
-#endif
+
+    /* RTLD_LOCAL so each plugin's handler_init() and private globals stay its own */
+    dlh = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!dlh) {
+	sys_warning("dlopen(%s): %s", path, dlerror());
+	return -ENOENT;
+    }
+
+    plugin_init = dlsym(dlh, "handler_init");
+    if (!plugin_init) {
+	sys_warning("%s: no handler_init symbol: %s", path, dlerror());
+	dlclose(dlh);
+	return -ENOEXEC;
+    }
+
+    err = plugin_init();
+    if (err) {
+	sys_warning("%s: handler_init() returned ERROR %d", path, err);
+	dlclose(dlh);
+	return err;
+    }
+
+    scstu_tcmu_dlhandles[scstu_tcmu_ndlhandles++] = dlh;
+    return E_OK;
 }
 
-static inline void
-scstu_reqcall_end(struct tcmu_device * td, struct timeval * u, struct timeval * s)
+/* Load the plugins named in the colon-separated list of shared-object paths in the
+ * SCSTU_TCMU_HANDLERS environment variable, e.g. SCSTU_TCMU_HANDLERS=./handler_ram.so:./handler_qcow.so
+ * A plugin that fails to load is skipped (with a warning) so the others can still be used.
+ */
+static void
+scstu_tcmu_plugins_load(void)
 {
-#ifdef SCSTU_TIMING
-    struct rusage ru;
-    int rc = getrusage(RUSAGE_THREAD, &ru);
-    if (unlikely(!td)) return;
-    if (likely(rc == 0)) {
-	td->last_req_utime = ru.ru_utime;
-	td->last_req_stime = ru.ru_stime;
-	if (timerisset(u)) {
-	    struct timeval delta;
-	    assert(timercmp(&ru.ru_utime, u, >=));
-	    timersub(&ru.ru_utime, u, &delta);
-	    timeradd(&delta, &td->req_utime, &td->req_utime);
-
-	    assert(timercmp(&ru.ru_stime, s, >=));
-	    timersub(&ru.ru_stime, s, &delta);
-	    timeradd(&delta, &td->req_stime, &td->req_stime);
-	    td->nreq++;
-	}
+    string_t list = getenv("SCSTU_TCMU_HANDLERS");
+    char * paths, * path, * saveptr;
+
+    if (!list || !strlen(list))
+	return;
+
+    paths = kstrdup(list, GFP_KERNEL);
+    if (!paths)
+	return;
+    for (path = strtok_r(paths, ":", &saveptr); path; path = strtok_r(NULL, ":", &saveptr))
+	(void)scstu_tcmu_plugin_load(path);
+    kfree(paths);
+}
+
+static void
+scstu_tcmu_handlers_exit(void)
+{
+    while (scstu_tcmu_nhandlers) {
+	struct tcmur_handler * handler = scstu_tcmu_handlers[scstu_tcmu_nhandlers - 1];
+	expect(handler->registered);
+	if (handler->handler_exit)
+	    handler->handler_exit();
+	/* Handler should have unregistered itself; if not, do it for it */
+	if (scstu_tcmu_nhandlers && scstu_tcmu_handlers[scstu_tcmu_nhandlers - 1] == handler)
+	    tcmur_unregister_handler(handler);
     }
+
+    while (scstu_tcmu_ndlhandles)
+	dlclose(scstu_tcmu_dlhandles[--scstu_tcmu_ndlhandles]);
+}
+
+/******** Per-OP latency sampling ********/
+
+/* Track time spent in OP requests, in the handler, and in completion callbacks -- keep
+ * these inline and fast.  Samples are taken from the TSC where there is one (converted to
+ * nanoseconds using a multiplier calibrated at init), otherwise from CLOCK_MONOTONIC_COARSE;
+ * neither makes a system call.
+ */
+#define SCSTU_NS_SHIFT 20
+
+static uint64_t scstu_ns_mult = 1ull << SCSTU_NS_SHIFT;	/* ns per tick << SCSTU_NS_SHIFT */
+
+/* Serializes sysfs readers of virt_dev->aio_private against its removal at detach */
+static DEFINE_SPINLOCK(scstu_tcmu_stat_lock);
+
+static inline uint64_t
+scstu_clock_ns_raw(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t
+scstu_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t
+scstu_ticks_to_ns(uint64_t ticks)
+{
+    return (ticks * scstu_ns_mult) >> SCSTU_NS_SHIFT;
+}
+
+static void
+scstu_clock_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t ns0 = scstu_clock_ns_raw();
+    uint64_t t0 = scstu_clock();
+    usleep(20000);
+    uint64_t t1 = scstu_clock();
+    uint64_t ns1 = scstu_clock_ns_raw();
+
+    if (t1 > t0 && ns1 > ns0)
+	scstu_ns_mult = ((ns1 - ns0) << SCSTU_NS_SHIFT) / (t1 - t0);
+
+    sys_notice(LOGID" TSC calibrated at %"PRIu64" ticks/usec",
+	       (t1 - t0) * 1000 / ((ns1 - ns0) ?: 1));
 #endif
 }
 
 static inline void
-scstu_rspcall_end(struct tcmu_device * td, struct timeval * u, struct timeval * s)
+scstu_lat_record(struct tcmu_device * td, int phase, uint64_t t_begin, uint64_t t_end)
+{
+    struct scstu_lat_hist * h = &td->lat[raw_smp_processor_id()].hist[phase];
+    uint64_t ns = t_end > t_begin ? scstu_ticks_to_ns(t_end - t_begin) : 0;
+    int b = ns >> 7 ? ilog2(ns >> 7) + 1 : 0;
+    if (b >= SCSTU_LAT_BUCKETS) b = SCSTU_LAT_BUCKETS - 1;
+
+    h->count++;
+    h->sum_ns += ns;
+    h->bucket[b]++;
+}
+
+static inline bool
+scstu_timing(struct tcmu_device * td)
 {
 #ifdef SCSTU_TIMING
-    struct rusage ru;
-    int rc = getrusage(RUSAGE_THREAD, &ru);
-    if (unlikely(!td)) return;
-    if (likely(rc == 0)) {
-	td->last_rsp_utime = ru.ru_utime;
-	td->last_rsp_stime = ru.ru_stime;
-	if (timerisset(u)) {
-	    struct timeval delta;
-	    assert(timercmp(&ru.ru_utime, u, >=));
-	    timersub(&ru.ru_utime, u, &delta);
-	    timeradd(&delta, &td->rsp_utime, &td->rsp_utime);
-
-	    assert(timercmp(&ru.ru_stime, s, >=));
-	    timersub(&ru.ru_stime, s, &delta);
-	    timeradd(&delta, &td->rsp_stime, &td->rsp_stime);
-	    td->nrsp++;
-	}
-    }
+    return td && READ_ONCE(td->timing) && td->lat;
+#else
+    return false;
 #endif
 }
 
-static inline uint32_t
-PCT(uint64_t const n, uint64_t const d)
+/* Returns the start time to pass to scstu_reqcall_end(), or zero if not timing */
+static inline uint64_t
+scstu_reqcall_begin(struct tcmu_device * td, struct tcmulib_cmd * op)
+{
+    if (!scstu_timing(td)) {
+	op->t_submit = 0;
+	return 0;
+    }
+    return op->t_submit = scstu_clock();
+}
+
+static inline void
+scstu_reqcall_end(struct tcmu_device * td, uint64_t t_begin)
+{
+    if (t_begin)
+	scstu_lat_record(td, SCSTU_LAT_REQ, t_begin, scstu_clock());
+}
+
+/* NB: the op may be freed during the callback, so t_submit is consumed here */
+static inline uint64_t
+scstu_rspcall_begin(struct tcmu_device * td, struct tcmulib_cmd * op)
+{
+    uint64_t now;
+    if (!op->t_submit || !scstu_timing(td))
+	return 0;
+    now = scstu_clock();
+    scstu_lat_record(td, SCSTU_LAT_SVC, op->t_submit, now);
+    return now;
+}
+
+static inline void
+scstu_rspcall_end(struct tcmu_device * td, uint64_t t_begin)
+{
+    if (t_begin)
+	scstu_lat_record(td, SCSTU_LAT_RSP, t_begin, scstu_clock());
+}
+
+static const char * const scstu_lat_phase_names[SCSTU_LAT_NPHASE] = {
+    [SCSTU_LAT_REQ] = "request",
+    [SCSTU_LAT_SVC] = "handler",
+    [SCSTU_LAT_RSP] = "response",
+};
+
+/* Sum the per-CPU histograms of one phase of a device into *sum */
+static void
+scstu_tcmu_lat_sum(struct tcmu_device * td, int phase, struct scstu_lat_hist * sum)
 {
-    return d ? (100*n + d/2) / d : 0;
+    int cpu, b;
+
+    memset(sum, 0, sizeof(*sum));
+    if (!td->lat)
+	return;
+
+    for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+	const struct scstu_lat_hist * h = &td->lat[cpu].hist[phase];
+	sum->count += READ_ONCE(h->count);
+	sum->sum_ns += READ_ONCE(h->sum_ns);
+	for (b = 0; b < SCSTU_LAT_BUCKETS; b++)
+	    sum->bucket[b] += READ_ONCE(h->bucket[b]);
+    }
 }
 
-/* CPU time tracked is time spent in the handler during Requests, and time
- * spent in SCST during Responses.  This can be used to estimate the division
- * of time on Request and Response threads between SCST and our client
- * interface to the backstorage.
+/* Format the latency histograms of a device: one line per phase with the OP count, the
+ * mean latency in nanoseconds, and the count in each bucket (see struct scstu_lat_hist)
  */
+static int
+scstu_tcmu_lat_format(struct tcmu_device * td, char * buf, int size)
+{
+    struct scstu_lat_hist h;
+    int pos = 0;
+    int phase, b;
+
+    for (phase = 0; phase < SCSTU_LAT_NPHASE; phase++) {
+	scstu_tcmu_lat_sum(td, phase, &h);
+
+	pos += scnprintf(buf + pos, size - pos, "%-8s count=%"PRIu64" mean_ns=%"PRIu64" buckets:",
+			 scstu_lat_phase_names[phase], h.count, h.count ? h.sum_ns / h.count : 0);
+	for (b = 0; b < SCSTU_LAT_BUCKETS; b++)
+	    pos += scnprintf(buf + pos, size - pos, " %"PRIu64, h.bucket[b]);
+	pos += scnprintf(buf + pos, size - pos, "\n");
+    }
+    return pos;
+}
+
+/* Racy against OPs completing meanwhile, which may survive the reset */
+static void
+scstu_tcmu_lat_reset(struct tcmu_device * td)
+{
+    if (td->lat)
+	memset(td->lat, 0, nr_cpu_ids * sizeof(*td->lat));
+}
+
 static void
 scstu_tcmu_device_stat_dump(struct tcmu_device * td)
 {
-#ifdef SCSTU_TIMING
-    uint64_t tot_u_req = 1000000u * td->last_req_utime.tv_sec + td->last_req_utime.tv_usec;
-    uint64_t tot_s_req = 1000000u * td->last_req_stime.tv_sec + td->last_req_stime.tv_usec;
-    uint64_t tot_u_rsp = 1000000u * td->last_rsp_utime.tv_sec + td->last_rsp_utime.tv_usec;
-    uint64_t tot_s_rsp = 1000000u * td->last_rsp_stime.tv_sec + td->last_rsp_stime.tv_usec;
-
-    uint64_t req_utime = 1000000u * td->req_utime.tv_sec + td->req_utime.tv_usec;
-    uint64_t req_stime = 1000000u * td->req_stime.tv_sec + td->req_stime.tv_usec;
-    uint64_t rsp_utime = 1000000u * td->rsp_utime.tv_sec + td->rsp_utime.tv_usec;
-    uint64_t rsp_stime = 1000000u * td->rsp_stime.tv_sec + td->rsp_stime.tv_usec;
-
-    /* Share of Request thread's usr/sys time spent in the handler */
-    uint32_t req_u_pct = PCT(req_utime, tot_u_req);
-    uint32_t req_s_pct = PCT(req_stime, tot_s_req);
-    /* Share of Response thread's usr/sys time spent in the SCST callback */
-    uint32_t rsp_u_pct = PCT(rsp_utime, tot_u_rsp);
-    uint32_t rsp_s_pct = PCT(rsp_stime, tot_s_rsp);
-
-    /* Time per op spent in handler during Request (in units of 10ns) */
-    uint32_t req_u_per = PCT(req_utime, td->nreq);
-    uint32_t req_s_per = PCT(req_stime, td->nreq);
-    /* Time per op spent in SCST during Response */
-    uint32_t rsp_u_per = PCT(rsp_utime, td->nrsp);
-    uint32_t rsp_s_per = PCT(rsp_stime, td->nrsp);
-
-    /* Total time per op on Request thread (in units of 10ns) */
-    uint32_t treq_u_per = PCT(tot_u_req, td->nreq);
-    uint32_t treq_s_per = PCT(tot_s_req, td->nreq);
-    /* Total time per op on Response thread */
-    uint32_t trsp_u_per = PCT(tot_u_rsp, td->nrsp);
-    uint32_t trsp_s_per = PCT(tot_s_rsp, td->nrsp);
-
-    sys_notice(LOGID
-	    " device %s (%s) handler %s nreq=%"PRIu64" (microseconds per OP, %% of thread):"
-	    " REQ_USR=%u.%02u/%u.%02u (%u%%)  REQ_SYS=%u.%02u/%u.%02u (%u%%)"
-	    " RSP_USR=%u.%02u/%u.%02u (%u%%)  RSP_SYS=%u.%02u/%u.%02u (%u%%)",
-	    td->dev_name, td->cfgstring_orig, td->handler->name, td->nreq,
-	    req_u_per/100, req_u_per%100, treq_u_per/100, treq_u_per%100, req_u_pct,
-	    req_s_per/100, req_s_per%100, treq_s_per/100, treq_s_per%100, req_s_pct,
-	    rsp_u_per/100, rsp_u_per%100, trsp_u_per/100, trsp_u_per%100, rsp_u_pct,
-	    rsp_s_per/100, rsp_s_per%100, trsp_s_per/100, trsp_s_per%100, rsp_s_pct);
+    char buf[SCSTU_LAT_NPHASE * (SCSTU_LAT_BUCKETS * 8 + 64)];
+    struct scstu_lat_hist h;
+
+    scstu_tcmu_lat_sum(td, SCSTU_LAT_REQ, &h);
+    if (!h.count)
+	return;
+    scstu_tcmu_lat_format(td, buf, sizeof(buf));
+    sys_notice(LOGID" device %s (%s) handler %s latency:\n%s",
+	       td->dev_name, td->cfgstring_orig, td->handler->name, buf);
+}
+
+/******** sysfs ********/
+
+/* tcmu_latency: read the device's latency histograms; write anything to reset them */
+static ssize_t
+vdisk_tcmu_latency_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct scst_device *dev = container_of(kobj, struct scst_device, dev_kobj);
+    struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+    struct tcmu_device * td;
+    int pos = 0;
+
+    spin_lock(&scstu_tcmu_stat_lock);
+    td = virt_dev->aio_private;
+    if (td)
+	pos = scstu_tcmu_lat_format(td, buf, PAGE_SIZE);
+    spin_unlock(&scstu_tcmu_stat_lock);
+
+    return pos;
+}
+
+static ssize_t
+vdisk_tcmu_latency_store(struct kobject *kobj, struct kobj_attribute *attr,
+			 const char *buf, size_t count)
+{
+    struct scst_device *dev = container_of(kobj, struct scst_device, dev_kobj);
+    struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+    struct tcmu_device * td;
+
+    spin_lock(&scstu_tcmu_stat_lock);
+    td = virt_dev->aio_private;
+    if (td)
+	scstu_tcmu_lat_reset(td);
+    spin_unlock(&scstu_tcmu_stat_lock);
+
+    return count;
+}
+
+/* tcmu_timing: runtime switch for per-OP latency sampling on the device (0 or 1) */
+static ssize_t
+vdisk_tcmu_timing_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct scst_device *dev = container_of(kobj, struct scst_device, dev_kobj);
+    struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+    struct tcmu_device * td;
+    int pos = 0;
+
+    spin_lock(&scstu_tcmu_stat_lock);
+    td = virt_dev->aio_private;
+    if (td)
+	pos = sprintf(buf, "%d\n", td->timing);
+    spin_unlock(&scstu_tcmu_stat_lock);
+
+    return pos;
+}
+
+static ssize_t
+vdisk_tcmu_timing_store(struct kobject *kobj, struct kobj_attribute *attr,
+			const char *buf, size_t count)
+{
+    struct scst_device *dev = container_of(kobj, struct scst_device, dev_kobj);
+    struct scst_vdisk_dev *virt_dev = dev->dh_priv;
+    struct tcmu_device * td;
+    unsigned long val;
+    int res;
+
+    res = kstrtoul(buf, 0, &val);
+    if (res)
+	return res;
+    if (val > 1)
+	return -EINVAL;
+#ifndef SCSTU_TIMING
+    if (val)
+	return -EOPNOTSUPP;
 #endif
+
+    spin_lock(&scstu_tcmu_stat_lock);
+    td = virt_dev->aio_private;
+    if (td)
+	WRITE_ONCE(td->timing, val);
+    spin_unlock(&scstu_tcmu_stat_lock);
+
+    return td ? count : -ENODEV;
 }
 
 /******** SCST VDISK BLOCKIO Implementor ********/
@@ -261,17 +544,29 @@ init_scst_vdisk_aio(void)
 			IGNORED);	/* constructer */
     assert(op_cache);
 
-    assert(!scstu_tcmu_handler);
-    errno_t err = handler_init();
-    if (err) {
-	sys_warning("handler_init() returned ERROR %d", err);
-	expect(scstu_tcmu_handler == NULL);
-	scstu_tcmu_handler = NULL;	/* just in case */
+#ifdef SCSTU_TIMING
+    scstu_clock_calibrate();
+#endif
+
+    assert_eq(scstu_tcmu_nhandlers, 0);
+
+    /* A handler linked statically into the executable provides handler_init() directly */
+    if (handler_init) {
+	errno_t err = handler_init();
+	if (err)
+	    sys_warning("handler_init() returned ERROR %d", err);
+    }
+
+    /* Any number of others can be loaded as shared-object plugins */
+    scstu_tcmu_plugins_load();
+
+    if (!scstu_tcmu_nhandlers) {
+	sys_warning("no tcmu handlers registered");
+	scstu_tcmu_handlers_exit();
 	kmem_cache_destroy(op_cache);
 	op_cache = NULL;
-	return err;
+	return -ENOENT;
     }
-    assert(scstu_tcmu_handler);
 
     return E_OK;
 }
@@ -279,16 +574,9 @@ init_scst_vdisk_aio(void)
 static void
 exit_scst_vdisk_aio(void)
 {
-    assert(scstu_tcmu_handler);
+    assert(scstu_tcmu_nhandlers);
     assert(op_cache);
-    if (scstu_tcmu_handler) {
-	expect(scstu_tcmu_handler->registered);
-	if (scstu_tcmu_handler->handler_exit) {
-	    scstu_tcmu_handler->handler_exit();
-	    expect(scstu_tcmu_handler == NULL);
-	}
-	scstu_tcmu_handler = NULL;
-    }
+    scstu_tcmu_handlers_exit();
     kmem_cache_destroy(op_cache);
     op_cache = NULL;
 }
@@ -329,6 +617,12 @@ scstu_tcmu_openprep(struct scst_vdisk_dev * virt_dev, struct tcmur_handler * han
     memcpy(tcmu_dev->cfgstring, tcmu_dev->cfgstring_orig, sizeof(tcmu_dev->cfgstring));
     tcmu_set_dev_block_size(tcmu_dev, block_size);
     tcmu_set_dev_num_lbas(tcmu_dev, tcmu_size/block_size);
+#ifdef SCSTU_TIMING
+    /* Sampling stays off until turned on through tcmu_timing */
+    tcmu_dev->lat = kcalloc(nr_cpu_ids, sizeof(*tcmu_dev->lat), GFP_KERNEL);
+    if (!tcmu_dev->lat)
+	tcmu_warn("%s: no memory for latency histograms\n", name);
+#endif
 
     tcmu_dev_dbg(tcmu_dev, "block_size %ld, size in bytes %lld\n", block_size, tcmu_size);
 
@@ -341,6 +635,8 @@ vdisk_aio_attach_tgt(struct scst_tgt_dev * tgt_dev)
     errno_t err;
     size_t dev_size;
     struct tcmu_device * tcmu_dev;
+    struct tcmur_handler * handler;
+    string_t cfg;
     struct scst_vdisk_dev * virt_dev = tgt_dev->dev->dh_priv;
     assert(virt_dev);
     assert(virt_dev->blockio);
@@ -355,8 +651,12 @@ vdisk_aio_attach_tgt(struct scst_tgt_dev * tgt_dev)
 	return -EINVAL;
     }
 
-    /* XXX To support multiple handlers, add code here to lookup the handler */
-    tcmu_dev = scstu_tcmu_openprep(virt_dev, scstu_tcmu_handler, "scstu_tcmu", virt_dev->filename);
+    handler = scstu_tcmu_handler_lookup(virt_dev->filename, &cfg);
+    if (!handler) {
+	return -EINVAL;
+    }
+
+    tcmu_dev = scstu_tcmu_openprep(virt_dev, handler, "scstu_tcmu", cfg);
     if (!tcmu_dev) {
 	err = EINVAL;
 	goto out;
@@ -416,8 +716,11 @@ out:
 fail_close:
     tcmu_dev->handler->close(tcmu_dev);
     virt_dev->tgt_dev_cnt--;
+    spin_lock(&scstu_tcmu_stat_lock);
     virt_dev->aio_private = NULL;
+    spin_unlock(&scstu_tcmu_stat_lock);
 fail_free:
+    kfree(tcmu_dev->lat);
     vfree(tcmu_dev);
     goto out;
 }
@@ -445,7 +748,10 @@ vdisk_aio_detach_tgt(struct scst_tgt_dev * tgt_dev)
     scstu_tcmu_device_stat_dump(tcmu_dev);
 
     tcmu_dev->handler->close(tcmu_dev);
+    spin_lock(&scstu_tcmu_stat_lock);
     virt_dev->aio_private = NULL;
+    spin_unlock(&scstu_tcmu_stat_lock);
+    kfree(tcmu_dev->lat);
     vfree(tcmu_dev);
 }
 
@@ -483,19 +789,17 @@ aio_endio(struct tcmu_device * tcmu_dev, struct tcmulib_cmd * op, sam_stat_t sam
 static void
 aio_readv_done(struct tcmu_device * tcmu_dev, struct tcmulib_cmd * op, sam_stat_t sam_stat)
 {
-    struct timeval u, s;
-    scstu_call_begin(tcmu_dev, &u, &s);
+    uint64_t t = scstu_rspcall_begin(tcmu_dev, op);
     aio_endio(tcmu_dev, op, sam_stat, false);
-    scstu_rspcall_end(tcmu_dev, &u, &s);
+    scstu_rspcall_end(tcmu_dev, t);
 }
 
 static void
 aio_writev_done(struct tcmu_device * tcmu_dev, struct tcmulib_cmd * op, sam_stat_t sam_stat)
 {
-    struct timeval u, s;
-    scstu_call_begin(tcmu_dev, &u, &s);
+    uint64_t t = scstu_rspcall_begin(tcmu_dev, op);
     aio_endio(tcmu_dev, op, sam_stat, true);
-    scstu_rspcall_end(tcmu_dev, &u, &s);
+    scstu_rspcall_end(tcmu_dev, t);
 }
 
 static void
@@ -571,18 +875,18 @@ blockio_exec_rw(struct vdisk_cmd_params *p, bool is_write, bool fua)
 
     /* Submit the command to the handler */
     sam_stat_t sam_stat;
-    struct timeval u, s;
+    uint64_t t;
     if (is_write) {
 	op->done = aio_writev_done;
-	scstu_call_begin(tcmu_dev, &u, &s);
+	t = scstu_reqcall_begin(tcmu_dev, op);
 	sam_stat = tcmu_dev->handler->write(op->tcmu_dev, op, op->iovec, op->iov_cnt, op->len, seekpos);
-	scstu_reqcall_end(tcmu_dev, &u, &s);
+	scstu_reqcall_end(tcmu_dev, t);
 	if (sam_stat != SAM_STAT_GOOD) goto out_finish;
     } else {
 	op->done = aio_readv_done;
-	scstu_call_begin(tcmu_dev, &u, &s);
+	t = scstu_reqcall_begin(tcmu_dev, op);
 	sam_stat = tcmu_dev->handler->read(op->tcmu_dev, op, op->iovec, op->iov_cnt, op->len, seekpos);
-	scstu_reqcall_end(tcmu_dev, &u, &s);
+	scstu_reqcall_end(tcmu_dev, t);
 	if (sam_stat != SAM_STAT_GOOD) goto out_finish;
     }
 
@@ -678,6 +982,109 @@ out_finish:
     goto out;
 }
 
+static void
+aio_zero_done(struct tcmu_device * tcmu_dev, struct tcmulib_cmd * op, sam_stat_t sam_stat)
+{
+    thread_assimilate();
+    op->sync_stat = sam_stat;
+    complete(op->sync_done);
+}
+
+/* Zero a byte range through the handler's optional write_zeroes entry point, synchronously.
+ * Returns -EOPNOTSUPP (without setting sense) if the handler does not implement it.
+ */
+static int
+vdisk_tcmu_zero_range(struct scst_cmd * scst_cmd, loff_t off, loff_t len)
+{
+    errno_t err = E_OK;
+    struct scst_vdisk_dev * virt_dev = scst_cmd->dev->dh_priv;
+    struct tcmu_device * tcmu_dev = virt_dev->aio_private;
+    struct tcmulib_cmd * op;
+    DECLARE_COMPLETION_ONSTACK(scst_completion);
+
+    TRACE_ENTRY();
+    EXTRACHECKS_BUG_ON(!virt_dev->blockio);
+
+    assert(tcmu_dev);
+    assert(tcmu_dev->handler);
+    assert(tcmu_dev->handler->registered);
+
+    if (!tcmu_dev->handler->write_zeroes) {
+	err = -EOPNOTSUPP;
+	goto out;
+    }
+
+    op = kmem_cache_zalloc(op_cache, scst_cmd->cmd_gfp_mask);
+    op->scst_cmd = scst_cmd;
+    op->tcmu_dev = tcmu_dev;
+    op->len = len;
+    op->done = aio_zero_done;
+    op->sync_done = &scst_completion;
+
+    sam_stat_t sam_stat = tcmu_dev->handler->write_zeroes(op->tcmu_dev, op, off, len);
+    if (sam_stat != SAM_STAT_GOOD) {
+	PRINT_ERROR(LOGID" write_zeroes submit failed: %d (scst_cmd %p)", sam_stat, scst_cmd);
+	scst_set_cmd_error(scst_cmd, SCST_LOAD_SENSE(scst_sense_internal_failure));
+	err = -EIO;
+	goto out_free;
+    }
+
+    wait_for_completion(&scst_completion);
+
+    if (unlikely(op->sync_stat != SAM_STAT_GOOD)) {
+	PRINT_ERROR(LOGID" write_zeroes failed: %d (scst_cmd %p)", op->sync_stat, scst_cmd);
+	errno_t rc = scst_alloc_sense(scst_cmd, IGNORED);
+	assert(!rc);
+	size_t copylen = min_t(int, scst_cmd->sense_buflen, SENSE_BUF_USED);
+	memcpy(scst_cmd->sense, op->sense_buf, copylen);
+	scst_cmd->sense_valid_len = copylen;
+	err = -EIO;
+    }
+
+out_free:
+    kmem_cache_free(op_cache, op);
+out:
+    TRACE_EXIT_RES(err);
+    return err;
+}
+
+/* Return how many bytes from off, at most len, the handler's optional get_lba_status entry
+ * point reports as all mapped or all deallocated (*mapped), or -errno. Without the entry
+ * point everything is reported mapped.
+ */
+static int64_t
+vdisk_tcmu_get_lba_status(struct scst_vdisk_dev * virt_dev, loff_t off, loff_t len, bool * mapped)
+{
+    struct tcmu_device * tcmu_dev = virt_dev->aio_private;
+    uint64_t nbytes = len;
+    int64_t ret;
+
+    TRACE_ENTRY();
+    EXTRACHECKS_BUG_ON(!virt_dev->blockio);
+
+    assert(tcmu_dev);
+    assert(tcmu_dev->handler);
+    assert(tcmu_dev->handler->registered);
+
+    *mapped = true;
+    if (!tcmu_dev->handler->get_lba_status) {
+	ret = len;
+	goto out;
+    }
+
+    ret = tcmu_dev->handler->get_lba_status(tcmu_dev, off, &nbytes, mapped);
+    if (ret < 0) {
+	PRINT_ERROR(LOGID" get_lba_status failed: %lld (off %lld)", (long long)ret, (long long)off);
+	goto out;
+    }
+
+    ret = min_t(uint64_t, nbytes, len);
+
+out:
+    TRACE_EXIT_RES(ret);
+    return ret;
+}
+
 /* Return 0 on success with file size in *file_size; otherwise -errno */
 static errno_t
 vdisk_get_file_size(const struct scst_vdisk_dev *virt_devc, loff_t *file_sizep)
@@ -686,6 +1093,8 @@ vdisk_get_file_size(const struct scst_vdisk_dev *virt_devc, loff_t *file_sizep)
     const char *filename = virt_dev->filename;
     errno_t err = E_OK;
     struct tcmu_device * tcmu_dev;
+    struct tcmur_handler * handler;
+    string_t cfg;
 
     TRACE_ENTRY();
     lockdep_assert_held(&scst_mutex);
@@ -696,8 +1105,13 @@ vdisk_get_file_size(const struct scst_vdisk_dev *virt_devc, loff_t *file_sizep)
 
     *file_sizep = 0;
 
-    /* XXX To support multiple handlers, add code here to lookup the handler */
-    tcmu_dev = scstu_tcmu_openprep(virt_dev, scstu_tcmu_handler, "scstu_tcmu", filename);
+    handler = scstu_tcmu_handler_lookup(filename, &cfg);
+    if (!handler) {
+	err = EINVAL;
+	goto out;
+    }
+
+    tcmu_dev = scstu_tcmu_openprep(virt_dev, handler, "scstu_tcmu", cfg);
     if (!tcmu_dev) {
 	err = EINVAL;
 	goto out;
@@ -720,6 +1134,7 @@ vdisk_get_file_size(const struct scst_vdisk_dev *virt_devc, loff_t *file_sizep)
     tcmu_dev->handler->close(tcmu_dev);
 
 out_free:
+    kfree(tcmu_dev->lat);
     vfree(tcmu_dev);
 out:
     trace_tcmu("TCMU device size=%"PRIu64, *file_sizep);
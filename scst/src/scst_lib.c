@@ -4190,6 +4190,7 @@ int scst_alloc_device(gfp_t gfp_mask, int nodeid,
 	scst_init_mem_lim(&dev->dev_mem_lim);
 	spin_lock_init(&dev->dev_lock);
 	INIT_LIST_HEAD(&dev->dev_exec_cmd_list);
+	INIT_LIST_HEAD(&dev->dev_exec_nolba_cmd_list);
 	INIT_LIST_HEAD(&dev->blocked_cmd_list);
 	INIT_LIST_HEAD(&dev->dev_tgt_dev_list);
 	INIT_LIST_HEAD(&dev->dev_acg_dev_list);
@@ -4227,6 +4228,7 @@ void scst_free_device(struct scst_device *dev)
 
 	EXTRACHECKS_BUG_ON(dev->dev_scsi_atomic_cmd_active != 0);
 	EXTRACHECKS_BUG_ON(!list_empty(&dev->dev_exec_cmd_list));
+	EXTRACHECKS_BUG_ON(!list_empty(&dev->dev_exec_nolba_cmd_list));
 
 #ifdef CONFIG_SCST_EXTRACHECKS
 	if (!list_empty(&dev->dev_tgt_dev_list) ||
@@ -5382,6 +5384,11 @@ static int scst_alloc_add_tgt_dev(struct scst_session *sess,
 		goto out_detach;
 
 	spin_lock_bh(&dev->dev_lock);
+	/*
+	 * Under dev_lock, so either this or scst_pr_publish_verdicts() for
+	 * a concurrent PR change sees the final PR state.
+	 */
+	scst_pr_set_verdict(tgt_dev);
 	list_add_tail(&tgt_dev->dev_tgt_dev_list_entry, &dev->dev_tgt_dev_list);
 	spin_unlock_bh(&dev->dev_lock);
 
@@ -6889,6 +6896,7 @@ struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
 
 	sess->init_phase = SCST_SESS_IPH_INITING;
 	sess->shut_phase = SCST_SESS_SPH_READY;
+	sess->sess_numa_node_id = NUMA_NO_NODE;
 	atomic_set(&sess->refcnt, 0);
 	for (i = 0; i < SESS_TGT_DEV_LIST_HASH_SIZE; i++) {
 		struct list_head *head = &sess->sess_tgt_dev_list[i];
@@ -6897,6 +6905,8 @@ struct scst_session *scst_alloc_session(struct scst_tgt *tgt, gfp_t gfp_mask,
 	}
 	spin_lock_init(&sess->sess_list_lock);
 	INIT_LIST_HEAD(&sess->sess_cmd_list);
+	for (i = 0; i < SESS_CMD_TAG_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&sess->sess_cmd_tag_hash[i]);
 	sess->tgt = tgt;
 	INIT_LIST_HEAD(&sess->init_deferred_cmd_list);
 	INIT_LIST_HEAD(&sess->init_deferred_mcmd_list);
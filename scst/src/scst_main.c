@@ -40,6 +40,11 @@
 #include "scst_mem.h"
 #include "scst_pres.h"
 
+#ifdef SCST_USERMODE
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
 #if defined(CONFIG_HIGHMEM4G) || defined(CONFIG_HIGHMEM64G)
 #warning HIGHMEM kernel configurations are fully supported, but not \
 recommended for performance reasons. Consider changing VMSPLIT \
@@ -150,6 +155,17 @@ static struct mutex scst_cmd_threads_mutex;
 static struct list_head scst_cmd_threads_list;
 
 int scst_threads;
+int scst_node_threads;
+
+/*
+ * Threads of scst_main_cmd_threads by index, for the scst_node_threads
+ * session affinity. Rebuilt under scst_mutex with suspended activities only,
+ * so scst_translate_lun() reads them without locks.
+ */
+struct scst_cmd_thread_t **scst_main_thr_array;
+int scst_main_thr_cnt;
+struct scst_node_thrs *scst_main_thr_nodes;
+
 static struct task_struct *scst_init_cmd_thread;
 static struct task_struct *scst_mgmt_thread;
 static struct task_struct *scst_mgmt_cmd_thread;
@@ -178,10 +194,16 @@ static unsigned int scst_max_cmd_mem;
 unsigned int scst_max_dev_cmd_mem;
 int scst_forcibly_close_sessions;
 int scst_auto_cm_assignment = true;
+int scst_work_stealing = true;
 
 module_param_named(scst_threads, scst_threads, int, S_IRUGO);
 MODULE_PARM_DESC(scst_threads, "SCSI target threads count");
 
+module_param_named(scst_node_threads, scst_node_threads, int, S_IRUGO);
+MODULE_PARM_DESC(scst_node_threads, "SCSI target threads count per NUMA node. "
+	"If set, overrides scst_threads, binds the threads to the CPUs of their "
+	"node and processes all commands of a session on the same thread");
+
 module_param_named(scst_max_cmd_mem, scst_max_cmd_mem, int, S_IRUGO);
 MODULE_PARM_DESC(scst_max_cmd_mem, "Maximum memory allowed to be consumed by "
 	"all SCSI commands of all devices at any given time in MB");
@@ -200,6 +222,11 @@ module_param_named(auto_cm_assignment, scst_auto_cm_assignment, int,
 		   S_IWUSR | S_IRUGO);
 MODULE_PARM_DESC(auto_cm_assignment, "Enables the copy managers auto registration");
 
+module_param_named(work_stealing, scst_work_stealing, int, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(work_stealing, "If enabled, idle processing threads take "
+	"commands queued to busy threads of the same pool and threads take "
+	"commands from their pool's queue in batches");
+
 struct scst_dev_type scst_null_devtype = {
 	.name = "none",
 	.threads_num = -1,
@@ -1905,12 +1932,89 @@ void scst_unregister_virtual_dev_driver(struct scst_dev_type *dev_type)
 }
 EXPORT_SYMBOL_GPL(scst_unregister_virtual_dev_driver);
 
+/* Returns the NUMA node of the n-th scst_main_cmd_threads thread */
+static int scst_main_thr_nodeid(int n)
+{
+	int node, i = (n / scst_node_threads) % num_online_nodes();
+
+	for_each_online_node(node) {
+		if (i-- == 0)
+			return node;
+	}
+	return NUMA_NO_NODE;
+}
+
+/*
+ * Must be called under scst_mutex with suspended activities, or while there
+ * can't be any commands, after the scst_main_cmd_threads threads changed.
+ */
+void scst_main_thr_array_rebuild(void)
+{
+	struct scst_cmd_threads *cmd_threads = &scst_main_cmd_threads;
+	struct scst_cmd_thread_t **a = NULL, *thr;
+	struct scst_node_thrs *nodes = NULL;
+	int n = 0, node;
+
+	TRACE_ENTRY();
+
+	lockdep_assert_held(&scst_mutex);
+
+	if ((scst_node_threads > 0) && (cmd_threads->nr_threads > 0)) {
+		a = kmalloc_array(cmd_threads->nr_threads, sizeof(*a),
+				  GFP_KERNEL);
+		nodes = kcalloc(nr_node_ids, sizeof(*nodes), GFP_KERNEL);
+		if ((a == NULL) || (nodes == NULL)) {
+			PRINT_ERROR("Unable to allocate array of %d threads, "
+				"session affinity disabled",
+				cmd_threads->nr_threads);
+			kfree(a);
+			a = NULL;
+			kfree(nodes);
+			nodes = NULL;
+			goto set;
+		}
+
+		/* Threads of each node go next to each other */
+		spin_lock(&cmd_threads->thr_lock);
+		for (node = 0; node < nr_node_ids; node++) {
+			nodes[node].first = n;
+			list_for_each_entry(thr, &cmd_threads->threads_list,
+					    thread_list_entry) {
+				if (thr->thr_nodeid == node)
+					a[n++] = thr;
+			}
+			nodes[node].cnt = n - nodes[node].first;
+		}
+		list_for_each_entry(thr, &cmd_threads->threads_list,
+				    thread_list_entry) {
+			if ((thr->thr_nodeid < 0) ||
+			    (thr->thr_nodeid >= nr_node_ids))
+				a[n++] = thr;
+		}
+		spin_unlock(&cmd_threads->thr_lock);
+	}
+
+set:
+	kfree(scst_main_thr_array);
+	kfree(scst_main_thr_nodes);
+	scst_main_thr_array = a;
+	scst_main_thr_nodes = nodes;
+	scst_main_thr_cnt = n;
+
+	TRACE_DBG("%d threads for session affinity", n);
+
+	TRACE_EXIT();
+	return;
+}
+
 int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int num)
 {
 	int res = 0, i;
 	struct scst_cmd_thread_t *thr;
 	int n = 0, tgt_dev_num = 0, nodeid = NUMA_NO_NODE;
+	bool per_node = (cmd_threads == &scst_main_cmd_threads) &&
+			(scst_node_threads > 0);
 
 	TRACE_ENTRY();
 
@@ -1942,6 +2046,9 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 		nodeid = dev->dev_numa_node_id;
 
 	for (i = 0; i < num; i++) {
+		if (per_node)
+			nodeid = scst_main_thr_nodeid(n);
+
 		thr = kmem_cache_alloc_node(scst_thr_cachep, GFP_KERNEL, nodeid);
 		if (!thr) {
 			res = -ENOMEM;
@@ -1952,6 +2059,7 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 		INIT_LIST_HEAD(&thr->thr_active_cmd_list);
 		spin_lock_init(&thr->thr_cmd_list_lock);
 		thr->thr_cmd_threads = cmd_threads;
+		thr->thr_nodeid = per_node ? nodeid : NUMA_NO_NODE;
 
 		if (dev != NULL) {
 			thr->cmd_thread = kthread_create_on_node(scst_cmd_thread,
@@ -1982,6 +2090,17 @@ int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 			if (rc != 0)
 				PRINT_ERROR("Setting CPU affinity failed: "
 					"%d", rc);
+		} else if ((per_node || (dev != NULL)) &&
+			   (nodeid != NUMA_NO_NODE)) {
+			/*
+			 * Node threads and threads of a device with numa_node_id
+			 * run, and so allocate data buffers, on their node.
+			 */
+			int rc = set_cpus_allowed_ptr(thr->cmd_thread,
+					cpumask_of_node(nodeid));
+			if (rc != 0)
+				PRINT_ERROR("Setting CPU affinity to node %d "
+					"failed: %d", nodeid, rc);
 		}
 
 		spin_lock(&cmd_threads->thr_lock);
@@ -2018,6 +2137,50 @@ out:
  * The being stopped threads must not have assigned commands, which usually
  * means suspended activities.
  */
+static void scst_add_thr_stats(struct scst_thr_stats *to,
+			       const struct scst_thr_stats *from)
+{
+	to->shared_cmds += from->shared_cmds;
+	to->local_cmds += from->local_cmds;
+	to->stolen_cmds += from->stolen_cmds;
+	to->shared_lock_contended += from->shared_lock_contended;
+}
+
+/*
+ * Sums the commands scheduling counters of all threads of all pools and,
+ * if reset is true, zeroes them. The threads update their counters without
+ * any locking, so the result is approximate.
+ */
+void scst_get_thr_stats(struct scst_thr_stats *stats, bool reset)
+{
+	struct scst_cmd_threads *l;
+	struct scst_cmd_thread_t *thr;
+
+	TRACE_ENTRY();
+
+	memset(stats, 0, sizeof(*stats));
+
+	mutex_lock(&scst_cmd_threads_mutex);
+	list_for_each_entry(l, &scst_cmd_threads_list, lists_list_entry) {
+		spin_lock(&l->thr_lock);
+		scst_add_thr_stats(stats, &l->stopped_thr_stats);
+		if (reset)
+			memset(&l->stopped_thr_stats, 0,
+			       sizeof(l->stopped_thr_stats));
+		list_for_each_entry(thr, &l->threads_list, thread_list_entry) {
+			scst_add_thr_stats(stats, &thr->thr_stats);
+			if (reset)
+				memset(&thr->thr_stats, 0,
+				       sizeof(thr->thr_stats));
+		}
+		spin_unlock(&l->thr_lock);
+	}
+	mutex_unlock(&scst_cmd_threads_mutex);
+
+	TRACE_EXIT();
+	return;
+}
+
 void scst_del_threads(struct scst_cmd_threads *cmd_threads, int num)
 {
 	TRACE_ENTRY();
@@ -2046,6 +2209,11 @@ void scst_del_threads(struct scst_cmd_threads *cmd_threads, int num)
 		if (rc != 0 && rc != -EINTR)
 			TRACE_MGMT_DBG("kthread_stop() failed: %d", rc);
 
+		spin_lock(&cmd_threads->thr_lock);
+		scst_add_thr_stats(&cmd_threads->stopped_thr_stats,
+				   &ct->thr_stats);
+		spin_unlock(&cmd_threads->thr_lock);
+
 		kmem_cache_free(scst_thr_cachep, ct);
 	}
 
@@ -2298,6 +2466,7 @@ static void scst_stop_global_threads(void)
 	mutex_lock(&scst_mutex);
 
 	scst_del_threads(&scst_main_cmd_threads, -1);
+	scst_main_thr_array_rebuild();
 
 	if (scst_mgmt_cmd_thread)
 		kthread_stop(scst_mgmt_cmd_thread);
@@ -2324,6 +2493,7 @@ static int scst_start_global_threads(int num)
 	res = scst_add_threads(&scst_main_cmd_threads, NULL, NULL, num);
 	if (res < 0)
 		goto out_unlock;
+	scst_main_thr_array_rebuild();
 
 	scst_init_cmd_thread = kthread_run(scst_init_thread,
 		NULL, "scst_initd");
@@ -2501,6 +2671,90 @@ static void __init scst_print_config(void)
 		PRINT_INFO("%s", buf);
 }
 
+#ifdef SCST_USERMODE
+/*
+ * Host NUMA topology for the NUMA shims of scst_compat.h. Until
+ * scstu_numa_init() all CPUs are on node 0.
+ */
+int scstu_nr_node_ids = 1;
+int scstu_num_online_nodes = 1;
+int scstu_cpu_node[SCSTU_MAX_CPUS];
+bool scstu_node_online[SCSTU_MAX_NODES] = { true };
+cpumask_t scstu_node_cpumask[SCSTU_MAX_NODES];
+
+/* Parses a sysfs CPU list, like "0-7,16-23", into mask */
+static int scstu_parse_cpulist(const char *s, cpumask_t *mask)
+{
+	unsigned long first, last;
+	char *end;
+
+	cpumask_clear(mask);
+	while ((*s != '\0') && (*s != '\n')) {
+		first = strtoul(s, &end, 10);
+		if (end == s)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtoul(s, &end, 10);
+			if ((end == s) || (last < first))
+				return -EINVAL;
+		}
+		for (; (first <= last) && (first < nr_cpu_ids); first++)
+			cpumask_set_cpu(first, mask);
+		s = end;
+		if (*s == ',')
+			s++;
+	}
+	return 0;
+}
+
+/*
+ * Learns the host NUMA topology from sysfs. Nodes without CPUs are ignored.
+ * Without sysfs all CPUs stay on node 0.
+ */
+static void scstu_numa_init(void)
+{
+	char path[64], buf[1024];
+	int node, cpu, nodes = 0, max_node = 0;
+	FILE *f;
+
+	for (node = 0; node < SCSTU_MAX_NODES; node++) {
+		cpumask_t *mask = &scstu_node_cpumask[node];
+
+		scstu_node_online[node] = false;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if ((fgets(buf, sizeof(buf), f) != NULL) &&
+		    (scstu_parse_cpulist(buf, mask) == 0) &&
+		    !cpumask_empty(mask)) {
+			scstu_node_online[node] = true;
+			nodes++;
+			max_node = node;
+			for_each_cpu(cpu, mask) {
+				if (cpu < SCSTU_MAX_CPUS)
+					scstu_cpu_node[cpu] = node;
+			}
+		}
+		fclose(f);
+	}
+
+	if (nodes == 0) {
+		scstu_node_online[0] = true;
+		cpumask_setall(&scstu_node_cpumask[0]);
+		nodes = 1;
+	}
+
+	scstu_num_online_nodes = nodes;
+	scstu_nr_node_ids = max_node + 1;
+
+	PRINT_INFO("%d NUMA node(s), highest node id %d", nodes, max_node);
+}
+#endif
+
 static int __init init_scst(void)
 {
 	int res, i;
@@ -2546,6 +2800,9 @@ static int __init init_scst(void)
 	mutex_init(&scst_cmd_threads_mutex);
 	INIT_LIST_HEAD(&scst_cmd_threads_list);
 	cpumask_setall(&default_cpu_mask);
+#ifdef SCST_USERMODE
+	scstu_numa_init();
+#endif
 
 	scst_init_threads(&scst_main_cmd_threads);
 
@@ -2557,7 +2814,9 @@ static int __init init_scst(void)
 
 	/* ToDo: register_cpu_notifier() */
 
-	if (scst_threads == 0)
+	if (scst_node_threads > 0)
+		scst_threads = scst_node_threads * num_online_nodes();
+	else if (scst_threads == 0)
 #ifdef SCST_USERMODE
 		scst_threads = 1;
 #else
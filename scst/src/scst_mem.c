@@ -34,6 +34,12 @@
 #include "scst_priv.h"
 #include "scst_mem.h"
 
+#ifdef SCST_USERMODE
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #define SGV_DEFAULT_PURGE_INTERVAL	(60 * HZ)
 #define SGV_MIN_SHRINK_INTERVAL		(1 * HZ)
 
@@ -92,6 +98,8 @@ static int scst_sgv_sysfs_create(struct sgv_pool *pool);
 static void scst_sgv_sysfs_del(struct sgv_pool *pool);
 #endif
 
+static void sgv_mags_drain(struct sgv_pool *pool);
+
 static inline bool sgv_pool_clustered(const struct sgv_pool *pool)
 {
 	return pool->clustering_type != sgv_no_clustering;
@@ -220,6 +228,8 @@ static int sgv_shrink_pool(struct sgv_pool *pool, int nr, int min_interval,
 		goto out;
 	}
 
+	sgv_mags_drain(pool);
+
 	spin_lock_bh(&pool->sgv_pool_lock);
 
 	while (!list_empty(&pool->sorted_recycling_list) &&
@@ -376,6 +386,8 @@ static void sgv_purge_work_fn(struct work_struct *work)
 
 	TRACE_MEM("Purge work for pool %p", pool);
 
+	sgv_mags_drain(pool);
+
 	spin_lock_bh(&pool->sgv_pool_lock);
 
 	pool->purge_work_scheduled = false;
@@ -558,6 +570,341 @@ static struct page *sgv_alloc_sys_pages(struct scatterlist *sg,
 	return page;
 }
 
+#ifdef SCST_USERMODE
+
+/*
+ * Usermode SGV pages arenas. Instead of getting each SGV page separately from
+ * the page allocator, the SCST pools take them from regions reserved at
+ * startup and backed by 2 MB huge pages. Pages allocated for one buffer are
+ * taken consecutively, so a buffer is contiguous in memory, and the I/O
+ * paths, which coalesce adjacent buffer segments, describe it with a single
+ * iovec. The huge pages also reduce TLB misses.
+ *
+ * There is an arena on each NUMA node, with memory of that node, and pages
+ * are taken from the arena of the node of the allocating CPU, so a buffer
+ * lives on the node of the thread processing its command.
+ *
+ * The size in MB of each arena is set by SCSTU_SGV_ARENA_MB environment
+ * variable. 0, the default, disables the arenas. If the arena of the node is
+ * exhausted, the pages come from the other arenas, then from the page
+ * allocator as before.
+ */
+#define SGV_ARENA_HUGEPAGE_SIZE	(2UL << 20)
+
+/* When a buffer can't continue in place, look for a free run of that size */
+#define SGV_ARENA_RUN_PAGES	((1UL << 20) >> PAGE_SHIFT)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED		1
+#endif
+
+struct sgv_arena {
+	void *map;		/* as returned by mmap() */
+	size_t map_size;
+	void *base;		/* SGV_ARENA_HUGEPAGE_SIZE aligned */
+	unsigned long nr_pages;
+	struct page *pages;	/* descriptors of the arena pages */
+
+	spinlock_t arena_lock;
+	/* All protected by arena_lock */
+	unsigned long *bitmap;	/* set bits are the used pages */
+	unsigned long free_pages;
+	unsigned long hint;	/* where to start looking for a free run */
+};
+
+static struct sgv_arena sgv_arenas[SCSTU_MAX_NODES];
+static int sgv_arenas_cnt;
+
+/* Arena page, which the current thread allocates next */
+static __thread struct page *sgv_arena_next;
+
+static inline bool sgv_arena_page(const struct sgv_arena *a,
+	const struct page *page)
+{
+	return (page >= a->pages) && (page < a->pages + a->nr_pages);
+}
+
+static struct sgv_arena *sgv_arena_of_page(const struct page *page)
+{
+	int node;
+
+	for_each_online_node(node) {
+		if (sgv_arena_page(&sgv_arenas[node], page))
+			return &sgv_arenas[node];
+	}
+	return NULL;
+}
+
+/*
+ * Returns the first page of a free run of SGV_ARENA_RUN_PAGES pages or, if
+ * there is no such run, the first free page. Returns nr_pages, if the arena
+ * is full. Must be called under arena_lock held.
+ */
+static unsigned long sgv_arena_find_run(struct sgv_arena *a)
+{
+	unsigned long i = a->hint, n, start = 0, run = 0;
+	unsigned long first_free = a->nr_pages;
+
+	if (a->free_pages == 0)
+		goto out;
+
+	for (n = 0; n < a->nr_pages; n++, i++) {
+		if (i >= a->nr_pages) {
+			i = 0;
+			run = 0;
+		}
+		if (((i % BITS_PER_LONG) == 0) &&
+		    (a->bitmap[i / BITS_PER_LONG] == ~0UL)) {
+			/* Skip fully used words */
+			i += BITS_PER_LONG - 1;
+			n += BITS_PER_LONG - 1;
+			run = 0;
+			continue;
+		}
+		if (test_bit(i, a->bitmap)) {
+			run = 0;
+			continue;
+		}
+		if (run++ == 0)
+			start = i;
+		if (first_free == a->nr_pages)
+			first_free = i;
+		if (run == SGV_ARENA_RUN_PAGES) {
+			a->hint = start + SGV_ARENA_RUN_PAGES;
+			first_free = start;
+			goto out;
+		}
+	}
+
+out:
+	return first_free;
+}
+
+/*
+ * Takes page i of arena a, if it is free, otherwise a page found by
+ * sgv_arena_find_run(). Returns NULL, if the arena is full or absent.
+ */
+static struct page *__sgv_arena_alloc_page(struct sgv_arena *a,
+	unsigned long i)
+{
+	if (a->nr_pages == 0)
+		return NULL;
+
+	spin_lock_bh(&a->arena_lock);
+	if ((i >= a->nr_pages) || test_bit(i, a->bitmap)) {
+		i = sgv_arena_find_run(a);
+		if (unlikely(i >= a->nr_pages)) {
+			spin_unlock_bh(&a->arena_lock);
+			return NULL;
+		}
+	}
+	__set_bit(i, a->bitmap);
+	a->free_pages--;
+	spin_unlock_bh(&a->arena_lock);
+
+	return &a->pages[i];
+}
+
+static struct page *sgv_arena_alloc_page(struct scatterlist *sg,
+	gfp_t gfp_mask, void *priv)
+{
+	int node = cpu_to_node(raw_smp_processor_id()), n;
+	struct sgv_arena *a = &sgv_arenas[node];
+	struct page *page, *next = sgv_arena_next;
+
+	/* Continue in place, unless the thread moved to another node */
+	page = __sgv_arena_alloc_page(a, sgv_arena_page(a, next) ?
+				      next - a->pages : a->nr_pages);
+	if (unlikely(page == NULL)) {
+		TRACE_MEM("SGV arena of node %d exhausted", node);
+		for_each_online_node(n) {
+			if (n == node)
+				continue;
+			a = &sgv_arenas[n];
+			page = __sgv_arena_alloc_page(a, a->nr_pages);
+			if (page != NULL)
+				break;
+		}
+		if (page == NULL) {
+			TRACE_MEM("%s", "All SGV arenas exhausted");
+			return sgv_alloc_sys_pages(sg, gfp_mask, priv);
+		}
+	}
+
+	sgv_arena_next = page + 1;
+
+	if (gfp_mask & __GFP_ZERO)
+		memset(page_address(page), 0, PAGE_SIZE);
+
+	sg_set_page(sg, page, PAGE_SIZE, 0);
+	TRACE_MEM("arena %d page %ld, sg=%p, priv=%p", (int)(a - sgv_arenas),
+		(long)(page - a->pages), sg, priv);
+	return page;
+}
+
+static void sgv_arena_free_pages(struct scatterlist *sg, int sg_count,
+	void *priv)
+{
+	int i;
+
+	TRACE_MEM("sg=%p, sg_count=%d", sg, sg_count);
+
+	for (i = 0; i < sg_count; i++) {
+		struct page *p = sg_page(&sg[i]);
+		struct sgv_arena *a = sgv_arena_of_page(p);
+		int pages = PAGE_ALIGN(sg[i].length) >> PAGE_SHIFT;
+		unsigned long idx;
+
+		if (a == NULL) {
+			sgv_free_sys_sg_entries(&sg[i], 1, priv);
+			continue;
+		}
+
+		idx = p - a->pages;
+		spin_lock_bh(&a->arena_lock);
+		a->free_pages += pages;
+		while (pages-- > 0)
+			__clear_bit(idx++, a->bitmap);
+		spin_unlock_bh(&a->arena_lock);
+	}
+	return;
+}
+
+static int sgv_arena_init_node(struct sgv_arena *a, int node, size_t size)
+{
+	int res = 0;
+	unsigned long i;
+
+	TRACE_ENTRY();
+
+	spin_lock_init(&a->arena_lock);
+
+	/* Not populated yet, to populate it with memory of the node */
+	a->map_size = size;
+	a->map = mmap(NULL, a->map_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (a->map != MAP_FAILED) {
+		a->base = a->map;
+	} else {
+		/* No reserved huge pages, let THP back the arena, if it can */
+		PRINT_WARNING("No %zd MB of huge pages reserved for the SGV "
+			"arena of node %d, trying transparent huge pages",
+			size >> 20, node);
+		a->map_size = size + SGV_ARENA_HUGEPAGE_SIZE;
+		a->map = mmap(NULL, a->map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (a->map == MAP_FAILED) {
+			res = -errno;
+			PRINT_ERROR("Unable to map %zd MB for the SGV arena of "
+				"node %d: %d", size >> 20, node, res);
+			goto out_clear;
+		}
+		a->base = PTR_ALIGN(a->map, SGV_ARENA_HUGEPAGE_SIZE);
+		madvise(a->base, size, MADV_HUGEPAGE);
+	}
+
+	if (num_online_nodes() > 1) {
+		unsigned long nodemask[BITS_TO_LONGS(SCSTU_MAX_NODES)] = { };
+
+		/*
+		 * Preferred, not bound, so the faults below can't SIGBUS, if
+		 * the node is out of huge pages.
+		 */
+		__set_bit(node, nodemask);
+		if (syscall(SYS_mbind, a->base, size, MPOL_PREFERRED,
+			    nodemask, SCSTU_MAX_NODES + 1, 0) != 0)
+			PRINT_WARNING("Unable to place the SGV arena on node "
+				"%d: %d", node, -errno);
+	}
+	memset(a->base, 0, size);
+
+	a->nr_pages = size >> PAGE_SHIFT;
+	a->free_pages = a->nr_pages;
+	a->bitmap = kcalloc(BITS_TO_LONGS(a->nr_pages), sizeof(long),
+			    GFP_KERNEL);
+	a->pages = kcalloc(a->nr_pages, sizeof(*a->pages), GFP_KERNEL);
+	if ((a->bitmap == NULL) || (a->pages == NULL)) {
+		PRINT_ERROR("Unable to allocate descriptors of %ld SGV arena "
+			"pages", a->nr_pages);
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < a->nr_pages; i++)
+		scstu_page_init(&a->pages[i], a->base + (i << PAGE_SHIFT));
+
+	PRINT_INFO("SGV arena of %zd MB on node %d at %p (%s)", size >> 20,
+		node, a->base, (a->base == a->map) ? "huge pages" :
+		"transparent huge pages");
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_free:
+	kfree(a->bitmap);
+	kfree(a->pages);
+	munmap(a->map, a->map_size);
+
+out_clear:
+	memset(a, 0, sizeof(*a));
+	goto out;
+}
+
+static void sgv_arena_init(void)
+{
+	const char *env = getenv("SCSTU_SGV_ARENA_MB");
+	unsigned long mb = 0;
+	int node;
+
+	TRACE_ENTRY();
+
+	if ((env == NULL) || (kstrtoul(env, 0, &mb) != 0) || (mb == 0))
+		goto out;
+
+	for_each_online_node(node) {
+		if (sgv_arena_init_node(&sgv_arenas[node], node,
+				ALIGN(mb << 20, SGV_ARENA_HUGEPAGE_SIZE)) == 0)
+			sgv_arenas_cnt++;
+	}
+
+out:
+	TRACE_EXIT();
+	return;
+}
+
+/* Must be called after all SGV pools using the arenas destroyed */
+static void sgv_arena_deinit(void)
+{
+	int node;
+
+	for (node = 0; node < SCSTU_MAX_NODES; node++) {
+		struct sgv_arena *a = &sgv_arenas[node];
+
+		if (a->base == NULL)
+			continue;
+
+		WARN_ON(a->free_pages != a->nr_pages);
+
+		kfree(a->bitmap);
+		kfree(a->pages);
+		munmap(a->map, a->map_size);
+		memset(a, 0, sizeof(*a));
+	}
+	sgv_arenas_cnt = 0;
+	return;
+}
+
+static void sgv_arena_attach(struct sgv_pool *pool)
+{
+	if ((sgv_arenas_cnt != 0) && (pool != NULL))
+		sgv_pool_set_allocator(pool, sgv_arena_alloc_page,
+				       sgv_arena_free_pages);
+	return;
+}
+
+#endif /* SCST_USERMODE */
+
 static int sgv_alloc_sg_entries(struct scatterlist *sg, int pages,
 	gfp_t gfp_mask, enum sgv_clustering_types clustering_type,
 	struct trans_tbl_ent *trans_tbl,
@@ -737,15 +1084,26 @@ out:
 	return obj;
 }
 
-static void sgv_put_obj(struct sgv_pool_obj *obj)
+/* Must be called under sgv_pool_lock held */
+static void sgv_schedule_purge_work(struct sgv_pool *pool)
+{
+	if (!pool->purge_work_scheduled) {
+		TRACE_MEM("Scheduling purge work for pool %p", pool);
+		pool->purge_work_scheduled = true;
+		schedule_delayed_work(&pool->sgv_purge_work,
+			pool->purge_interval);
+	}
+	return;
+}
+
+/* Must be called under sgv_pool_lock held */
+static void __sgv_put_obj(struct sgv_pool_obj *obj)
 {
 	struct sgv_pool *pool = obj->owner_pool;
 	struct list_head *entry;
 	struct list_head *list = &pool->recycling_lists[obj->cache_num];
 	int pages = obj->pages;
 
-	spin_lock_bh(&pool->sgv_pool_lock);
-
 	TRACE_MEM("sgv %p, cache num %d, pages %d, sg_count %d", obj,
 		obj->cache_num, pages, obj->sg_count);
 
@@ -775,17 +1133,147 @@ static void sgv_put_obj(struct sgv_pool_obj *obj)
 
 	pool->inactive_cached_pages += pages;
 
-	if (!pool->purge_work_scheduled) {
-		TRACE_MEM("Scheduling purge work for pool %p", pool);
-		pool->purge_work_scheduled = true;
-		schedule_delayed_work(&pool->sgv_purge_work,
-			pool->purge_interval);
-	}
+	sgv_schedule_purge_work(pool);
+	return;
+}
 
+static void sgv_put_obj(struct sgv_pool_obj *obj)
+{
+	struct sgv_pool *pool = obj->owner_pool;
+
+	spin_lock_bh(&pool->sgv_pool_lock);
+	__sgv_put_obj(obj);
 	spin_unlock_bh(&pool->sgv_pool_lock);
 	return;
 }
 
+/* No locks. Returns NULL, if this CPU's magazine has no cache_num objects. */
+static struct sgv_pool_obj *sgv_mag_get(struct sgv_pool *pool, int cache_num)
+{
+	struct sgv_pool_mag *mag;
+	struct sgv_pool_obj *obj = NULL;
+
+	if (pool->mags == NULL)
+		goto out;
+
+	mag = &pool->mags[raw_smp_processor_id()];
+
+	spin_lock_bh(&mag->mag_lock);
+	if (mag->cnt[cache_num] > 0) {
+		obj = mag->objs[cache_num][--mag->cnt[cache_num]];
+		mag->hit_alloc[cache_num]++;
+	}
+	spin_unlock_bh(&mag->mag_lock);
+
+out:
+	return obj;
+}
+
+/*
+ * No locks. Returns false, if obj should go to the pool's recycling lists,
+ * because this CPU's magazine for it is full.
+ */
+static bool sgv_mag_put(struct sgv_pool_obj *obj)
+{
+	struct sgv_pool *pool = obj->owner_pool;
+	struct sgv_pool_mag *mag;
+	int cache_num = obj->cache_num;
+	bool res = false;
+
+	if (pool->mags == NULL)
+		goto out;
+
+	mag = &pool->mags[raw_smp_processor_id()];
+
+	spin_lock_bh(&mag->mag_lock);
+	if (mag->cnt[cache_num] < SGV_MAG_SIZE) {
+		mag->objs[cache_num][mag->cnt[cache_num]++] = obj;
+		res = true;
+	}
+	spin_unlock_bh(&mag->mag_lock);
+
+	/*
+	 * The purge work drains magazines, so it must be scheduled while they
+	 * have anything. Racy read, rechecked under the lock.
+	 */
+	if (res && unlikely(!pool->purge_work_scheduled)) {
+		spin_lock_bh(&pool->sgv_pool_lock);
+		sgv_schedule_purge_work(pool);
+		spin_unlock_bh(&pool->sgv_pool_lock);
+	}
+
+out:
+	return res;
+}
+
+/*
+ * Returns number of allocations of cache_num served by the magazines. They
+ * are counted neither in hit_alloc, nor in total_alloc of cache_acc.
+ */
+static int sgv_mags_hits(const struct sgv_pool *pool, int cache_num)
+{
+	int cpu, res = 0;
+
+	if (pool->mags == NULL)
+		goto out;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		res += pool->mags[cpu].hit_alloc[cache_num];
+
+out:
+	return res;
+}
+
+#ifndef CONFIG_SCST_PROC
+/* Zeroes the magazines hits counters. No locks. */
+static void sgv_mags_hits_reset(struct sgv_pool *pool)
+{
+	int cpu;
+
+	if (pool->mags == NULL)
+		goto out;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		struct sgv_pool_mag *mag = &pool->mags[cpu];
+
+		spin_lock_bh(&mag->mag_lock);
+		memset(mag->hit_alloc, 0, sizeof(mag->hit_alloc));
+		spin_unlock_bh(&mag->mag_lock);
+	}
+
+out:
+	return;
+}
+#endif
+
+/*
+ * Moves all objects from the magazines of pool to its recycling lists, where
+ * the purge work and the shrinker can free them. No locks.
+ */
+static void sgv_mags_drain(struct sgv_pool *pool)
+{
+	int cpu, i;
+
+	if (pool->mags == NULL)
+		goto out;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		struct sgv_pool_mag *mag = &pool->mags[cpu];
+
+		spin_lock_bh(&mag->mag_lock);
+		spin_lock(&pool->sgv_pool_lock);
+		for (i = 0; i < pool->max_caches; i++) {
+			while (mag->cnt[i] > 0)
+				__sgv_put_obj(mag->objs[i][--mag->cnt[i]]);
+		}
+		spin_unlock(&pool->sgv_pool_lock);
+		spin_unlock_bh(&mag->mag_lock);
+	}
+
+out:
+	return;
+}
+
 /* No locks */
 static int sgv_hiwmk_check(int pages_to_alloc)
 {
@@ -934,6 +1422,14 @@ struct scatterlist *sgv_pool_alloc(struct sgv_pool *pool, unsigned int size,
 			goto out_fail;
 		allowed_mem_checked = true;
 
+		if (likely(!(flags & SGV_POOL_ALLOC_GET_NEW))) {
+			obj = sgv_mag_get(pool, cache_num);
+			if (obj != NULL) {
+				TRACE_MEM("Magazine obj %p", obj);
+				goto success_mag;
+			}
+		}
+
 		obj = sgv_get_obj(pool, cache_num, pages_to_alloc, gfp_mask,
 			flags & SGV_POOL_ALLOC_GET_NEW);
 		if (unlikely(obj == NULL)) {
@@ -1058,10 +1554,17 @@ struct scatterlist *sgv_pool_alloc(struct sgv_pool *pool, unsigned int size,
 	}
 
 success:
+	if (cache_num >= 0)
+		atomic_inc(&pool->cache_acc[cache_num].total_alloc);
+	else if (no_cached)
+		atomic_inc(&pool->other_alloc);
+	else
+		atomic_inc(&pool->big_alloc);
+
+success_mag:
 	if (cache_num >= 0) {
 		int sg;
 
-		atomic_inc(&pool->cache_acc[cache_num].total_alloc);
 		if (sgv_pool_clustered(pool))
 			cnt = obj->trans_tbl[pages-1].sg_num;
 		else
@@ -1073,13 +1576,8 @@ success:
 			obj->sg_entries[sg].length =
 				(pages - obj->trans_tbl[sg].pg_count) << PAGE_SHIFT;
 		}
-	} else {
+	} else
 		cnt = obj->sg_count;
-		if (no_cached)
-			atomic_inc(&pool->other_alloc);
-		else
-			atomic_inc(&pool->big_alloc);
-	}
 
 	*count = cnt;
 	res = obj->sg_entries;
@@ -1211,7 +1709,8 @@ void sgv_pool_free(struct sgv_pool_obj *obj, struct scst_mem_lim *mem_lim)
 
 	if (obj->cache_num >= 0) {
 		obj->sg_entries[obj->orig_sg].length = obj->orig_length;
-		sgv_put_obj(obj);
+		if ((obj->sg_count == 0) || !sgv_mag_put(obj))
+			sgv_put_obj(obj);
 	} else {
 		obj->owner_pool->alloc_fns.free_pages_fn(obj->sg_entries,
 			obj->sg_count, obj->allocator_priv);
@@ -1374,7 +1873,7 @@ static void sgv_pool_init_cache(struct sgv_pool *pool, int cache_num,
 /* Must be called under sgv_pools_mutex */
 static int sgv_pool_init(struct sgv_pool *pool, const char *name,
 	enum sgv_clustering_types clustering_type, int single_alloc_pages,
-	int purge_interval, bool per_cpu)
+	int purge_interval, bool per_cpu, struct sgv_pool_mag *mags)
 {
 	int res = -ENOMEM;
 	int i;
@@ -1435,6 +1934,12 @@ static int sgv_pool_init(struct sgv_pool *pool, const char *name,
 		}
 	}
 
+	if (mags != NULL) {
+		for (i = 0; i < nr_cpu_ids; i++)
+			spin_lock_init(&mags[i].mag_lock);
+		pool->mags = mags;
+	}
+
 	atomic_set(&pool->sgv_pool_ref, 1);
 	spin_lock_init(&pool->sgv_pool_lock);
 	INIT_LIST_HEAD(&pool->sorted_recycling_list);
@@ -1506,6 +2011,8 @@ void sgv_pool_flush(struct sgv_pool *pool)
 
 	TRACE_ENTRY();
 
+	sgv_mags_drain(pool);
+
 	for (i = 0; i < pool->max_caches; i++) {
 		struct sgv_pool_obj *obj;
 
@@ -1558,6 +2065,7 @@ static void sgv_pool_destroy(struct sgv_pool *pool)
 		pool->caches[i] = NULL;
 	}
 
+	kfree(pool->mags);
 	kmem_cache_free(sgv_pool_cachep, pool);
 
 	TRACE_EXIT();
@@ -1615,6 +2123,7 @@ struct sgv_pool *sgv_pool_create_node(const char *name,
 	int single_alloc_pages, bool shared, int purge_interval, int nodeid)
 {
 	struct sgv_pool *pool, *tp;
+	struct sgv_pool_mag *mags = NULL;
 	int rc;
 
 	TRACE_ENTRY();
@@ -1637,6 +2146,17 @@ struct sgv_pool *sgv_pool_create_node(const char *name,
 	}
 	memset(pool, 0, sizeof(*pool));
 
+	if (nodeid == NUMA_NO_NODE) {
+		mags = kcalloc(nr_cpu_ids, sizeof(*mags), GFP_KERNEL);
+		if (mags == NULL) {
+			PRINT_ERROR("Allocation of sgv_pool magazines failed "
+				"(size %zd)", nr_cpu_ids * sizeof(*mags));
+			kmem_cache_free(sgv_pool_cachep, pool);
+			pool = NULL;
+			goto out;
+		}
+	}
+
 	mutex_lock(&sgv_pools_mutex);
 
 	list_for_each_entry(tp, &sgv_pools_list, sgv_pools_list_entry) {
@@ -1660,7 +2180,7 @@ struct sgv_pool *sgv_pool_create_node(const char *name,
 	tp = NULL;
 
 	rc = sgv_pool_init(pool, name, clustering_type, single_alloc_pages,
-				purge_interval, nodeid != NUMA_NO_NODE);
+				purge_interval, nodeid != NUMA_NO_NODE, mags);
 	if (rc != 0)
 		goto out_free;
 
@@ -1672,6 +2192,7 @@ out:
 	return pool;
 
 out_free:
+	kfree(mags);
 	kmem_cache_free(sgv_pool_cachep, pool);
 	pool = tp;
 	goto out_unlock;
@@ -1795,6 +2316,18 @@ int scst_sgv_pools_init(unsigned long mem_hwmark, unsigned long mem_lwmark)
 			goto out_free_per_cpu_dma;
 	}
 
+#ifdef SCST_USERMODE
+	sgv_arena_init();
+	sgv_arena_attach(sgv_norm_pool);
+	sgv_arena_attach(sgv_norm_clust_pool);
+	sgv_arena_attach(sgv_dma_pool);
+	for (i = 0; i < NR_CPUS; i++) {
+		sgv_arena_attach(sgv_norm_pool_per_cpu[i]);
+		sgv_arena_attach(sgv_norm_clust_pool_per_cpu[i]);
+		sgv_arena_attach(sgv_dma_pool_per_cpu[i]);
+	}
+#endif
+
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 23))
 	sgv_shrinker = set_shrinker(DEFAULT_SEEKS, sgv_shrink);
 #else
@@ -1870,6 +2403,10 @@ void scst_sgv_pools_deinit(void)
 		if (sgv_norm_clust_pool_per_cpu[i] != NULL)
 			sgv_pool_destroy(sgv_norm_clust_pool_per_cpu[i]);
 
+#ifdef SCST_USERMODE
+	sgv_arena_deinit();
+#endif
+
 	kmem_cache_destroy(sgv_pool_cachep);
 
 	TRACE_EXIT();
@@ -1884,10 +2421,10 @@ static void sgv_do_proc_read(struct seq_file *seq, const struct sgv_pool *pool)
 	int oa, om;
 
 	for (i = 0; i < pool->max_caches; i++) {
-		int t;
+		int t, mh = sgv_mags_hits(pool, i);
 
-		hit += atomic_read(&pool->cache_acc[i].hit_alloc);
-		total += atomic_read(&pool->cache_acc[i].total_alloc);
+		hit += atomic_read(&pool->cache_acc[i].hit_alloc) + mh;
+		total += atomic_read(&pool->cache_acc[i].total_alloc) + mh;
 
 		t = atomic_read(&pool->cache_acc[i].total_alloc) -
 			atomic_read(&pool->cache_acc[i].hit_alloc);
@@ -1904,6 +2441,7 @@ static void sgv_do_proc_read(struct seq_file *seq, const struct sgv_pool *pool)
 		pool->cached_entries);
 
 	for (i = 0; i < pool->max_caches; i++) {
+		int mh = sgv_mags_hits(pool, i);
 		int t = atomic_read(&pool->cache_acc[i].total_alloc) -
 			atomic_read(&pool->cache_acc[i].hit_alloc);
 		if (pool->single_alloc_pages == 0)
@@ -1914,8 +2452,8 @@ static void sgv_do_proc_read(struct seq_file *seq, const struct sgv_pool *pool)
 
 		seq_printf(seq, "  %-28s %-11d %-11d %d\n",
 			pool->cache_names[i],
-			atomic_read(&pool->cache_acc[i].hit_alloc),
-			atomic_read(&pool->cache_acc[i].total_alloc),
+			atomic_read(&pool->cache_acc[i].hit_alloc) + mh,
+			atomic_read(&pool->cache_acc[i].total_alloc) + mh,
 			(allocated != 0) ? merged*100/allocated : 0);
 	}
 
@@ -1981,10 +2519,10 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 	pool = container_of(kobj, struct sgv_pool, sgv_kobj);
 
 	for (i = 0; i < SGV_POOL_ELEMENTS; i++) {
-		int t;
+		int t, mh = sgv_mags_hits(pool, i);
 
-		hit += atomic_read(&pool->cache_acc[i].hit_alloc);
-		total += atomic_read(&pool->cache_acc[i].total_alloc);
+		hit += atomic_read(&pool->cache_acc[i].hit_alloc) + mh;
+		total += atomic_read(&pool->cache_acc[i].total_alloc) + mh;
 
 		t = atomic_read(&pool->cache_acc[i].total_alloc) -
 			atomic_read(&pool->cache_acc[i].hit_alloc);
@@ -2002,6 +2540,7 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 		pool->cached_entries);
 
 	for (i = 0; i < SGV_POOL_ELEMENTS; i++) {
+		int mh = sgv_mags_hits(pool, i);
 		int t = atomic_read(&pool->cache_acc[i].total_alloc) -
 			atomic_read(&pool->cache_acc[i].hit_alloc);
 		allocated = t * (1 << i);
@@ -2009,8 +2548,8 @@ static ssize_t sgv_sysfs_stat_show(struct kobject *kobj,
 
 		res += sprintf(&buf[res], "  %-28s %-11d %-11d %d\n",
 			pool->cache_names[i],
-			atomic_read(&pool->cache_acc[i].hit_alloc),
-			atomic_read(&pool->cache_acc[i].total_alloc),
+			atomic_read(&pool->cache_acc[i].hit_alloc) + mh,
+			atomic_read(&pool->cache_acc[i].total_alloc) + mh,
 			(allocated != 0) ? merged*100/allocated : 0);
 	}
 
@@ -2042,6 +2581,7 @@ static ssize_t sgv_sysfs_stat_reset(struct kobject *kobj,
 		atomic_set(&pool->cache_acc[i].total_alloc, 0);
 		atomic_set(&pool->cache_acc[i].merged, 0);
 	}
+	sgv_mags_hits_reset(pool);
 
 	atomic_set(&pool->big_pages, 0);
 	atomic_set(&pool->big_merged, 0);
@@ -61,6 +61,23 @@ struct sgv_pool_cache_acc {
 	atomic_t merged;
 };
 
+/* Max number of objects of each cache_num kept in a magazine */
+#define SGV_MAG_SIZE		4
+
+/*
+ * Per-CPU magazine of recently freed objects of an SGV pool. Serves the
+ * common alloc/free pairs without sgv_pool_lock and shared atomics. The
+ * lock is taken remotely only to drain it, so it is normally uncontended.
+ */
+struct sgv_pool_mag {
+	spinlock_t mag_lock;
+
+	/* All protected by mag_lock */
+	int cnt[SGV_POOL_ELEMENTS];
+	struct sgv_pool_obj *objs[SGV_POOL_ELEMENTS][SGV_MAG_SIZE];
+	unsigned int hit_alloc[SGV_POOL_ELEMENTS];
+} ____cacheline_aligned_in_smp;
+
 /*
  * SGV pool allocation functions
  */
@@ -108,6 +125,12 @@ struct sgv_pool {
 
 	struct sgv_pool_cache_acc cache_acc[SGV_POOL_ELEMENTS];
 
+	/*
+	 * nr_cpu_ids magazines, or NULL for per-CPU pools, which don't need
+	 * them, because they are used from their CPU only.
+	 */
+	struct sgv_pool_mag *mags;
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 20))
 	struct delayed_work sgv_purge_work;
 #else
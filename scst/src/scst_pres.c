@@ -44,6 +44,7 @@
 #include <linux/version.h>
 #endif
 #include <linux/vmalloc.h>
+#include <linux/crc32c.h>
 #include <asm/unaligned.h>
 #include <stdarg.h>
 
@@ -68,6 +69,38 @@
 #define SCST_PR_ROOT_ENTRY	"pr"
 #define SCST_PR_FILE_SIGN	0xBBEEEEAAEEBBDD77LLU
 #define SCST_PR_FILE_VERSION	1LLU
+#define SCST_PR_JNL_SIGN	0xBBEEEEAAEEBBDD78LLU
+#define SCST_PR_JNL_VERSION	1LLU
+
+/* Journal size at which it gets folded into a new snapshot */
+#define SCST_PR_JNL_MAX_SIZE	(256 * 1024)
+
+/*
+ * The PR journal is a header followed by records of the changes made on
+ * top of the snapshot, which crc32c the header holds. So a journal left
+ * over from an interrupted compaction doesn't match the new snapshot and
+ * is ignored, while it still matches the backup copy of the old one.
+ */
+struct scst_pr_jnl_file_hdr {
+	uint64_t sign;
+	uint64_t version;
+	uint32_t snapshot_crc;
+	uint32_t reserved;
+} __packed;
+
+enum scst_pr_jnl_rec_type {
+	SCST_PR_JNL_REG = 1,	/* tid, key, rel_tgt_id */
+	SCST_PR_JNL_UNREG = 2,	/* tid, rel_tgt_id */
+	SCST_PR_JNL_RES = 3,	/* aptpl, is_set, type, scope, has_holder
+				 * [, holder tid, holder rel_tgt_id] */
+};
+
+struct scst_pr_jnl_rec_hdr {
+	uint32_t crc;		/* crc32c of the rest of the record */
+	uint32_t len;		/* of the payload following this header */
+	uint8_t type;
+	uint8_t reserved[3];
+} __packed;
 
 #define FILE_BUFFER_SIZE	512
 
@@ -502,6 +535,19 @@ out_free:
 	goto out;
 }
 
+/* Must be called under dev_pr_mutex */
+static void scst_pr_jnl_free_removed(struct scst_device *dev)
+{
+	struct scst_dev_registrant *reg, *tmp_reg;
+
+	list_for_each_entry_safe(reg, tmp_reg, &dev->pr_jnl_removed_list,
+				 dev_registrants_list_entry) {
+		list_del(&reg->dev_registrants_list_entry);
+		kfree(reg->transport_id);
+		kfree(reg);
+	}
+}
+
 /* Must be called under dev_pr_mutex */
 void scst_pr_remove_registrant(struct scst_device *dev,
 	struct scst_dev_registrant *reg)
@@ -525,9 +571,18 @@ void scst_pr_remove_registrant(struct scst_device *dev,
 	if (reg->tgt_dev)
 		reg->tgt_dev->registrant = NULL;
 
+	if (reg->jnl_synced && (dev->pr_jnl_size != 0)) {
+		/* Its UNREG record will be written by the next sync */
+		reg->tgt_dev = NULL;
+		list_add_tail(&reg->dev_registrants_list_entry,
+			      &dev->pr_jnl_removed_list);
+		goto out;
+	}
+
 	kfree(reg->transport_id);
 	kfree(reg);
 
+out:
 	TRACE_EXIT();
 	return;
 }
@@ -661,7 +716,7 @@ out:
 
 /* Called under scst_mutex */
 static int scst_pr_do_load_device_file(struct scst_device *dev,
-	const char *file_name)
+	const char *file_name, uint32_t *crc)
 {
 	int res = 0, rc;
 	struct file *file = NULL;
@@ -820,6 +875,8 @@ static int scst_pr_do_load_device_file(struct scst_device *dev,
 			dev->pr_holder = reg;
 	}
 
+	*crc = crc32c(0, buf, file_size);
+
 out_close:
 	filp_close(file, NULL);
 
@@ -833,9 +890,205 @@ out:
 	return res;
 }
 
+static int scst_pr_jnl_get_reg(const uint8_t *p, uint32_t len,
+	uint32_t *pos, const uint8_t **tid, __be64 *key, uint16_t *rel_tgt_id)
+{
+	/* Enough for scst_tid_size() */
+	if (len - *pos < 4)
+		return -EINVAL;
+	*tid = &p[*pos];
+	if (len - *pos < scst_tid_size(*tid))
+		return -EINVAL;
+	*pos += scst_tid_size(*tid);
+
+	if (key != NULL) {
+		if (len - *pos < sizeof(*key))
+			return -EINVAL;
+		*key = get_unaligned((__be64 *)&p[*pos]);
+		*pos += sizeof(*key);
+	}
+
+	if (len - *pos < sizeof(*rel_tgt_id))
+		return -EINVAL;
+	*rel_tgt_id = get_unaligned((uint16_t *)&p[*pos]);
+	*pos += sizeof(*rel_tgt_id);
+
+	return 0;
+}
+
+/* Must be called under dev_pr_mutex */
+static int scst_pr_jnl_apply(struct scst_device *dev, uint8_t type,
+	const uint8_t *p, uint32_t len)
+{
+	int res;
+	struct scst_dev_registrant *reg = NULL;
+	const uint8_t *tid;
+	uint16_t rel_tgt_id;
+	uint32_t pos = 0;
+	__be64 key;
+
+	switch (type) {
+	case SCST_PR_JNL_REG:
+		res = scst_pr_jnl_get_reg(p, len, &pos, &tid, &key, &rel_tgt_id);
+		if (res != 0)
+			break;
+		reg = scst_pr_find_reg(dev, tid, rel_tgt_id);
+		if (reg != NULL)
+			reg->key = key;
+		else if (scst_pr_add_registrant(dev, tid, rel_tgt_id, key,
+						false) == NULL)
+			res = -ENOMEM;
+		break;
+	case SCST_PR_JNL_UNREG:
+		res = scst_pr_jnl_get_reg(p, len, &pos, &tid, NULL, &rel_tgt_id);
+		if (res != 0)
+			break;
+		reg = scst_pr_find_reg(dev, tid, rel_tgt_id);
+		if (reg != NULL)
+			scst_pr_remove_registrant(dev, reg);
+		break;
+	case SCST_PR_JNL_RES:
+		if (len < 5) {
+			res = -EINVAL;
+			break;
+		}
+		pos = 5;
+		if (p[4]) {
+			res = scst_pr_jnl_get_reg(p, len, &pos, &tid, NULL,
+						  &rel_tgt_id);
+			if (res != 0)
+				break;
+			reg = scst_pr_find_reg(dev, tid, rel_tgt_id);
+		}
+		dev->pr_aptpl = p[0] ? 1 : 0;
+		dev->pr_is_set = p[1] ? 1 : 0;
+		dev->pr_type = p[2];
+		dev->pr_scope = p[3];
+		dev->pr_holder = reg;
+		res = 0;
+		break;
+	default:
+		res = -EINVAL;
+		break;
+	}
+
+	return res;
+}
+
+/*
+ * Must be called under dev_pr_mutex. Applies the PR journal, if any, on top
+ * of the just loaded snapshot with crc32c @snapshot_crc. Records after the
+ * first torn or corrupted one are ignored.
+ */
+static int scst_pr_jnl_replay(struct scst_device *dev, uint32_t snapshot_crc)
+{
+	int res = 0, rc, nr = 0;
+	struct file *file;
+	uint8_t *buf = NULL;
+	loff_t file_size, pos;
+	mm_segment_t old_fs;
+	const struct scst_pr_jnl_file_hdr *fhdr;
+
+	TRACE_ENTRY();
+
+	scst_assert_pr_mutex_held(dev);
+
+	if (dev->pr_jnl_file_name == NULL)
+		goto out;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+
+	file = filp_open(dev->pr_jnl_file_name, O_RDONLY, 0);
+	if (IS_ERR(file)) {
+		TRACE_PR("Unable to open PR journal '%s' - error %d",
+			dev->pr_jnl_file_name, (int)PTR_ERR(file));
+		goto out_set_fs;
+	}
+
+	file_size = file_inode(file)->i_size;
+	if ((file_size < sizeof(*fhdr)) || (file_size >= 15*1024*1024)) {
+		PRINT_WARNING("Ignoring PR journal '%s' of invalid size %lld",
+			dev->pr_jnl_file_name, file_size);
+		goto out_close;
+	}
+
+	buf = vmalloc(file_size);
+	if (buf == NULL) {
+		res = -ENOMEM;
+		PRINT_ERROR("%s", "Unable to allocate buffer");
+		goto out_close;
+	}
+
+	pos = 0;
+	rc = vfs_read(file, (void __force __user *)buf, file_size, &pos);
+	if (rc != file_size) {
+		PRINT_ERROR("Unable to read file '%s' - error %d",
+			dev->pr_jnl_file_name, rc);
+		res = (rc < 0) ? rc : -EIO;
+		goto out_close;
+	}
+
+	fhdr = (struct scst_pr_jnl_file_hdr *)buf;
+	if ((fhdr->sign != SCST_PR_JNL_SIGN) ||
+	    (fhdr->version != SCST_PR_JNL_VERSION) ||
+	    (fhdr->snapshot_crc != snapshot_crc)) {
+		TRACE_PR("PR journal '%s' doesn't match the loaded snapshot, "
+			"ignoring it", dev->pr_jnl_file_name);
+		goto out_close;
+	}
+
+	pos = sizeof(*fhdr);
+	while (file_size - pos >= sizeof(struct scst_pr_jnl_rec_hdr)) {
+		const struct scst_pr_jnl_rec_hdr *hdr =
+			(struct scst_pr_jnl_rec_hdr *)&buf[pos];
+		uint32_t len = hdr->len;
+
+		if (len > file_size - pos - sizeof(*hdr))
+			break;
+		if (hdr->crc != crc32c(0, &buf[pos + sizeof(hdr->crc)],
+				sizeof(*hdr) - sizeof(hdr->crc) + len))
+			break;
+
+		rc = scst_pr_jnl_apply(dev, hdr->type, &buf[pos + sizeof(*hdr)],
+				       len);
+		if (rc == -ENOMEM) {
+			res = rc;
+			goto out_close;
+		} else if (rc != 0) {
+			PRINT_ERROR("Invalid record type %d at offset %lld of "
+				"PR journal '%s'", hdr->type, pos,
+				dev->pr_jnl_file_name);
+			break;
+		}
+
+		pos += sizeof(*hdr) + len;
+		nr++;
+	}
+
+	if (pos != file_size)
+		PRINT_WARNING("Ignoring last %lld bytes of PR journal '%s'",
+			file_size - pos, dev->pr_jnl_file_name);
+
+	TRACE_PR("Replayed %d records of PR journal '%s'", nr,
+		dev->pr_jnl_file_name);
+
+out_close:
+	filp_close(file, NULL);
+
+out_set_fs:
+	set_fs(old_fs);
+	vfree(buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
 static int scst_pr_load_device_file(struct scst_device *dev)
 {
 	int res, rc;
+	uint32_t crc;
 
 	TRACE_ENTRY();
 
@@ -847,22 +1100,26 @@ static int scst_pr_load_device_file(struct scst_device *dev)
 		goto out;
 	}
 
-	res = scst_pr_do_load_device_file(dev, dev->pr_file_name);
+	res = scst_pr_do_load_device_file(dev, dev->pr_file_name, &crc);
 	if (res == 0)
-		goto out_dump;
+		goto out_replay;
 	else if (res == -ENOMEM)
 		goto out;
 
 	rc = res;
 
-	res = scst_pr_do_load_device_file(dev, dev->pr_file_name1);
+	res = scst_pr_do_load_device_file(dev, dev->pr_file_name1, &crc);
 	if (res != 0) {
 		if (res == -ENOENT)
 			res = rc;
 		goto out;
 	}
 
-out_dump:
+out_replay:
+	res = scst_pr_jnl_replay(dev, crc);
+	if (res != 0)
+		goto out;
+
 	scst_pr_dump_prs(dev, false);
 
 out:
@@ -876,6 +1133,8 @@ static void scst_pr_remove_device_files(struct scst_device *dev)
 
 	scst_assert_pr_mutex_held(dev);
 
+	if (dev->pr_jnl_file_name)
+		scst_remove_file(dev->pr_jnl_file_name);
 	if (dev->pr_file_name)
 		scst_remove_file(dev->pr_file_name);
 	if (dev->pr_file_name1)
@@ -885,26 +1144,84 @@ static void scst_pr_remove_device_files(struct scst_device *dev)
 	return;
 }
 
-/* Must be called under dev_pr_mutex */
-void scst_pr_sync_device_file(struct scst_device *dev)
+struct scst_pr_jnl_buf {
+	uint8_t *buf;		/* NULL while only sizing the data */
+	size_t pos;
+	size_t rec_start;
+};
+
+static void scst_pr_jnl_put(struct scst_pr_jnl_buf *jb, const void *data,
+	size_t len)
+{
+	if (jb->buf != NULL)
+		memcpy(&jb->buf[jb->pos], data, len);
+	jb->pos += len;
+}
+
+/*
+ * Must be called under dev_pr_mutex. Produces the snapshot in the format
+ * scst_pr_do_load_device_file() expects, with a zero signature.
+ */
+static void scst_pr_snapshot_build(struct scst_device *dev,
+	struct scst_pr_jnl_buf *jb)
+{
+	struct scst_dev_registrant *reg;
+	uint64_t sign = 0, version = SCST_PR_FILE_VERSION;
+	uint8_t pr_is_set, aptpl;
+
+	scst_pr_jnl_put(jb, &sign, sizeof(sign));
+	scst_pr_jnl_put(jb, &version, sizeof(version));
+
+	aptpl = dev->pr_aptpl;
+	scst_pr_jnl_put(jb, &aptpl, sizeof(aptpl));
+	pr_is_set = dev->pr_is_set;
+	scst_pr_jnl_put(jb, &pr_is_set, sizeof(pr_is_set));
+	scst_pr_jnl_put(jb, &dev->pr_type, sizeof(dev->pr_type));
+	scst_pr_jnl_put(jb, &dev->pr_scope, sizeof(dev->pr_scope));
+
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		uint8_t is_holder = (dev->pr_holder == reg);
+
+		scst_pr_jnl_put(jb, &is_holder, sizeof(is_holder));
+		scst_pr_jnl_put(jb, reg->transport_id,
+				scst_tid_size(reg->transport_id));
+		scst_pr_jnl_put(jb, &reg->key, sizeof(reg->key));
+		scst_pr_jnl_put(jb, &reg->rel_tgt_id, sizeof(reg->rel_tgt_id));
+	}
+}
+
+/*
+ * Must be called under dev_pr_mutex. Writes the whole PR state into
+ * pr_file_name, keeping the previous one in pr_file_name1. On success
+ * *crc is set to the crc32c of the written file.
+ */
+static int scst_pr_write_snapshot(struct scst_device *dev, uint32_t *crc)
 {
 	int res = 0;
 	struct file *file;
 	mm_segment_t old_fs = get_fs();
+	struct scst_pr_jnl_buf jb = { };
 	loff_t pos = 0;
 	uint64_t sign;
-	uint64_t version;
-	uint8_t pr_is_set, aptpl;
-	struct scst_dev_registrant *reg;
+	size_t size;
 
 	TRACE_ENTRY();
 
 	scst_assert_pr_mutex_held(dev);
 
-	if ((dev->pr_aptpl == 0) || list_empty(&dev->dev_registrants_list)) {
-		scst_pr_remove_device_files(dev);
+	scst_pr_snapshot_build(dev, &jb);
+	size = jb.pos;
+
+	jb.buf = vmalloc(size);
+	if (jb.buf == NULL) {
+		PRINT_ERROR("%s", "Unable to allocate PR file buffer");
+		res = -ENOMEM;
 		goto out;
 	}
+	jb.pos = 0;
+	scst_pr_snapshot_build(dev, &jb);
+	EXTRACHECKS_BUG_ON(jb.pos != size);
 
 	scst_copy_file(dev->pr_file_name, dev->pr_file_name1);
 
@@ -921,78 +1238,13 @@ void scst_pr_sync_device_file(struct scst_device *dev)
 	TRACE_PR("Updating pr file '%s'", dev->pr_file_name);
 
 	/*
-	 * signature
-	 */
-	sign = 0;
-	pos = 0;
-	res = vfs_write(file, (void __force __user *)&sign, sizeof(sign), &pos);
-	if (res != sizeof(sign))
-		goto write_error;
-
-	/*
-	 * version
-	 */
-	version = SCST_PR_FILE_VERSION;
-	res = vfs_write(file, (void __force __user *)&version, sizeof(version), &pos);
-	if (res != sizeof(version))
-		goto write_error;
-
-	/*
-	 * APTPL
-	 */
-	aptpl = dev->pr_aptpl;
-	res = vfs_write(file, (void __force __user *)&aptpl, sizeof(aptpl), &pos);
-	if (res != sizeof(aptpl))
-		goto write_error;
-
-	/*
-	 * reservation
+	 * Everything but the signature first, so that a partially written
+	 * file is never taken for a valid one.
 	 */
-	pr_is_set = dev->pr_is_set;
-	res = vfs_write(file, (void __force __user *)&pr_is_set, sizeof(pr_is_set), &pos);
-	if (res != sizeof(pr_is_set))
-		goto write_error;
-
-	res = vfs_write(file, (void __force __user *)&dev->pr_type, sizeof(dev->pr_type), &pos);
-	if (res != sizeof(dev->pr_type))
+	res = vfs_write(file, (void __force __user *)jb.buf, size, &pos);
+	if (res != size)
 		goto write_error;
 
-	res = vfs_write(file, (void __force __user *)&dev->pr_scope, sizeof(dev->pr_scope), &pos);
-	if (res != sizeof(dev->pr_scope))
-		goto write_error;
-
-	/*
-	 * registration records
-	 */
-	list_for_each_entry(reg, &dev->dev_registrants_list,
-			    dev_registrants_list_entry) {
-		uint8_t is_holder = 0;
-		int size;
-
-		is_holder = (dev->pr_holder == reg);
-
-		res = vfs_write(file, (void __force __user *)&is_holder,
-				sizeof(is_holder), &pos);
-		if (res != sizeof(is_holder))
-			goto write_error;
-
-		size = scst_tid_size(reg->transport_id);
-		res = vfs_write(file, (void __force __user *)reg->transport_id,
-				size, &pos);
-		if (res != size)
-			goto write_error;
-
-		res = vfs_write(file, (void __force __user *)&reg->key,
-				sizeof(reg->key), &pos);
-		if (res != sizeof(reg->key))
-			goto write_error;
-
-		res = vfs_write(file, (void __force __user *)&reg->rel_tgt_id,
-				sizeof(reg->rel_tgt_id), &pos);
-		if (res != sizeof(reg->rel_tgt_id))
-			goto write_error;
-	}
-
 	res = vfs_fsync(file, 1);
 	if (res != 0) {
 		PRINT_ERROR("fsync() of the PR file failed: %d", res);
@@ -1013,33 +1265,32 @@ void scst_pr_sync_device_file(struct scst_device *dev)
 
 	res = 0;
 
+	put_unaligned(sign, (uint64_t *)jb.buf);
+	*crc = crc32c(0, jb.buf, size);
+
 	filp_close(file, NULL);
 
 out_set_fs:
 	set_fs(old_fs);
+	vfree(jb.buf);
 
 out:
-	if (res != 0) {
-		PRINT_CRIT_ERROR("Unable to save persistent information "
-				 "(device %s)", dev->virt_name);
-		 /*
-		  * It's safer to not return any error to the initiator and expect
-		  * operator's intervention to be able to save the PR's state next
-		  * time, than to screw up all the interactions with this initiator.
-		  */
-	}
-
-	TRACE_EXIT();
-	return;
+	TRACE_EXIT_RES(res);
+	return res;
 
 write_error:
 	PRINT_ERROR("Error writing to '%s' - error %d", dev->pr_file_name, res);
 
 write_error_close:
 	filp_close(file, NULL);
+	if (res >= 0)
+		res = -EIO;
 #ifdef SCST_USERMODE			/* unlink */
-	res = UMC_kernelize(unlink(dev->pr_file_name));
-	expect_noerr(res, "unlink(\"%s\")", dev->pr_file_name);
+	{
+		int rc = UMC_kernelize(unlink(dev->pr_file_name));
+
+		expect_noerr(rc, "unlink(\"%s\")", dev->pr_file_name);
+	}
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 39)
 	{
 		struct nameidata nd;
@@ -1068,6 +1319,284 @@ write_error_close:
 	goto out_set_fs;
 }
 
+static void scst_pr_jnl_rec_start(struct scst_pr_jnl_buf *jb, uint8_t type)
+{
+	struct scst_pr_jnl_rec_hdr hdr = { .type = type };
+
+	jb->rec_start = jb->pos;
+	scst_pr_jnl_put(jb, &hdr, sizeof(hdr));
+}
+
+static void scst_pr_jnl_rec_end(struct scst_pr_jnl_buf *jb)
+{
+	struct scst_pr_jnl_rec_hdr *hdr;
+	uint8_t *p;
+
+	if (jb->buf == NULL)
+		return;
+
+	p = &jb->buf[jb->rec_start];
+	hdr = (struct scst_pr_jnl_rec_hdr *)p;
+	hdr->len = jb->pos - jb->rec_start - sizeof(*hdr);
+	hdr->crc = crc32c(0, p + sizeof(hdr->crc),
+			  jb->pos - jb->rec_start - sizeof(hdr->crc));
+}
+
+static void scst_pr_jnl_put_reg(struct scst_pr_jnl_buf *jb,
+	const struct scst_dev_registrant *reg, bool with_key)
+{
+	scst_pr_jnl_put(jb, reg->transport_id,
+			scst_tid_size(reg->transport_id));
+	if (with_key)
+		scst_pr_jnl_put(jb, &reg->key, sizeof(reg->key));
+	scst_pr_jnl_put(jb, &reg->rel_tgt_id, sizeof(reg->rel_tgt_id));
+}
+
+/*
+ * Must be called under dev_pr_mutex. Produces the records for all changes
+ * since the last sync: removed registrants first, then new registrants and
+ * changed keys, then the reservation, which might refer to any of them.
+ */
+static void scst_pr_jnl_build(struct scst_device *dev,
+	struct scst_pr_jnl_buf *jb)
+{
+	struct scst_dev_registrant *reg;
+	uint8_t state[5];
+
+	list_for_each_entry(reg, &dev->pr_jnl_removed_list,
+			    dev_registrants_list_entry) {
+		scst_pr_jnl_rec_start(jb, SCST_PR_JNL_UNREG);
+		scst_pr_jnl_put_reg(jb, reg, false);
+		scst_pr_jnl_rec_end(jb);
+	}
+
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		if (reg->jnl_synced && (reg->jnl_key == reg->key))
+			continue;
+		scst_pr_jnl_rec_start(jb, SCST_PR_JNL_REG);
+		scst_pr_jnl_put_reg(jb, reg, true);
+		scst_pr_jnl_rec_end(jb);
+	}
+
+	state[0] = dev->pr_aptpl;
+	state[1] = dev->pr_is_set;
+	state[2] = dev->pr_type;
+	state[3] = dev->pr_scope;
+	state[4] = (dev->pr_holder != NULL);
+	scst_pr_jnl_rec_start(jb, SCST_PR_JNL_RES);
+	scst_pr_jnl_put(jb, state, sizeof(state));
+	if (dev->pr_holder != NULL)
+		scst_pr_jnl_put_reg(jb, dev->pr_holder, false);
+	scst_pr_jnl_rec_end(jb);
+}
+
+/* Must be called under dev_pr_mutex */
+static void scst_pr_jnl_mark_synced(struct scst_device *dev)
+{
+	struct scst_dev_registrant *reg;
+
+	list_for_each_entry(reg, &dev->dev_registrants_list,
+			    dev_registrants_list_entry) {
+		reg->jnl_synced = 1;
+		reg->jnl_key = reg->key;
+	}
+
+	scst_pr_jnl_free_removed(dev);
+}
+
+/*
+ * Must be called under dev_pr_mutex. Appends the changes since the last
+ * sync to the journal with a single write and fdatasync.
+ */
+static int scst_pr_jnl_append(struct scst_device *dev)
+{
+	int res;
+	struct scst_pr_jnl_buf jb = { };
+	struct file *file;
+	mm_segment_t old_fs;
+	loff_t pos;
+	size_t size;
+
+	TRACE_ENTRY();
+
+	scst_assert_pr_mutex_held(dev);
+
+	scst_pr_jnl_build(dev, &jb);
+	size = jb.pos;
+
+	jb.buf = vmalloc(size);
+	if (jb.buf == NULL) {
+		PRINT_ERROR("%s", "Unable to allocate PR journal buffer");
+		res = -ENOMEM;
+		goto out;
+	}
+	jb.pos = 0;
+	scst_pr_jnl_build(dev, &jb);
+	EXTRACHECKS_BUG_ON(jb.pos != size);
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+
+	file = filp_open(dev->pr_jnl_file_name, O_WRONLY, 0);
+	if (IS_ERR(file)) {
+		res = PTR_ERR(file);
+		PRINT_ERROR("Unable to open PR journal '%s' - error %d",
+			dev->pr_jnl_file_name, res);
+		goto out_set_fs;
+	}
+
+	TRACE_PR("Appending %zu bytes to pr journal '%s'", size,
+		dev->pr_jnl_file_name);
+
+	pos = dev->pr_jnl_size;
+	res = vfs_write(file, (void __force __user *)jb.buf, size, &pos);
+	if (res != size) {
+		PRINT_ERROR("Error writing to '%s' - error %d",
+			dev->pr_jnl_file_name, res);
+		if (res >= 0)
+			res = -EIO;
+		goto out_close;
+	}
+
+	res = vfs_fsync(file, 1);
+	if (res != 0) {
+		PRINT_ERROR("fsync() of the PR journal failed: %d", res);
+		goto out_close;
+	}
+
+	dev->pr_jnl_size += size;
+	scst_pr_jnl_mark_synced(dev);
+
+out_close:
+	filp_close(file, NULL);
+
+out_set_fs:
+	set_fs(old_fs);
+	vfree(jb.buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/*
+ * Must be called under dev_pr_mutex after a new snapshot was written.
+ * Starts an empty journal on top of it.
+ */
+static int scst_pr_jnl_reset(struct scst_device *dev, uint32_t snapshot_crc)
+{
+	int res;
+	struct file *file;
+	mm_segment_t old_fs = get_fs();
+	struct scst_pr_jnl_file_hdr hdr = {
+		.sign = SCST_PR_JNL_SIGN,
+		.version = SCST_PR_JNL_VERSION,
+		.snapshot_crc = snapshot_crc,
+	};
+	loff_t pos = 0;
+
+	TRACE_ENTRY();
+
+	scst_assert_pr_mutex_held(dev);
+
+	set_fs(KERNEL_DS);
+
+	file = filp_open(dev->pr_jnl_file_name, O_WRONLY | O_CREAT | O_TRUNC,
+			 0644);
+	if (IS_ERR(file)) {
+		res = PTR_ERR(file);
+		PRINT_ERROR("Unable to (re)create PR journal '%s' - error %d",
+			dev->pr_jnl_file_name, res);
+		goto out_set_fs;
+	}
+
+	res = vfs_write(file, (void __force __user *)&hdr, sizeof(hdr), &pos);
+	if (res != sizeof(hdr)) {
+		PRINT_ERROR("Error writing to '%s' - error %d",
+			dev->pr_jnl_file_name, res);
+		if (res >= 0)
+			res = -EIO;
+		goto out_close;
+	}
+
+	res = vfs_fsync(file, 1);
+	if (res != 0) {
+		PRINT_ERROR("fsync() of the PR journal failed: %d", res);
+		goto out_close;
+	}
+
+	dev->pr_jnl_size = sizeof(hdr);
+
+out_close:
+	filp_close(file, NULL);
+
+out_set_fs:
+	set_fs(old_fs);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/* Must be called under dev_pr_mutex */
+void scst_pr_sync_device_file(struct scst_device *dev)
+{
+	int res = 0;
+	uint32_t crc;
+
+	TRACE_ENTRY();
+
+	scst_assert_pr_mutex_held(dev);
+
+	if ((dev->pr_aptpl == 0) || list_empty(&dev->dev_registrants_list)) {
+		scst_pr_remove_device_files(dev);
+		dev->pr_jnl_size = 0;
+		scst_pr_jnl_mark_synced(dev);
+		goto out;
+	}
+
+	if ((dev->pr_jnl_size != 0) &&
+	    (dev->pr_jnl_size < SCST_PR_JNL_MAX_SIZE)) {
+		res = scst_pr_jnl_append(dev);
+		if (res == 0)
+			goto out;
+		/* Fall back to a full snapshot */
+	}
+
+	dev->pr_jnl_size = 0;
+
+	res = scst_pr_write_snapshot(dev, &crc);
+	if (res != 0)
+		goto out;
+
+	scst_pr_jnl_mark_synced(dev);
+
+	if (dev->pr_jnl_file_name != NULL) {
+		res = scst_pr_jnl_reset(dev, crc);
+		if (res != 0) {
+			/* The snapshot is up to date, so only log it */
+			PRINT_WARNING("Unable to start PR journal for device "
+				"%s, will write full snapshots (error %d)",
+				dev->virt_name, res);
+			res = 0;
+		}
+	}
+
+out:
+	if (res != 0) {
+		PRINT_CRIT_ERROR("Unable to save persistent information "
+				 "(device %s)", dev->virt_name);
+		 /*
+		  * It's safer to not return any error to the initiator and expect
+		  * operator's intervention to be able to save the PR's state next
+		  * time, than to screw up all the interactions with this initiator.
+		  */
+	}
+
+	TRACE_EXIT();
+	return;
+}
+
 #endif /* CONFIG_SCST_PROC */
 
 /**
@@ -1085,7 +1614,7 @@ int scst_pr_set_file_name(struct scst_device *dev, char **prev,
 			  const char *fmt, ...)
 {
 	va_list args;
-	char *pr_file_name = NULL, *bkp = NULL;
+	char *pr_file_name = NULL, *bkp = NULL, *jnl = NULL;
 	int file_mode, res = -EINVAL;
 
 	scst_assert_pr_mutex_held(dev);
@@ -1127,6 +1656,14 @@ int scst_pr_set_file_name(struct scst_device *dev, char **prev,
 		PRINT_ERROR("Unable to kasprintf() backup PR file name");
 		goto out;
 	}
+	/* No journal next to block devices */
+	if (file_mode < 0 || !S_ISBLK(file_mode)) {
+		jnl = kasprintf(GFP_KERNEL, "%s.journal", pr_file_name);
+		if (!jnl) {
+			PRINT_ERROR("Unable to kasprintf() PR journal name");
+			goto out;
+		}
+	}
 	if (prev) {
 		*prev = dev->pr_file_name;
 		dev->pr_file_name = pr_file_name;
@@ -1134,11 +1671,15 @@ int scst_pr_set_file_name(struct scst_device *dev, char **prev,
 	} else
 		swap(dev->pr_file_name, pr_file_name);
 	swap(dev->pr_file_name1, bkp);
+	swap(dev->pr_jnl_file_name, jnl);
+	/* The next sync starts over with a snapshot in the new place */
+	dev->pr_jnl_size = 0;
 	res = 0;
 
 out:
 	kfree(pr_file_name);
 	kfree(bkp);
+	kfree(jnl);
 	return res;
 }
 
@@ -1153,6 +1694,8 @@ int scst_pr_init(struct scst_device *dev)
 	dev->pr_scope = SCOPE_LU;
 	dev->pr_type = TYPE_UNSPECIFIED;
 	INIT_LIST_HEAD(&dev->dev_registrants_list);
+	dev->pr_jnl_size = 0;
+	INIT_LIST_HEAD(&dev->pr_jnl_removed_list);
 
 	return 0;
 }
@@ -1215,6 +1758,8 @@ int scst_pr_init_dev(struct scst_device *dev)
 		res = 0;
 #endif
 
+	scst_pr_publish_verdicts(dev);
+
 	TRACE_EXIT_RES(res);
 	return res;
 }
@@ -1225,9 +1770,11 @@ void scst_pr_clear_dev(struct scst_device *dev)
 	TRACE_ENTRY();
 
 	scst_pr_remove_registrants(dev);
+	scst_pr_jnl_free_removed(dev);
 
 	kfree(dev->pr_file_name);
 	kfree(dev->pr_file_name1);
+	kfree(dev->pr_jnl_file_name);
 
 	TRACE_EXIT();
 	return;
@@ -2491,68 +3038,98 @@ out:
 
 }
 
-/* Check if command allowed in presence of reservation */
-bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
+/*
+ * Returns the PR verdict for an I_T nexus with registration @reg, see
+ * tgt_dev->pr_verdict.
+ */
+static unsigned int scst_pr_verdict(struct scst_device *dev,
+	const struct scst_dev_registrant *reg)
 {
-	bool allowed;
-	struct scst_device *dev = cmd->dev;
-	struct scst_tgt_dev *tgt_dev = cmd->tgt_dev;
-	struct scst_dev_registrant *reg;
-	uint8_t type;
-
-	TRACE_ENTRY();
-
-	scst_pr_read_lock(dev);
+	unsigned int verdict;
 
-	TRACE_DBG("Testing if command %s (%s) from %s allowed to execute",
-		cmd->op_name, scst_get_opcode_name(cmd), cmd->sess->initiator_name);
-
-	/* Recheck, because it can change while we were waiting for the lock */
-	if (unlikely(!dev->pr_is_set)) {
-		allowed = true;
-		goto out_unlock;
-	}
-
-	reg = tgt_dev->registrant;
-	type = dev->pr_type;
+	if (!dev->pr_is_set)
+		return SCST_PR_VERDICT_ALL;
 
-	switch (type) {
+	switch (dev->pr_type) {
 	case TYPE_WRITE_EXCLUSIVE:
 		if (reg && reg == dev->pr_holder)
-			allowed = true;
+			verdict = SCST_PR_VERDICT_ALL;
 		else
-			allowed = (cmd->op_flags & SCST_WRITE_EXCL_ALLOWED) != 0;
+			verdict = SCST_WRITE_EXCL_ALLOWED;
 		break;
 
 	case TYPE_EXCLUSIVE_ACCESS:
 		if (reg && reg == dev->pr_holder)
-			allowed = true;
+			verdict = SCST_PR_VERDICT_ALL;
 		else
-			allowed = (cmd->op_flags & SCST_EXCL_ACCESS_ALLOWED) != 0;
+			verdict = SCST_EXCL_ACCESS_ALLOWED;
 		break;
 
 	case TYPE_WRITE_EXCLUSIVE_REGONLY:
 	case TYPE_WRITE_EXCLUSIVE_ALL_REG:
 		if (reg)
-			allowed = true;
+			verdict = SCST_PR_VERDICT_ALL;
 		else
-			allowed = (cmd->op_flags & SCST_WRITE_EXCL_ALLOWED) != 0;
+			verdict = SCST_WRITE_EXCL_ALLOWED;
 		break;
 
 	case TYPE_EXCLUSIVE_ACCESS_REGONLY:
 	case TYPE_EXCLUSIVE_ACCESS_ALL_REG:
 		if (reg)
-			allowed = true;
+			verdict = SCST_PR_VERDICT_ALL;
 		else
-			allowed = (cmd->op_flags & SCST_EXCL_ACCESS_ALLOWED) != 0;
+			verdict = SCST_EXCL_ACCESS_ALLOWED;
 		break;
 
 	default:
-		PRINT_ERROR("Invalid PR type %x", type);
-		allowed = false;
+		PRINT_ERROR("Invalid PR type %x", dev->pr_type);
+		verdict = 0;
 		break;
 	}
 
+	return verdict;
+}
+
+/* Must be called under dev_lock */
+void scst_pr_set_verdict(struct scst_tgt_dev *tgt_dev)
+{
+	WRITE_ONCE(tgt_dev->pr_verdict,
+		   scst_pr_verdict(tgt_dev->dev, tgt_dev->registrant));
+}
+
+/*
+ * Must be called under dev_pr_mutex after any change of the reservation,
+ * the registrants or their tgt_devs. Recomputes the verdicts
+ * scst_pr_is_cmd_allowed() checks.
+ */
+void scst_pr_publish_verdicts(struct scst_device *dev)
+{
+	struct scst_tgt_dev *tgt_dev;
+
+	lockdep_assert_pr_write_lock_held(dev);
+
+	spin_lock_bh(&dev->dev_lock);
+	list_for_each_entry(tgt_dev, &dev->dev_tgt_dev_list,
+			    dev_tgt_dev_list_entry)
+		scst_pr_set_verdict(tgt_dev);
+	spin_unlock_bh(&dev->dev_lock);
+}
+
+/*
+ * Check if command allowed in presence of reservation. Lockless, a command
+ * racing with a PR change may see either the old or the new verdict.
+ */
+bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
+{
+	bool allowed;
+	unsigned int verdict;
+
+	TRACE_ENTRY();
+
+	verdict = READ_ONCE(cmd->tgt_dev->pr_verdict);
+	allowed = (verdict == SCST_PR_VERDICT_ALL) ||
+		  ((cmd->op_flags & verdict) != 0);
+
 	if (!allowed)
 		TRACE_PR("Command %s (%s) from %s rejected due "
 			"to PR", cmd->op_name, scst_get_opcode_name(cmd),
@@ -2562,9 +3139,6 @@ bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd)
 			cmd->op_name, scst_get_opcode_name(cmd),
 			cmd->sess->initiator_name);
 
-out_unlock:
-	scst_pr_read_unlock(dev);
-
 	TRACE_EXIT_RES(allowed);
 	return allowed;
 }
@@ -89,8 +89,11 @@ static inline void scst_pr_write_lock(struct scst_device *dev)
 	mutex_lock(&dev->dev_pr_mutex);
 }
 
+void scst_pr_publish_verdicts(struct scst_device *dev);
+
 static inline void scst_pr_write_unlock(struct scst_device *dev)
 {
+	scst_pr_publish_verdicts(dev);
 	mutex_unlock(&dev->dev_pr_mutex);
 }
 
@@ -108,6 +111,11 @@ void scst_pr_clear_dev(struct scst_device *dev);
 int scst_pr_init_tgt_dev(struct scst_tgt_dev *tgt_dev);
 void scst_pr_clear_tgt_dev(struct scst_tgt_dev *tgt_dev);
 
+/* tgt_dev->pr_verdict value allowing all commands */
+#define SCST_PR_VERDICT_ALL			(~0U)
+
+void scst_pr_set_verdict(struct scst_tgt_dev *tgt_dev);
+
 bool scst_pr_crh_case(struct scst_cmd *cmd);
 bool scst_pr_is_cmd_allowed(struct scst_cmd *cmd);
 
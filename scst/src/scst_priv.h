@@ -147,6 +147,25 @@ typedef void (*scst_i_finish_fn_t) (struct scst_cmd *cmd);
 extern struct mutex scst_mutex2;
 
 extern int scst_threads;
+extern int scst_node_threads;
+
+extern struct scst_cmd_thread_t **scst_main_thr_array;
+extern int scst_main_thr_cnt;
+
+/* Part of scst_main_thr_array with the threads of a NUMA node */
+struct scst_node_thrs {
+	int first;
+	int cnt;
+};
+extern struct scst_node_thrs *scst_main_thr_nodes;
+
+/*
+ * Max number of commands a thread moves at once from active_cmd_list of its
+ * pool to its own thr_active_cmd_list.
+ */
+#define SCST_THR_BATCH_CMDS 4
+extern int scst_work_stealing;
+void scst_get_thr_stats(struct scst_thr_stats *stats, bool reset);
 
 extern unsigned int scst_max_dev_cmd_mem;
 
@@ -226,8 +245,31 @@ struct scst_cmd_thread_t {
 	struct scst_cmd_threads *thr_cmd_threads;
 	struct list_head thread_list_entry;
 	bool being_stopped;
+	/* NUMA node the thread is bound to or NUMA_NO_NODE */
+	int thr_nodeid;
+	/* Updated only by the thread itself */
+	struct scst_thr_stats thr_stats;
 };
 
+/*
+ * Returns the scst_main_cmd_threads thread for all commands of sess. Prefers
+ * the threads of the session's NUMA node, if there are any. scst_main_thr_cnt
+ * must not be 0.
+ */
+static inline struct scst_cmd_thread_t *scst_sess_main_thr(
+	struct scst_session *sess)
+{
+	u32 h = hash_ptr(sess, 32);
+	int nodeid = READ_ONCE(sess->sess_numa_node_id);
+
+	if ((nodeid != NUMA_NO_NODE) && (nodeid < nr_node_ids) &&
+	    (scst_main_thr_nodes[nodeid].cnt != 0))
+		return scst_main_thr_array[scst_main_thr_nodes[nodeid].first +
+				h % scst_main_thr_nodes[nodeid].cnt];
+
+	return scst_main_thr_array[h % scst_main_thr_cnt];
+}
+
 static inline bool scst_set_io_context(struct scst_cmd *cmd,
 	struct io_context **old)
 {
@@ -279,6 +321,7 @@ extern enum scst_dev_type_threads_pool_type scst_parse_threads_pool_type(
 extern int scst_add_threads(struct scst_cmd_threads *cmd_threads,
 	struct scst_device *dev, struct scst_tgt_dev *tgt_dev, int num);
 extern void scst_del_threads(struct scst_cmd_threads *cmd_threads, int num);
+extern void scst_main_thr_array_rebuild(void);
 
 extern int scst_create_dev_threads(struct scst_device *dev);
 extern void scst_stop_dev_threads(struct scst_device *dev);
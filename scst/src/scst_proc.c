@@ -1233,7 +1233,7 @@ static ssize_t scst_proc_threads_write(struct file *file,
 				       const char __user *buf,
 				       size_t length, loff_t *off)
 {
-	int res = length;
+	int res = length, rc;
 	int oldtn, newtn, delta;
 	char *buffer;
 
@@ -1268,6 +1268,13 @@ static ssize_t scst_proc_threads_write(struct file *file,
 		goto out_free;
 	}
 
+	/* Threads with assigned commands can't be stopped, see sysfs */
+	rc = scst_suspend_activity(SCST_SUSPEND_TIMEOUT_USER);
+	if (rc != 0) {
+		res = rc;
+		goto out_up_proc;
+	}
+
 	mutex_lock(&scst_mutex);
 
 	oldtn = scst_main_cmd_threads.nr_threads;
@@ -1281,17 +1288,21 @@ static ssize_t scst_proc_threads_write(struct file *file,
 	if (delta < 0)
 		scst_del_threads(&scst_main_cmd_threads, -delta);
 	else {
-		int rc = scst_add_threads(&scst_main_cmd_threads, NULL, NULL,
-					delta);
+		rc = scst_add_threads(&scst_main_cmd_threads, NULL, NULL,
+				      delta);
 		if (rc != 0)
 			res = rc;
 	}
+	scst_main_thr_array_rebuild();
 
 	PRINT_INFO("Changed cmd threads num: old %d, new %d", oldtn, newtn);
 
 out_up_thr_free:
 	mutex_unlock(&scst_mutex);
 
+	scst_resume_activity();
+
+out_up_proc:
 	mutex_unlock(&scst_proc_mutex);
 
 out_free:
@@ -3599,6 +3599,50 @@ static struct kobj_attribute dev_numa_node_id_attr =
 	__ATTR(numa_node_id, S_IRUGO | S_IWUSR, scst_dev_numa_node_id_show,
 		scst_dev_numa_node_id_store);
 
+static ssize_t scst_dev_scsi_atomic_blocked_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_device *dev;
+	uint64_t cmds, total_us, max_us;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	spin_lock_bh(&dev->dev_lock);
+	cmds = dev->dev_scsi_atomic_blocked_cmds;
+	total_us = dev->dev_scsi_atomic_blocked_us;
+	max_us = dev->dev_scsi_atomic_blocked_max_us;
+	spin_unlock_bh(&dev->dev_lock);
+
+	return scnprintf(buf, SCST_SYSFS_BLOCK_SIZE,
+		"cmds\t%llu\ntotal_us\t%llu\nmax_us\t%llu\n",
+		(unsigned long long)cmds, (unsigned long long)total_us,
+		(unsigned long long)max_us);
+}
+
+static ssize_t scst_dev_scsi_atomic_blocked_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_device *dev;
+
+	dev = container_of(kobj, struct scst_device, dev_kobj);
+
+	PRINT_INFO("Zeroing SCSI atomicity blocking statistics for device %s",
+		dev->virt_name);
+
+	spin_lock_bh(&dev->dev_lock);
+	dev->dev_scsi_atomic_blocked_cmds = 0;
+	dev->dev_scsi_atomic_blocked_us = 0;
+	dev->dev_scsi_atomic_blocked_max_us = 0;
+	spin_unlock_bh(&dev->dev_lock);
+
+	return count;
+}
+
+static struct kobj_attribute dev_scsi_atomic_blocked_attr =
+	__ATTR(scsi_atomic_blocked, S_IRUGO | S_IWUSR,
+		scst_dev_scsi_atomic_blocked_show,
+		scst_dev_scsi_atomic_blocked_store);
+
 static ssize_t scst_dev_block_show(struct kobject *kobj,
 	struct kobj_attribute *attr, char *buf)
 {
@@ -3731,6 +3775,7 @@ static struct attribute *scst_dev_attrs[] = {
 	&dev_type_attr.attr,
 	&dev_max_tgt_dev_commands_attr.attr,
 	&dev_numa_node_id_attr.attr,
+	&dev_scsi_atomic_blocked_attr.attr,
 	&dev_block_attr.attr,
 	NULL,
 };
@@ -7085,6 +7130,7 @@ static int scst_process_threads_store(int newtn)
 		if (res != 0)
 			goto out_up;
 	}
+	scst_main_thr_array_rebuild();
 
 	PRINT_INFO("Changed cmd threads num: old %ld, new %d", oldtn, newtn);
 
@@ -7228,6 +7274,84 @@ static struct kobj_attribute scst_max_tasklet_cmd_attr =
 	__ATTR(max_tasklet_cmd, S_IRUGO | S_IWUSR, scst_max_tasklet_cmd_show,
 	       scst_max_tasklet_cmd_store);
 
+static ssize_t scst_work_stealing_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	int count;
+
+	TRACE_ENTRY();
+
+	count = sprintf(buf, "%d\n%s\n", scst_work_stealing,
+		scst_work_stealing ? "" : SCST_SYSFS_KEY_MARK);
+
+	TRACE_EXIT();
+	return count;
+}
+
+static ssize_t scst_work_stealing_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	int res;
+	unsigned long val;
+
+	TRACE_ENTRY();
+
+	res = kstrtoul(buf, 0, &val);
+	if (res != 0) {
+		PRINT_ERROR("kstrtoul() for %s failed: %d ", buf, res);
+		goto out;
+	}
+
+	scst_work_stealing = !!val;
+	PRINT_INFO("Changed work_stealing to %d", scst_work_stealing);
+
+	res = count;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static struct kobj_attribute scst_work_stealing_attr =
+	__ATTR(work_stealing, S_IRUGO | S_IWUSR, scst_work_stealing_show,
+	       scst_work_stealing_store);
+
+static ssize_t scst_threads_stats_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	struct scst_thr_stats stats;
+	int count;
+
+	TRACE_ENTRY();
+
+	scst_get_thr_stats(&stats, false);
+
+	count = sprintf(buf, "shared_cmds %lu\nlocal_cmds %lu\n"
+		"stolen_cmds %lu\nshared_lock_contended %lu\n",
+		stats.shared_cmds, stats.local_cmds, stats.stolen_cmds,
+		stats.shared_lock_contended);
+
+	TRACE_EXIT();
+	return count;
+}
+
+static ssize_t scst_threads_stats_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	struct scst_thr_stats stats;
+
+	TRACE_ENTRY();
+
+	scst_get_thr_stats(&stats, true);
+
+	TRACE_EXIT();
+	return count;
+}
+
+static struct kobj_attribute scst_threads_stats_attr =
+	__ATTR(threads_stats, S_IRUGO | S_IWUSR, scst_threads_stats_show,
+	       scst_threads_stats_store);
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
 
 static ssize_t scst_poll_us_show(struct kobject *kobj,
@@ -7589,6 +7713,8 @@ static struct attribute *scst_sysfs_root_default_attrs[] = {
 	&scst_threads_attr.attr,
 	&scst_setup_id_attr.attr,
 	&scst_max_tasklet_cmd_attr.attr,
+	&scst_work_stealing_attr.attr,
+	&scst_threads_stats_attr.attr,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
 	&scst_poll_us_attr.attr,
 #endif
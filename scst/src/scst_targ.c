@@ -29,6 +29,8 @@
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/rbtree.h>
 #include <linux/vmalloc.h>
 #include <scsi/sg.h>
 
@@ -72,6 +74,54 @@ void scst_post_dev_alloc_data_buf(struct scst_cmd *cmd)
 }
 EXPORT_SYMBOL_GPL(scst_post_dev_alloc_data_buf);
 
+/*
+ * Queues cmd for processing by its assigned thread, if it has one, otherwise
+ * by any thread of its cmd_threads. No locks, but might be in IRQ.
+ */
+static void scst_add_active_cmd(struct scst_cmd *cmd)
+{
+	struct list_head *active_cmd_list;
+	struct scst_cmd_threads *steal_threads = NULL;
+	unsigned long flags;
+
+	if (cmd->cmd_thr != NULL) {
+		TRACE_DBG("Using assigned thread %p for cmd %p",
+			cmd->cmd_thr, cmd);
+		active_cmd_list = &cmd->cmd_thr->thr_active_cmd_list;
+		spin_lock_irqsave(&cmd->cmd_thr->thr_cmd_list_lock, flags);
+	} else {
+		active_cmd_list = &cmd->cmd_threads->active_cmd_list;
+		spin_lock_irqsave(&cmd->cmd_threads->cmd_list_lock, flags);
+	}
+	TRACE_DBG("Adding cmd %p to active cmd list", cmd);
+	if ((cmd->cmd_thr != NULL) && !list_empty(active_cmd_list) &&
+	    scst_work_stealing &&
+	    !READ_ONCE(cmd->cmd_thr->thr_cmd_threads->steal_hint))
+		steal_threads = cmd->cmd_thr->thr_cmd_threads;
+	if (unlikely(cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
+		list_add(&cmd->cmd_list_entry, active_cmd_list);
+	else
+		list_add_tail(&cmd->cmd_list_entry, active_cmd_list);
+	if (cmd->cmd_thr != NULL) {
+		wake_up_process(cmd->cmd_thr->cmd_thread);
+		spin_unlock_irqrestore(&cmd->cmd_thr->thr_cmd_list_lock, flags);
+	} else {
+		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
+		spin_unlock_irqrestore(&cmd->cmd_threads->cmd_list_lock, flags);
+	}
+
+	/*
+	 * The assigned thread is busy, so let an idle thread of the same pool,
+	 * if any, take part of its backlog. Cmd might already be processed
+	 * here, so don't touch it anymore.
+	 */
+	if (steal_threads != NULL) {
+		WRITE_ONCE(steal_threads->steal_hint, true);
+		wake_up(&steal_threads->cmd_list_waitQ);
+	}
+	return;
+}
+
 static inline void scst_schedule_tasklet(struct scst_cmd *cmd)
 {
 	struct scst_percpu_info *i;
@@ -267,15 +317,248 @@ static bool scst_cmd_overlap(struct scst_cmd *chk_cmd, struct scst_cmd *cmd)
 	return res;
 }
 
+/*
+ * Index of cmds by LBA range
+ *
+ * An rbtree sorted by starting LBA, plus the number of entries per power of
+ * two length. An entry starting 2^(max_order + 1) or more blocks before lba
+ * is too short to reach it, so a lookup of [lba, lba + blocks) only walks the
+ * entries starting in between: O(log n) plus the cmds near the range, instead
+ * of all the cmds being executed on the device.
+ */
+
+static int scst_lba_index_order(int64_t blocks)
+{
+	if (blocks <= 1)
+		return 0;
+	/* Keep 2 << order in int64_t */
+	return min_t(int, ilog2((u64)blocks), 61);
+}
+
+static void scst_lba_index_insert(struct scst_lba_index *idx,
+	struct scst_lba_index_node *node, struct scst_cmd *cmd, int64_t blocks)
+{
+	struct rb_node **p = &idx->root.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p != NULL) {
+		parent = *p;
+		if (cmd->lba < rb_entry(parent, struct scst_lba_index_node,
+					rb)->cmd->lba)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	node->cmd = cmd;
+	node->order = scst_lba_index_order(blocks);
+	rb_link_node(&node->rb, parent, p);
+	rb_insert_color(&node->rb, &idx->root);
+
+	idx->order_count[node->order]++;
+	if (node->order > idx->max_order)
+		idx->max_order = node->order;
+	return;
+}
+
+static void scst_lba_index_erase(struct scst_lba_index *idx,
+	struct scst_lba_index_node *node)
+{
+	rb_erase(&node->rb, &idx->root);
+
+	idx->order_count[node->order]--;
+	while ((idx->max_order > 0) && (idx->order_count[idx->max_order] == 0))
+		idx->max_order--;
+	return;
+}
+
+/* Returns the first node from rb on, which may overlap [lba, lba + blocks) */
+static struct scst_lba_index_node *scst_lba_index_scan(struct rb_node *rb,
+	int64_t lba, int64_t blocks)
+{
+	for ( ; rb != NULL; rb = rb_next(rb)) {
+		struct scst_lba_index_node *node = rb_entry(rb,
+					struct scst_lba_index_node, rb);
+
+		if (node->cmd->lba >= lba + blocks)
+			break;
+		/* Its length is less than 2 << order */
+		if (node->cmd->lba + (2LL << node->order) > lba)
+			return node;
+	}
+	return NULL;
+}
+
+/*
+ * Returns the first cmd's node in idx which may overlap [lba, lba + blocks),
+ * the caller checks if it does. Continue with scst_lba_index_next().
+ */
+static struct scst_lba_index_node *scst_lba_index_first(
+	struct scst_lba_index *idx, int64_t lba, int64_t blocks)
+{
+	struct rb_node *rb = idx->root.rb_node, *first = NULL;
+	int64_t from = lba - (2LL << idx->max_order) + 1;
+
+	while (rb != NULL) {
+		if (rb_entry(rb, struct scst_lba_index_node, rb)->cmd->lba >= from) {
+			first = rb;
+			rb = rb->rb_left;
+		} else
+			rb = rb->rb_right;
+	}
+
+	return scst_lba_index_scan(first, lba, blocks);
+}
+
+static struct scst_lba_index_node *scst_lba_index_next(
+	struct scst_lba_index_node *node, int64_t lba, int64_t blocks)
+{
+	return scst_lba_index_scan(rb_next(&node->rb), lba, blocks);
+}
+
+static inline int64_t scst_cmd_lba_blocks(const struct scst_cmd *cmd)
+{
+	return cmd->data_len >> cmd->dev->block_shift;
+}
+
+/*
+ * Cmds without valid LBA, which scst_cmd_overlap_cwr() can find overlapping
+ * with COMPARE AND WRITE
+ */
+static bool scst_cmd_nolba_cwr_relevant(const struct scst_cmd *cmd)
+{
+	switch (cmd->cdb[0]) {
+	case RESERVE:
+	case RESERVE_10:
+	case UNMAP:
+	case EXTENDED_COPY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* dev_lock supposed to be held and BH disabled */
+static void scst_exec_index_add(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+
+	if ((cmd->op_flags & SCST_LBA_NOT_VALID) == 0) {
+		scst_lba_index_insert(&dev->dev_exec_lba_index,
+			&cmd->dev_exec_lba_node, cmd, scst_cmd_lba_blocks(cmd));
+		cmd->dev_exec_lba_indexed = 1;
+	} else if (scst_cmd_nolba_cwr_relevant(cmd)) {
+		list_add_tail(&cmd->dev_exec_nolba_cmd_list_entry,
+			&dev->dev_exec_nolba_cmd_list);
+		cmd->dev_exec_nolba_listed = 1;
+	}
+
+	if (cmd->cdb[0] == COMPARE_AND_WRITE) {
+		scst_lba_index_insert(&dev->dev_exec_cwr_index,
+			&cmd->dev_exec_cwr_node, cmd, scst_cmd_lba_blocks(cmd));
+		cmd->dev_exec_cwr_indexed = 1;
+	}
+	return;
+}
+
+/* dev_lock supposed to be held and BH disabled */
+static void scst_exec_index_del(struct scst_cmd *cmd)
+{
+	struct scst_device *dev = cmd->dev;
+
+	if (cmd->dev_exec_lba_indexed) {
+		scst_lba_index_erase(&dev->dev_exec_lba_index,
+			&cmd->dev_exec_lba_node);
+		cmd->dev_exec_lba_indexed = 0;
+	}
+	if (cmd->dev_exec_nolba_listed) {
+		list_del(&cmd->dev_exec_nolba_cmd_list_entry);
+		cmd->dev_exec_nolba_listed = 0;
+	}
+	if (cmd->dev_exec_cwr_indexed) {
+		scst_lba_index_erase(&dev->dev_exec_cwr_index,
+			&cmd->dev_exec_cwr_node);
+		cmd->dev_exec_cwr_indexed = 0;
+	}
+	return;
+}
+
+/*
+ * dev_lock supposed to be held and BH disabled. Called on the first SCSI
+ * atomic cmd for dev to start indexing the cmds being executed on it.
+ */
+static void scst_exec_index_enable(struct scst_device *dev)
+{
+	struct scst_cmd *cmd;
+
+	TRACE_DBG("Indexing exec cmds of dev %s", dev->virt_name);
+
+	list_for_each_entry(cmd, &dev->dev_exec_cmd_list, dev_exec_cmd_list_entry)
+		scst_exec_index_add(cmd);
+	dev->dev_exec_indexed = 1;
+	return;
+}
+
+static inline uint64_t scst_atomic_time_us(void)
+{
+	return ktime_to_us(ktime_get());
+}
+
+/*
+ * dev_lock supposed to be held and BH disabled. Blocks chk_cmd until cmd
+ * finishes, if they overlap. Returns -ENOMEM if chk_cmd could not be blocked.
+ */
+static int scst_check_atomic_overlap(struct scst_cmd *chk_cmd,
+	struct scst_cmd *cmd, bool *blocked)
+{
+	struct scst_cmd **p = cmd->scsi_atomic_blocked_cmds;
+	int cnt = cmd->scsi_atomic_blocked_cmds_count;
+
+	if ((chk_cmd == cmd) || !scst_cmd_overlap(chk_cmd, cmd))
+		return 0;
+
+	/*
+	 * Grow by doubling: with COMPARE AND WRITE heavy loads lots of cmds
+	 * can queue up behind one.
+	 */
+	if ((cnt == 0) || ((cnt >= 4) && is_power_of_2(cnt))) {
+		p = krealloc(p, sizeof(*p) * (cnt ? cnt * 2 : 4), GFP_ATOMIC);
+		if (p == NULL)
+			return -ENOMEM;
+		cmd->scsi_atomic_blocked_cmds = p;
+	}
+	p[cnt] = chk_cmd;
+	cmd->scsi_atomic_blocked_cmds_count++;
+
+	chk_cmd->scsi_atomic_blockers++;
+
+	TRACE_BLOCK("Delaying cmd %p (op %s, lba %lld, len %lld, blockers %d) "
+		"due to overlap with cmd %p (op %s, lba %lld, len %lld, "
+		"blocked cmds %d)", chk_cmd, scst_get_opcode_name(chk_cmd),
+		(long long)chk_cmd->lba, (long long)chk_cmd->data_len,
+		chk_cmd->scsi_atomic_blockers, cmd, scst_get_opcode_name(cmd),
+		(long long)cmd->lba, (long long)cmd->data_len,
+		cmd->scsi_atomic_blocked_cmds_count);
+
+	*blocked = true;
+	return 0;
+}
+
 /*
  * dev_lock supposed to be held and BH disabled. Returns true if cmd blocked,
  * hence stop processing it and go to the next command.
+ *
+ * Finds the overlapping cmds through the dev's exec cmd indexes: only pairs
+ * with at least one SCSI atomic cmd can overlap, see scst_cmd_overlap().
  */
 static bool scst_check_scsi_atomicity(struct scst_cmd *chk_cmd)
 {
 	bool res = false;
 	struct scst_device *dev = chk_cmd->dev;
+	struct scst_lba_index_node *node;
 	struct scst_cmd *cmd;
+	struct rb_node *rb;
+	int64_t blocks;
 
 	TRACE_ENTRY();
 
@@ -288,41 +571,64 @@ static bool scst_check_scsi_atomicity(struct scst_cmd *chk_cmd)
 		chk_cmd, scst_get_opcode_name(chk_cmd), chk_cmd->internal,
 		(long long)chk_cmd->lba, (long long)chk_cmd->data_len);
 
-	list_for_each_entry(cmd, &dev->dev_exec_cmd_list, dev_exec_cmd_list_entry) {
-		if (chk_cmd == cmd)
-			continue;
-		if (scst_cmd_overlap(chk_cmd, cmd)) {
-			struct scst_cmd **p = cmd->scsi_atomic_blocked_cmds;
-
-			/*
-			 * kmalloc() allocates by at least 32 bytes increments,
-			 * hence krealloc() on 8 bytes increments, if not all
-			 * that space is used, does nothing.
-			 */
-			p = krealloc(p, sizeof(*p) * (cmd->scsi_atomic_blocked_cmds_count + 1),
-				GFP_ATOMIC);
-			if (p == NULL)
+	EXTRACHECKS_BUG_ON(!dev->dev_exec_indexed);
+
+	if ((chk_cmd->op_flags & SCST_SCSI_ATOMIC) != 0) {
+		switch (chk_cmd->cdb[0]) {
+		case COMPARE_AND_WRITE:
+			/* Cmds in its LBA range, and ones without LBA */
+			blocks = max_t(int64_t, scst_cmd_lba_blocks(chk_cmd), 1);
+			for (node = scst_lba_index_first(&dev->dev_exec_lba_index,
+					chk_cmd->lba, blocks);
+			     node != NULL;
+			     node = scst_lba_index_next(node, chk_cmd->lba, blocks)) {
+				if (scst_check_atomic_overlap(chk_cmd, node->cmd, &res))
+					goto out_busy_undo;
+			}
+			list_for_each_entry(cmd, &dev->dev_exec_nolba_cmd_list,
+					dev_exec_nolba_cmd_list_entry) {
+				if (scst_check_atomic_overlap(chk_cmd, cmd, &res))
+					goto out_busy_undo;
+			}
+			break;
+		case RESERVE:
+		case RESERVE_10:
+			/* All COMPARE AND WRITEs */
+			for (rb = rb_first(&dev->dev_exec_cwr_index.root); rb != NULL;
+			     rb = rb_next(rb)) {
+				node = rb_entry(rb, struct scst_lba_index_node, rb);
+				if (scst_check_atomic_overlap(chk_cmd, node->cmd, &res))
+					goto out_busy_undo;
+			}
+			break;
+		default:
+			break;
+		}
+	} else if ((chk_cmd->op_flags & SCST_LBA_NOT_VALID) == 0) {
+		/* COMPARE AND WRITEs in its LBA range */
+		blocks = max_t(int64_t, scst_cmd_lba_blocks(chk_cmd), 1);
+		for (node = scst_lba_index_first(&dev->dev_exec_cwr_index,
+				chk_cmd->lba, blocks);
+		     node != NULL;
+		     node = scst_lba_index_next(node, chk_cmd->lba, blocks)) {
+			if (scst_check_atomic_overlap(chk_cmd, node->cmd, &res))
+				goto out_busy_undo;
+		}
+	} else if (scst_cmd_nolba_cwr_relevant(chk_cmd)) {
+		/* All COMPARE AND WRITEs */
+		for (rb = rb_first(&dev->dev_exec_cwr_index.root); rb != NULL;
+		     rb = rb_next(rb)) {
+			node = rb_entry(rb, struct scst_lba_index_node, rb);
+			if (scst_check_atomic_overlap(chk_cmd, node->cmd, &res))
 				goto out_busy_undo;
-			p[cmd->scsi_atomic_blocked_cmds_count] = chk_cmd;
-			cmd->scsi_atomic_blocked_cmds = p;
-			cmd->scsi_atomic_blocked_cmds_count++;
-
-			chk_cmd->scsi_atomic_blockers++;
-
-			TRACE_BLOCK("Delaying cmd %p (op %s, lba %lld, "
-				"len %lld, blockers %d) due to overlap with "
-				"cmd %p (op %s, lba %lld, len %lld, blocked "
-				"cmds %d)", chk_cmd, scst_get_opcode_name(chk_cmd),
-				(long long)chk_cmd->lba,
-				(long long)chk_cmd->data_len,
-				chk_cmd->scsi_atomic_blockers, cmd,
-				scst_get_opcode_name(cmd), (long long)cmd->lba,
-				(long long)cmd->data_len,
-				cmd->scsi_atomic_blocked_cmds_count);
-			res = true;
 		}
 	}
 
+	if (res) {
+		chk_cmd->scsi_atomic_blocked_start = scst_atomic_time_us();
+		dev->dev_scsi_atomic_blocked_cmds++;
+	}
+
 out:
 	TRACE_EXIT_RES(res);
 	return res;
@@ -331,9 +637,14 @@ out_busy_undo:
 	list_for_each_entry(cmd, &dev->dev_exec_cmd_list, dev_exec_cmd_list_entry) {
 		struct scst_cmd **p = cmd->scsi_atomic_blocked_cmds;
 
-		if ((p != NULL) && (p[cmd->scsi_atomic_blocked_cmds_count-1] == chk_cmd)) {
+		if ((cmd->scsi_atomic_blocked_cmds_count > 0) &&
+		    (p[cmd->scsi_atomic_blocked_cmds_count-1] == chk_cmd)) {
 			cmd->scsi_atomic_blocked_cmds_count--;
 			chk_cmd->scsi_atomic_blockers--;
+			if (cmd->scsi_atomic_blocked_cmds_count == 0) {
+				kfree(p);
+				cmd->scsi_atomic_blocked_cmds = NULL;
+			}
 		}
 	}
 	sBUG_ON(chk_cmd->scsi_atomic_blockers != 0);
@@ -375,6 +686,8 @@ bool scst_do_check_blocked_dev(struct scst_cmd *cmd)
 	if (likely(!cmd->on_dev_exec_list)) {
 		list_add_tail(&cmd->dev_exec_cmd_list_entry, &dev->dev_exec_cmd_list);
 		cmd->on_dev_exec_list = 1;
+		if (unlikely(dev->dev_exec_indexed))
+			scst_exec_index_add(cmd);
 	}
 
 	/*
@@ -388,6 +701,8 @@ bool scst_do_check_blocked_dev(struct scst_cmd *cmd)
 	    !cmd->scsi_atomicity_checked) {
 		cmd->scsi_atomicity_checked = 1;
 		if ((cmd->op_flags & SCST_SCSI_ATOMIC) != 0) {
+			if (unlikely(!dev->dev_exec_indexed))
+				scst_exec_index_enable(dev);
 			dev->dev_scsi_atomic_cmd_active++;
 			TRACE_DBG("cmd %p (dev %p), scsi atomic_cmd_active %d",
 				cmd, dev, dev->dev_scsi_atomic_cmd_active);
@@ -478,6 +793,14 @@ static void scst_check_unblock_scsi_atomic_cmds(struct scst_cmd *cmd)
 
 		acmd->scsi_atomic_blockers--;
 		if (acmd->scsi_atomic_blockers == 0) {
+			struct scst_device *dev = acmd->dev;
+			uint64_t t = scst_atomic_time_us() -
+					acmd->scsi_atomic_blocked_start;
+
+			dev->dev_scsi_atomic_blocked_us += t;
+			if (t > dev->dev_scsi_atomic_blocked_max_us)
+				dev->dev_scsi_atomic_blocked_max_us = t;
+
 			TRACE_BLOCK("Unblocking blocked acmd %p (blocker "
 				"cmd %p)", acmd, cmd);
 			spin_lock_irq(&acmd->cmd_threads->cmd_list_lock);
@@ -516,6 +839,7 @@ void __scst_check_unblock_dev(struct scst_cmd *cmd)
 	if (likely(cmd->on_dev_exec_list)) {
 		list_del(&cmd->dev_exec_cmd_list_entry);
 		cmd->on_dev_exec_list = 0;
+		scst_exec_index_del(cmd);
 	}
 
 	if (unlikely((cmd->op_flags & SCST_SCSI_ATOMIC) != 0)) {
@@ -851,9 +1175,12 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		 * TM processing. This check is needed because there might be
 		 * old, i.e. deferred, commands and new, i.e. just coming, ones.
 		 */
-		if (cmd->sess_cmd_list_entry.next == NULL)
+		if (cmd->sess_cmd_list_entry.next == NULL) {
 			list_add_tail(&cmd->sess_cmd_list_entry,
 				&sess->sess_cmd_list);
+			list_add_tail(&cmd->sess_cmd_tag_hash_entry,
+				&sess->sess_cmd_tag_hash[SESS_CMD_TAG_HASH_FN(cmd->tag)]);
+		}
 		switch (sess->init_phase) {
 		case SCST_SESS_IPH_SUCCESS:
 			break;
@@ -871,9 +1198,12 @@ void scst_cmd_init_done(struct scst_cmd *cmd,
 		default:
 			sBUG();
 		}
-	} else
+	} else {
 		list_add_tail(&cmd->sess_cmd_list_entry,
 			      &sess->sess_cmd_list);
+		list_add_tail(&cmd->sess_cmd_tag_hash_entry,
+			&sess->sess_cmd_tag_hash[SESS_CMD_TAG_HASH_FN(cmd->tag)]);
+	}
 
 	spin_unlock_irqrestore(&sess->sess_list_lock, flags);
 
@@ -912,16 +1242,7 @@ active:
 			pref_context);
 		/* go through */
 	case SCST_CONTEXT_THREAD:
-		spin_lock_irqsave(&cmd->cmd_threads->cmd_list_lock, flags);
-		TRACE_DBG("Adding cmd %p to active cmd list", cmd);
-		if (unlikely(cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
-			list_add(&cmd->cmd_list_entry,
-				&cmd->cmd_threads->active_cmd_list);
-		else
-			list_add_tail(&cmd->cmd_list_entry,
-				&cmd->cmd_threads->active_cmd_list);
-		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
-		spin_unlock_irqrestore(&cmd->cmd_threads->cmd_list_lock, flags);
+		scst_add_active_cmd(cmd);
 		break;
 
 	case SCST_CONTEXT_DIRECT:
@@ -1883,7 +2204,6 @@ static void scst_process_redirect_cmd(struct scst_cmd *cmd,
 	enum scst_exec_context context, int check_retries)
 {
 	struct scst_tgt *tgt = cmd->tgt;
-	unsigned long flags;
 
 	TRACE_ENTRY();
 
@@ -1915,33 +2235,9 @@ static void scst_process_redirect_cmd(struct scst_cmd *cmd,
 			    context);
 		/* go through */
 	case SCST_CONTEXT_THREAD:
-	{
-		struct list_head *active_cmd_list;
-
-		if (cmd->cmd_thr != NULL) {
-			TRACE_DBG("Using assigned thread %p for cmd %p",
-				cmd->cmd_thr, cmd);
-			active_cmd_list = &cmd->cmd_thr->thr_active_cmd_list;
-			spin_lock_irqsave(&cmd->cmd_thr->thr_cmd_list_lock, flags);
-		} else {
-			active_cmd_list = &cmd->cmd_threads->active_cmd_list;
-			spin_lock_irqsave(&cmd->cmd_threads->cmd_list_lock, flags);
-		}
-		TRACE_DBG("Adding cmd %p to active cmd list", cmd);
-		if (unlikely(cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
-			list_add(&cmd->cmd_list_entry, active_cmd_list);
-		else
-			list_add_tail(&cmd->cmd_list_entry, active_cmd_list);
-		if (cmd->cmd_thr != NULL) {
-			wake_up_process(cmd->cmd_thr->cmd_thread);
-			spin_unlock_irqrestore(&cmd->cmd_thr->thr_cmd_list_lock, flags);
-		} else {
-			wake_up(&cmd->cmd_threads->cmd_list_waitQ);
-			spin_unlock_irqrestore(&cmd->cmd_threads->cmd_list_lock, flags);
-		}
+		scst_add_active_cmd(cmd);
 		break;
 	}
-	}
 
 	TRACE_EXIT();
 	return;
@@ -3257,8 +3553,8 @@ int __scst_check_local_events(struct scst_cmd *cmd, bool preempt_tests_only)
 	}
 
 	/*
-	 * Let's check for ABORTED after scst_pr_is_cmd_allowed(), because
-	 * we might sleep for a while there.
+	 * Let's check for ABORTED after the reservation checks, because
+	 * they might take a while in the cluster mode.
 	 */
 skip_reserve:
 	if (unlikely(test_bit(SCST_CMD_ABORTED, &cmd->cmd_flags))) {
@@ -4768,6 +5064,8 @@ static int scst_finish_cmd(struct scst_cmd *cmd)
 		stat->unaligned_cmd_count++;
 
 	list_del(&cmd->sess_cmd_list_entry);
+	if (cmd->sess_cmd_tag_hash_entry.next != NULL)
+		list_del(&cmd->sess_cmd_tag_hash_entry);
 
 	/*
 	 * Done under sess_list_lock to sync with scst_abort_cmd() without
@@ -5027,6 +5325,15 @@ static int scst_translate_lun(struct scst_cmd *cmd)
 
 			if (likely(tgt_dev->dev->handler != &scst_null_devtype)) {
 				cmd->cmd_threads = tgt_dev->active_cmd_threads;
+				/*
+				 * With scst_node_threads all commands of a
+				 * session stay on one of the global threads,
+				 * preferably of the session's NUMA node.
+				 */
+				if ((scst_main_thr_cnt != 0) &&
+				    (cmd->cmd_threads == &scst_main_cmd_threads))
+					cmd->cmd_thr = scst_sess_main_thr(
+								cmd->sess);
 				cmd->tgt_dev = tgt_dev;
 				cmd->cur_order_data = tgt_dev->curr_order_data;
 				cmd->dev = tgt_dev->dev;
@@ -5290,16 +5597,7 @@ restart:
 		list_del(&cmd->cmd_list_entry);
 		spin_unlock(&scst_init_lock);
 
-		spin_lock(&cmd->cmd_threads->cmd_list_lock);
-		TRACE_DBG("Adding cmd %p to active cmd list", cmd);
-		if (unlikely(cmd->queue_type == SCST_CMD_QUEUE_HEAD_OF_QUEUE))
-			list_add(&cmd->cmd_list_entry,
-				&cmd->cmd_threads->active_cmd_list);
-		else
-			list_add_tail(&cmd->cmd_list_entry,
-				&cmd->cmd_threads->active_cmd_list);
-		wake_up(&cmd->cmd_threads->cmd_list_waitQ);
-		spin_unlock(&cmd->cmd_threads->cmd_list_lock);
+		scst_add_active_cmd(cmd);
 
 		spin_lock(&scst_init_lock);
 		goto restart;
@@ -5641,11 +5939,123 @@ static inline int test_cmd_threads(struct scst_cmd_thread_t *thr)
 {
 	int res = !list_empty(&thr->thr_active_cmd_list) ||
 		  !list_empty(&thr->thr_cmd_threads->active_cmd_list) ||
+		  (READ_ONCE(thr->thr_cmd_threads->steal_hint) &&
+		   scst_work_stealing) ||
 		  unlikely(kthread_should_stop()) ||
 		  tm_dbg_is_release();
 	return res;
 }
 
+/*
+ * Takes the first command from active_cmd_list of thr's pool and, if thr's
+ * own list is empty, moves up to SCST_THR_BATCH_CMDS - 1 following commands
+ * in order to it, so the next ones don't need cmd_list_lock. The threads
+ * woken for the batched commands would find active_cmd_list empty, so they
+ * are told to steal them instead.
+ *
+ * No locks, returns NULL if active_cmd_list is empty.
+ */
+static struct scst_cmd *scst_get_shared_cmd(struct scst_cmd_thread_t *thr)
+{
+	struct scst_cmd_threads *p_cmd_threads = thr->thr_cmd_threads;
+	struct scst_cmd *cmd = NULL, *c;
+	int cnt = 1;
+
+	if (!spin_trylock_irq(&p_cmd_threads->cmd_list_lock)) {
+		thr->thr_stats.shared_lock_contended++;
+		spin_lock_irq(&p_cmd_threads->cmd_list_lock);
+	}
+
+	if (list_empty(&p_cmd_threads->active_cmd_list))
+		goto out_unlock;
+
+	cmd = list_first_entry(&p_cmd_threads->active_cmd_list,
+			       typeof(*cmd), cmd_list_entry);
+	TRACE_DBG("Deleting cmd %p from active cmd list", cmd);
+	list_del(&cmd->cmd_list_entry);
+	thr->thr_stats.shared_cmds++;
+
+	if (!scst_work_stealing)
+		goto out_unlock;
+
+	spin_lock(&thr->thr_cmd_list_lock);
+	if (list_empty(&thr->thr_active_cmd_list)) {
+		for (cnt = 1; cnt < SCST_THR_BATCH_CMDS; cnt++) {
+			if (list_empty(&p_cmd_threads->active_cmd_list))
+				break;
+			c = list_first_entry(&p_cmd_threads->active_cmd_list,
+					     typeof(*c), cmd_list_entry);
+			TRACE_DBG("Moving cmd %p to thr active cmd list", c);
+			list_move_tail(&c->cmd_list_entry,
+				       &thr->thr_active_cmd_list);
+			if (c->cmd_thr == NULL)
+				c->cmd_thr = thr;
+			thr->thr_stats.shared_cmds++;
+		}
+	}
+	spin_unlock(&thr->thr_cmd_list_lock);
+
+out_unlock:
+	spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
+
+	if (cnt > 1) {
+		WRITE_ONCE(p_cmd_threads->steal_hint, true);
+		/* The waiters are exclusive, wake one per batched command */
+		while (--cnt > 0)
+			wake_up(&p_cmd_threads->cmd_list_waitQ);
+	}
+	return cmd;
+}
+
+/*
+ * Takes the last command from thr_active_cmd_list of another thread of the
+ * same pool, which has more than one queued. So neither the command the
+ * owner is going to process next nor a HEAD OF QUEUE one is ever taken.
+ *
+ * No locks, returns NULL if nothing to steal.
+ */
+static struct scst_cmd *scst_steal_cmd(struct scst_cmd_thread_t *thr)
+{
+	struct scst_cmd_threads *p_cmd_threads = thr->thr_cmd_threads;
+	struct scst_cmd_thread_t *victim;
+	struct scst_cmd *cmd = NULL;
+
+	/* Clear before looking, so new hints set meanwhile are not lost */
+	WRITE_ONCE(p_cmd_threads->steal_hint, false);
+	smp_mb();
+
+	spin_lock(&p_cmd_threads->thr_lock);
+	list_for_each_entry(victim, &p_cmd_threads->threads_list,
+			    thread_list_entry) {
+		if ((victim == thr) ||
+		    !spin_trylock_irq(&victim->thr_cmd_list_lock))
+			continue;
+		if (!list_empty(&victim->thr_active_cmd_list) &&
+		    !list_is_singular(&victim->thr_active_cmd_list)) {
+			cmd = list_entry(victim->thr_active_cmd_list.prev,
+					 typeof(*cmd), cmd_list_entry);
+			if (cmd->queue_type != SCST_CMD_QUEUE_HEAD_OF_QUEUE) {
+				TRACE_DBG("Stealing cmd %p from thr %p", cmd,
+					  victim);
+				list_del(&cmd->cmd_list_entry);
+				cmd->cmd_thr = thr;
+			} else
+				cmd = NULL;
+		}
+		spin_unlock_irq(&victim->thr_cmd_list_lock);
+		if (cmd != NULL)
+			break;
+	}
+	spin_unlock(&p_cmd_threads->thr_lock);
+
+	if (cmd != NULL) {
+		thr->thr_stats.stolen_cmds++;
+		/* There might be more, let others look as well */
+		WRITE_ONCE(p_cmd_threads->steal_hint, true);
+	}
+	return cmd;
+}
+
 int scst_cmd_thread(void *arg)
 {
 	struct scst_cmd_thread_t *thr = arg;
@@ -5725,19 +6135,7 @@ again:
 			someth_done = false;
 
 			for (thr_cnt = 0; thr_cnt < 1; thr_cnt++) {
-				cmd = NULL;
-				spin_lock_irq(&p_cmd_threads->cmd_list_lock);
-
-				if (!list_empty(&p_cmd_threads->active_cmd_list)) {
-					cmd = list_first_entry(&p_cmd_threads->active_cmd_list,
-								typeof(*cmd), cmd_list_entry);
-
-					TRACE_DBG("Deleting cmd %p from active cmd list", cmd);
-					list_del(&cmd->cmd_list_entry);
-				}
-
-				spin_unlock_irq(&p_cmd_threads->cmd_list_lock);
-
+				cmd = scst_get_shared_cmd(thr);
 				if (!cmd) break;
 
 				if (cmd->cmd_thr == NULL) {
@@ -5766,11 +6164,20 @@ again:
 
 				if (!cmd) break;
 
+				thr->thr_stats.local_cmds++;
 				scst_process_active_cmd(cmd, false);
 
 				someth_done = true;
 			}
 
+			if (!someth_done && scst_work_stealing &&
+			    READ_ONCE(p_cmd_threads->steal_hint)) {
+				cmd = scst_steal_cmd(thr);
+				if (cmd) {
+					scst_process_active_cmd(cmd, false);
+					someth_done = true;
+				}
+			}
 		} while (someth_done);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
@@ -8520,16 +8927,15 @@ static struct scst_cmd *__scst_find_cmd_by_tag(struct scst_session *sess,
 	uint64_t tag, bool to_abort)
 {
 	struct scst_cmd *cmd, *res = NULL;
+	struct list_head *head;
 
 	TRACE_ENTRY();
 
-	/* ToDo: hash list */
-
-	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd list",
+	TRACE_DBG("%s (sess=%p, tag=%llu)", "Searching in sess cmd tag hash",
 		  sess, (unsigned long long int)tag);
 
-	list_for_each_entry(cmd, &sess->sess_cmd_list,
-			sess_cmd_list_entry) {
+	head = &sess->sess_cmd_tag_hash[SESS_CMD_TAG_HASH_FN(tag)];
+	list_for_each_entry(cmd, head, sess_cmd_tag_hash_entry) {
 		if ((cmd->tag == tag) && likely(!cmd->internal)) {
 			/*
 			 * We must not count done commands, because
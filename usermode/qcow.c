@@ -63,6 +63,8 @@
 #include <scsi/scsi.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <zlib.h>
 #if defined(HAVE_LINUX_FALLOC)
@@ -90,6 +92,15 @@ struct bdev {
 	int64_t size;
 	uint32_t block_size;
 
+	/* metadata cache budgets in bytes, from the config string options (0 for default) */
+	uint64_t l2_cache_bytes;
+	uint64_t rc_cache_bytes;
+	/* metadata write-back timer period, from the config string options (0 for none) */
+	uint64_t flush_interval_ms;
+	/* I/O worker threads, from the config string options (top-level image only) */
+	uint64_t nr_threads;
+	struct qcow_workers *workers;
+
 	int fd;		/* image file descriptor */
 };
 
@@ -99,6 +110,8 @@ struct bdev_ops {
 	void (*close) (struct bdev *dev);
 	ssize_t (*preadv) (struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset);
 	ssize_t (*pwritev) (struct bdev *bdev, struct iovec *iov, int iovcnt, off_t offset);
+	int (*flush) (struct bdev *bdev);
+	int (*lba_status) (struct bdev *bdev, off_t offset, uint64_t *len, bool *mapped);
 };
 
 static int bdev_open(struct bdev *bdev, int dirfd, const char *pathname, int flags)
@@ -196,7 +209,46 @@ static void qcow2_header_bswap(struct qcow2_header *be, struct qcow2_header *dst
 	}
 }
 
-#define RC_CACHE_SIZE L2_CACHE_SIZE
+/* Metadata table cache: a fixed number of table-sized buffers (sized from the per-image
+ * memory budget), found by hashing the table's file offset, and recycled by CLOCK (second
+ * chance) eviction.  Updated tables are marked dirty and written back when evicted or
+ * flushed, rather than written through on every change.  A cache with a dependency (the L2
+ * cache depends on the refcounts) flushes that first before writing back any of its own
+ * tables, so a table on disk never refers to a cluster whose refcount is not yet on disk.
+ */
+struct meta_cache_entry {
+	uint64_t offset;			/* file offset of cached table, 0 if unused */
+	struct meta_cache_entry *hnext;		/* hash chain */
+	bool referenced;			/* CLOCK reference bit */
+	bool dirty;				/* needs write-back */
+	bool loading;				/* being read in with the lock dropped */
+};
+
+struct qcow_state;
+
+struct meta_cache {
+	const char *name;
+	size_t table_size;			/* bytes per table */
+	unsigned int nr_entries;
+	unsigned int nr_dirty;
+	unsigned int nr_loading;
+	unsigned int hash_bits;
+	unsigned int clock_hand;
+	struct meta_cache_entry *entries;
+	struct meta_cache_entry **hash;
+	uint8_t *tables;			/* nr_entries * table_size */
+	int (*depends)(struct qcow_state *s);	/* call before writing back */
+	bool unlocked_load;			/* drop s->lock while reading tables in */
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t writebacks;
+};
+
+struct dirty_range {
+	unsigned int lo;
+	unsigned int hi;			/* 0 if clean */
+};
 
 struct qcow_state
 {
@@ -215,9 +267,7 @@ struct qcow_state
 	uint64_t *l1_table;
 
 	/* L2 cache */
-	uint64_t *l2_cache;
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-	int l2_cache_counts[L2_CACHE_SIZE];
+	struct meta_cache l2_cache;
 
 	/* cluster decompression cache */
 	uint8_t *cluster_cache;
@@ -236,14 +286,30 @@ struct qcow_state
 
 	/* refcount block cache */
 	unsigned int refcount_order;
-	void *rc_cache;
-	uint64_t rc_cache_offsets[RC_CACHE_SIZE];
-	int rc_cache_counts[RC_CACHE_SIZE];
+	struct meta_cache rc_cache;
 
 	uint64_t (*block_alloc) (struct qcow_state *s, size_t size);
 	int (*set_refcount) (struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
 
 	uint64_t first_free_cluster;
+
+	/* run of clusters zeroed ahead for allocation, but not yet handed out */
+	uint64_t prealloc_next;
+	uint64_t prealloc_end;
+
+	/* entries of the top-level tables modified since last written back [lo, hi) */
+	struct dirty_range l1_dirty;
+	struct dirty_range rc_table_dirty;
+
+	/* Serializes cluster mapping, allocation and metadata write-back. Data transfers to and
+	 * from clusters already mapped run outside of it, see qcow_preadv() */
+	pthread_mutex_t lock;
+	pthread_cond_t load_cond;		/* meta_cache_entry.loading cleared */
+	pthread_cond_t flush_cond;
+	pthread_t flush_thread;
+	bool flush_thread_running;
+	bool flush_thread_stop;
+	uint64_t flush_interval_ms;
 };
 
 static uint64_t qcow_block_alloc(struct qcow_state *s, size_t size);
@@ -253,6 +319,14 @@ static int qcow_no_refcount(struct qcow_state *s, uint64_t cluster_offset, uint6
 	return 0;
 }
 static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uint64_t value);
+static int meta_cache_init(struct meta_cache *c, const char *name, size_t table_size,
+			   uint64_t budget, unsigned int min_entries, uint64_t max_entries);
+static void meta_cache_destroy(struct meta_cache *c);
+static int meta_cache_writeback_all(struct qcow_state *s, struct meta_cache *c);
+static int qcow_flush_refcounts(struct qcow_state *s);
+static int qcow_flush_metadata(struct qcow_state *s);
+static int qcow_flush_thread_start(struct qcow_state *s);
+static void qcow_flush_thread_stop(struct qcow_state *s);
 
 static int qcow_probe(struct bdev *bdev, int dirfd, const char *pathname)
 {
@@ -515,11 +589,13 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (meta_cache_init(&s->l2_cache, "L2", s->l2_size * sizeof(uint64_t),
+			    bdev->l2_cache_bytes ?: QCOW_DEFAULT_L2_CACHE_BYTES,
+			    MIN_L2_CACHE_SIZE, s->l1_size) < 0) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
+	s->l2_cache.unlocked_load = true;
 
 	/* cluster decompression cache */
 	s->cluster_cache = calloc(1, s->cluster_size);
@@ -538,13 +614,17 @@ static int qcow_image_open(struct bdev *bdev, int dirfd, const char *pathname, i
 
 	s->block_alloc = qcow_block_alloc;
 	s->set_refcount = qcow_no_refcount;
+
+	s->flush_interval_ms = bdev->flush_interval_ms;
+	if (qcow_flush_thread_start(s) < 0)
+		goto fail;
 	tcmu_dbg("%d: %s\n", bdev->fd, pathname);
 	return 0;
 fail:
 	close(bdev->fd);
 	free(s->cluster_cache);
 	free(s->cluster_data);
-	free(s->l2_cache);
+	meta_cache_destroy(&s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
 	free(s);
@@ -631,12 +711,13 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 		goto fail;
 	}
 
-	s->l2_cache = calloc(L2_CACHE_SIZE, s->l2_size * sizeof(uint64_t));
-	if (s->l2_cache == NULL) {
+	if (meta_cache_init(&s->l2_cache, "L2", s->l2_size * sizeof(uint64_t),
+			    bdev->l2_cache_bytes ?: QCOW_DEFAULT_L2_CACHE_BYTES,
+			    MIN_L2_CACHE_SIZE, s->l1_size) < 0) {
 		tcmu_err("Failed to allocate L2 cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->l2_cache = %p\n", s->l2_cache);
+	s->l2_cache.unlocked_load = true;
 
 	/* cluster decompression cache */
 	s->cluster_cache = calloc(1, s->cluster_size);
@@ -664,12 +745,13 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 	}
 
 	s->refcount_order = header.refcount_order;
-	s->rc_cache = calloc(RC_CACHE_SIZE, s->cluster_size);
-	if (s->rc_cache == NULL) {
+	if (meta_cache_init(&s->rc_cache, "refcount", s->cluster_size,
+			    bdev->rc_cache_bytes ?: QCOW_DEFAULT_RC_CACHE_BYTES,
+			    MIN_REFCOUNT_CACHE_SIZE, s->refcount_table_size) < 0) {
 		tcmu_err("Failed to allocate refcount cache\n");
 		goto fail;
 	}
-	tcmu_dbg("s->rc_cache = %p\n", s->rc_cache);
+	s->l2_cache.depends = qcow_flush_refcounts;
 
 	if (qcow2_setup_backing_file(bdev, &header) == -1)
 		goto fail;
@@ -680,15 +762,19 @@ static int qcow2_image_open(struct bdev *bdev, int dirfd, const char *pathname,
 
 	s->block_alloc = qcow2_block_alloc;
 	s->set_refcount = qcow2_set_refcount;
+
+	s->flush_interval_ms = bdev->flush_interval_ms;
+	if (qcow_flush_thread_start(s) < 0)
+		goto fail;
 	tcmu_dbg("%d: %s\n", bdev->fd, pathname);
 	return 0;
 fail:
 	close(bdev->fd);
 	free(s->cluster_cache);
 	free(s->cluster_data);
-	free(s->rc_cache);
+	meta_cache_destroy(&s->rc_cache);
 	free(s->refcount_table);
-	free(s->l2_cache);
+	meta_cache_destroy(&s->l2_cache);
 	free(s->l1_table);
 fail_nofd:
 	free(s);
@@ -703,52 +789,407 @@ static void qcow_image_close(struct bdev *bdev)
 		s->backing_image->ops->close(s->backing_image);
 		free(s->backing_image);
 	}
+	qcow_flush_thread_stop(s);
+	if (qcow_flush_metadata(s) < 0)
+		tcmu_err("%s: metadata write-back failed on close\n", __func__);
 	close(bdev->fd);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	free(s->l1_table);
-	free(s->l2_cache);
+	meta_cache_destroy(&s->l2_cache);
 	free(s->refcount_table);
-	free(s->rc_cache);
+	meta_cache_destroy(&s->rc_cache);
 	free(s);
 }
 
-static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
+static int qcow_image_flush(struct bdev *bdev)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	uint64_t *l2_table;
-	ssize_t read;
+	struct qcow_state *s = bdev->private;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	ret = qcow_flush_metadata(s);
+	pthread_mutex_unlock(&s->lock);
+	if (ret < 0)
+		return -1;
+
+	/* data written to clusters allocated earlier, which needed no metadata update */
+	return fdatasync(bdev->fd);
+}
+
+/* metadata table cache */
+
+static int meta_cache_init(struct meta_cache *c, const char *name, size_t table_size,
+			   uint64_t budget, unsigned int min_entries, uint64_t max_entries)
+{
+	uint64_t nr_entries = budget / table_size;
+
+	/* no point in caching more tables than the image can have */
+	if (nr_entries > max_entries)
+		nr_entries = max_entries;
+	if (nr_entries < min_entries)
+		nr_entries = min_entries;
+
+	c->name = name;
+	c->table_size = table_size;
+	c->nr_entries = nr_entries;
+	c->hash_bits = 1;
+	while ((1u << c->hash_bits) < 2 * c->nr_entries)
+		c->hash_bits++;
+
+	c->entries = calloc(c->nr_entries, sizeof(*c->entries));
+	c->hash = calloc(1u << c->hash_bits, sizeof(*c->hash));
+	c->tables = calloc(c->nr_entries, c->table_size);
+	if (!c->entries || !c->hash || !c->tables) {
+		meta_cache_destroy(c);
+		return -1;
+	}
+
+	tcmu_dbg("%s cache: %u tables of %zu bytes\n", name, c->nr_entries, c->table_size);
+	return 0;
+}
+
+static void meta_cache_destroy(struct meta_cache *c)
+{
+	if (c->hits + c->misses)
+		tcmu_info("%s cache: %u tables, %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" writebacks\n",
+			  c->name, c->nr_entries, c->hits, c->misses, c->writebacks);
+	free(c->entries);
+	free(c->hash);
+	free(c->tables);
+	memset(c, 0, sizeof(*c));
+}
+
+static inline unsigned int meta_cache_hash(struct meta_cache *c, uint64_t offset)
+{
+	/* tables are at least sector aligned */
+	return ((offset >> 9) * 0x9e3779b97f4a7c15ull) >> (64 - c->hash_bits);
+}
+
+static inline void *meta_cache_table(struct meta_cache *c, struct meta_cache_entry *e)
+{
+	return c->tables + (size_t)(e - c->entries) * c->table_size;
+}
+
+static void meta_cache_unhash(struct meta_cache *c, struct meta_cache_entry *e)
+{
+	struct meta_cache_entry **pp = &c->hash[meta_cache_hash(c, e->offset)];
+
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	e->hnext = NULL;
+	e->offset = 0;
+}
+
+static int meta_cache_writeback(struct qcow_state *s, struct meta_cache *c,
+				struct meta_cache_entry *e)
+{
+	ssize_t ret;
+
+	/* the metadata this table depends on must reach the disk first */
+	if (c->depends && c->depends(s) < 0)
+		return -1;
+
+	ret = pwrite(s->fd, meta_cache_table(c, e), c->table_size, e->offset);
+	if (ret != c->table_size) {
+		tcmu_err("%s: error, %s table writeback failed (%zd)\n", __func__, c->name, ret);
+		return -1;
+	}
+	e->dirty = false;
+	c->nr_dirty--;
+	c->writebacks++;
+	return 0;
+}
+
+/* Write back all the dirty tables in the cache (the caller syncs) */
+static int meta_cache_writeback_all(struct qcow_state *s, struct meta_cache *c)
+{
+	unsigned int i;
 
-	/* l2 cache lookup */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			if (++s->l2_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
+	for (i = 0; i < c->nr_entries && c->nr_dirty; i++) {
+		struct meta_cache_entry *e = &c->entries[i];
+		if (e->dirty && meta_cache_writeback(s, c, e) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* CLOCK: sweep the hand past referenced entries (clearing their bits) to find a victim,
+ * skipping entries being read in; the caller makes sure there is one which isn't */
+static struct meta_cache_entry *meta_cache_evict(struct qcow_state *s, struct meta_cache *c)
+{
+	struct meta_cache_entry *e;
+
+	for (;;) {
+		e = &c->entries[c->clock_hand];
+		if (++c->clock_hand == c->nr_entries)
+			c->clock_hand = 0;
+		if (e->loading)
+			continue;
+		if (!e->referenced)
+			break;
+		e->referenced = false;
+	}
+
+	if (e->dirty && meta_cache_writeback(s, c, e) < 0)
+		return NULL;
+	if (e->offset)
+		meta_cache_unhash(c, e);
+	return e;
+}
+
+/**
+ * meta_cache_get()
+ * returns the cached copy of the metadata table at file offset, reading it in on a miss
+ * returns NULL on I/O error
+ *
+ * fresh: the table has just been allocated (and zeroed) on disk, so skip reading it
+ *
+ * Called with s->lock held. For a cache with unlocked_load set, the lock is dropped while
+ * a table is read in, so that lookups hitting other tables aren't stuck behind the read;
+ * the entry is marked loading meanwhile, and lookups of that table wait for it. Tables
+ * returned earlier may have been evicted when this returns, so callers must not hold on
+ * to them across a call that can miss in such a cache.
+ */
+static void *meta_cache_get(struct qcow_state *s, struct meta_cache *c, uint64_t offset, bool fresh)
+{
+	struct meta_cache_entry *e;
+	unsigned int h = meta_cache_hash(c, offset);
+	void *table;
+	ssize_t read = 0;
+
+again:
+	for (e = c->hash[h]; e; e = e->hnext) {
+		if (e->offset == offset) {
+			if (e->loading) {
+				pthread_cond_wait(&s->load_cond, &s->lock);
+				goto again;
 			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			tcmu_dbg("%s: l2 hit %llx at index %d\n", __func__, l2_table, i);
-			return l2_table;
+			e->referenced = true;
+			c->hits++;
+			return meta_cache_table(c, e);
 		}
 	}
-	/* not found, evict least used entry */
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
+
+	if (c->nr_loading == c->nr_entries) {
+		/* every entry is being read in, wait for one */
+		pthread_cond_wait(&s->load_cond, &s->lock);
+		goto again;
 	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
-	read = pread(s->fd, l2_table, s->l2_size * sizeof(uint64_t), l2_offset);
-	if (read != s->l2_size * sizeof(uint64_t))
+
+	c->misses++;
+	e = meta_cache_evict(s, c);
+	if (!e)
 		return NULL;
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
 
-	return l2_table;
+	e->offset = offset;
+	e->referenced = true;
+	e->hnext = c->hash[h];
+	c->hash[h] = e;
+
+	table = meta_cache_table(c, e);
+	if (fresh) {
+		memset(table, 0, c->table_size);
+	} else if (c->unlocked_load) {
+		e->loading = true;
+		c->nr_loading++;
+		pthread_mutex_unlock(&s->lock);
+		read = pread(s->fd, table, c->table_size, offset);
+		pthread_mutex_lock(&s->lock);
+		e->loading = false;
+		c->nr_loading--;
+		pthread_cond_broadcast(&s->load_cond);
+	} else {
+		read = pread(s->fd, table, c->table_size, offset);
+	}
+	if (!fresh && read != c->table_size) {
+		meta_cache_unhash(c, e);
+		e->referenced = false;
+		return NULL;
+	}
+	return table;
+}
+
+/* Is the table at file offset cached (or being read in)? */
+static bool meta_cache_present(struct meta_cache *c, uint64_t offset)
+{
+	struct meta_cache_entry *e;
+
+	for (e = c->hash[meta_cache_hash(c, offset)]; e; e = e->hnext)
+		if (e->offset == offset)
+			return true;
+	return false;
+}
+
+/* Mark a table returned by meta_cache_get() as modified */
+static void meta_cache_dirty(struct meta_cache *c, void *table)
+{
+	struct meta_cache_entry *e;
+
+	e = &c->entries[((uint8_t *)table - c->tables) / c->table_size];
+	if (!e->dirty) {
+		e->dirty = true;
+		c->nr_dirty++;
+	}
+}
+
+/* Ordered metadata write-back
+ *
+ * Allocating writes update the refcounts, L2 tables, and L1 table only in memory; those
+ * updates accumulate across writes and are written back in an order which keeps the image
+ * consistent on disk at every point, so that a crash can at worst leak clusters:
+ *
+ *   1. refcount blocks, then refcount table entries pointing to new refcount blocks; sync
+ *   2. L2 tables; sync
+ *   3. L1 table entries pointing to new L2 tables; sync
+ *
+ * i.e. no cluster is ever referenced on disk before its refcount is on disk.  (Refcounts
+ * only ever increase here, so there is no need for the reverse ordering.)  The whole
+ * sequence runs on SYNCHRONIZE CACHE, from the flush timer, and on close; steps 1 or 1-2
+ * run when a dirty table has to be evicted from its cache.
+ */
+
+static void dirty_range_add(struct dirty_range *d, unsigned int index)
+{
+	if (!d->hi) {
+		d->lo = index;
+		d->hi = index + 1;
+	} else if (index < d->lo) {
+		d->lo = index;
+	} else if (index >= d->hi) {
+		d->hi = index + 1;
+	}
+}
+
+/* Write back the modified range of a top-level table */
+static int top_table_writeback(struct qcow_state *s, const char *name, uint64_t *table,
+			       uint64_t table_offset, struct dirty_range *d)
+{
+	size_t len = (d->hi - d->lo) * sizeof(uint64_t);
+	ssize_t ret;
+
+	if (!d->hi)
+		return 0;
+
+	ret = pwrite(s->fd, &table[d->lo], len, table_offset + d->lo * sizeof(uint64_t));
+	if (ret != len) {
+		tcmu_err("%s: error, %s table writeback failed (%zd)\n", __func__, name, ret);
+		return -1;
+	}
+	d->hi = 0;
+	return 0;
+}
+
+static int qcow_sync(struct qcow_state *s)
+{
+	if (fdatasync(s->fd) < 0) {
+		tcmu_err("%s: fdatasync failed: %m\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+/* step 1 */
+static int qcow_flush_refcounts(struct qcow_state *s)
+{
+	if (!s->rc_cache.nr_dirty && !s->rc_table_dirty.hi)
+		return 0;
+	if (meta_cache_writeback_all(s, &s->rc_cache) < 0)
+		return -1;
+	if (top_table_writeback(s, "refcount", s->refcount_table,
+				s->refcount_table_offset, &s->rc_table_dirty) < 0)
+		return -1;
+	return qcow_sync(s);
+}
+
+/* steps 1-3 */
+static int qcow_flush_metadata(struct qcow_state *s)
+{
+	if (qcow_flush_refcounts(s) < 0)
+		return -1;
+
+	if (s->l2_cache.nr_dirty) {
+		if (meta_cache_writeback_all(s, &s->l2_cache) < 0)
+			return -1;
+		if (qcow_sync(s) < 0)
+			return -1;
+	}
+
+	if (s->l1_dirty.hi) {
+		if (top_table_writeback(s, "L1", s->l1_table, s->l1_table_offset, &s->l1_dirty) < 0)
+			return -1;
+		if (qcow_sync(s) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Flush timer: limits how much metadata is waiting in memory for a SYNCHRONIZE CACHE */
+static void *qcow_flush_thread(void *arg)
+{
+	struct qcow_state *s = arg;
+	struct timespec deadline;
+
+	pthread_setname_np(pthread_self(), "qcow_flush");
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->flush_thread_stop) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += s->flush_interval_ms / 1000;
+		deadline.tv_nsec += (s->flush_interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (pthread_cond_timedwait(&s->flush_cond, &s->lock, &deadline) == ETIMEDOUT)
+			if (qcow_flush_metadata(s) < 0)
+				tcmu_err("%s: periodic metadata write-back failed\n", __func__);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static int qcow_flush_thread_start(struct qcow_state *s)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->load_cond, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->flush_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (!s->flush_interval_ms)
+		return 0;
+
+	if (pthread_create(&s->flush_thread, NULL, qcow_flush_thread, s)) {
+		tcmu_err("Failed to start metadata flush thread\n");
+		return -1;
+	}
+	s->flush_thread_running = true;
+	return 0;
+}
+
+static void qcow_flush_thread_stop(struct qcow_state *s)
+{
+	if (s->flush_thread_running) {
+		pthread_mutex_lock(&s->lock);
+		s->flush_thread_stop = true;
+		pthread_cond_signal(&s->flush_cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->flush_thread, NULL);
+		s->flush_thread_running = false;
+	}
+	pthread_cond_destroy(&s->flush_cond);
+	pthread_cond_destroy(&s->load_cond);
+	pthread_mutex_destroy(&s->lock);
+}
+
+static uint64_t *l2_cache_lookup(struct qcow_state *s, uint64_t l2_offset)
+{
+	return meta_cache_get(s, &s->l2_cache, l2_offset, false);
 }
 
 static uint64_t qcow_cluster_alloc(struct qcow_state *s)
@@ -780,21 +1221,12 @@ static uint64_t l2_table_alloc(struct qcow_state *s)
 
 static int l1_table_update(struct qcow_state *s, unsigned int l1_index, uint64_t l2_offset)
 {
-	ssize_t ret;
-
 	tcmu_dbg("%s: setting L1[%d] to %llx\n", __func__, l1_index, l2_offset);
 	s->l1_table[l1_index] = htobe64(l2_offset);
 
-	ret = pwrite(s->fd,
-		&s->l1_table[l1_index],
-		sizeof(uint64_t),
-		s->l1_table_offset + (l1_index * sizeof(uint64_t)));
-
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, L1 writeback failed (%zd)\n", __func__, ret);
-
-	fdatasync(s->fd);
-	return ret;
+	/* written back after the L2 tables, see qcow_flush_metadata() */
+	dirty_range_add(&s->l1_dirty, l1_index);
+	return 0;
 }
 
 /* refcount table */
@@ -859,39 +1291,7 @@ static void set_refcount(unsigned int order, void *rcblock, size_t index, uint64
 
 static void *rc_cache_lookup(struct qcow_state *s, uint64_t rc_offset)
 {
-	int i, j;
-	int min_index = 0;
-	int min_count = INT_MAX;
-	void *rc_table;
-	ssize_t read;
-
-	/* rc cache lookup */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (rc_offset == s->rc_cache_offsets[i]) {
-			if (++s->rc_cache_counts[i] == INT_MAX) {
-				for (j = 0; i < RC_CACHE_SIZE; j++) {
-					s->rc_cache_counts[j] >>= 1;
-				}
-			}
-			rc_table = s->rc_cache + (i << s->cluster_bits);
-			return rc_table;
-		}
-	}
-	/* not found, evict least used entry */
-	for (i = 0; i < RC_CACHE_SIZE; i++) {
-		if (s->rc_cache_counts[i] < min_count) {
-			min_count = s->rc_cache_counts[i];
-			min_index = i;
-		}
-	}
-	rc_table = s->rc_cache + (min_index << s->cluster_bits);
-	read = pread(s->fd, rc_table, 1 << s->cluster_bits, rc_offset);
-	if (read != 1 << s->cluster_bits)
-		return NULL;
-	s->rc_cache_offsets[min_index] = rc_offset;
-	s->rc_cache_counts[min_index] = 1;
-
-	return rc_table;
+	return meta_cache_get(s, &s->rc_cache, rc_offset, false);
 }
 
 static uint64_t qcow2_get_refcount(struct qcow_state *s, int64_t cluster_offset)
@@ -920,21 +1320,12 @@ static uint64_t qcow2_get_refcount(struct qcow_state *s, int64_t cluster_offset)
 
 static int rc_table_update(struct qcow_state *s, unsigned int rc_index, uint64_t refblock_offset)
 {
-	ssize_t ret;
-
 	tcmu_dbg("%s: setting RC[%d] to %llx\n", __func__, rc_index, refblock_offset);
 	s->refcount_table[rc_index] = htobe64(refblock_offset);
 
-	ret = pwrite(s->fd,
-		&s->refcount_table[rc_index],
-		sizeof(uint64_t),
-		s->refcount_table_offset + (rc_index * sizeof(uint64_t)));
-
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, RC writeback failed (%zd)\n", __func__, ret);
-
-	fdatasync(s->fd);
-	return ret;
+	/* written back after the refcount blocks, see qcow_flush_refcounts() */
+	dirty_range_add(&s->rc_table_dirty, rc_index);
+	return 0;
 }
 
 static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uint64_t value)
@@ -944,7 +1335,7 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 	uint64_t refblock_offset;
 	uint64_t refblock_index;
 	void *refblock;
-	ssize_t ret;
+	bool fresh = false;
 
 	refcount_bits = s->cluster_bits - s->refcount_order + 3;
 	rc_index = cluster_offset >> (s->cluster_bits + refcount_bits);
@@ -958,11 +1349,15 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 			tcmu_err("refblock allocation failure\n");
 			return -1;
 		}
-		rc_table_update(s, rc_index, refblock_offset | s->cluster_copied);
+		/* refcount table entries have no flag bits (unlike L1/L2 entries) */
+		rc_table_update(s, rc_index, refblock_offset);
 		qcow2_set_refcount(s, refblock_offset, 1);
+		fresh = true;
 	}
 
-	refblock = rc_cache_lookup(s, refblock_offset);
+	/* a freshly allocated refblock is zeroed on disk -- but it may have been cached (and
+	 * updated) just now by the recursive call above, in which case it is a cache hit */
+	refblock = meta_cache_get(s, &s->rc_cache, refblock_offset, fresh);
 	if (!refblock) {
 		tcmu_err("refblock cache failure\n");
 		return -1;
@@ -970,19 +1365,25 @@ static int qcow2_set_refcount(struct qcow_state *s, uint64_t cluster_offset, uin
 
 	set_refcount(s->refcount_order, refblock, refblock_index, value);
 
-	/* for now this writes back the entire block */
-	ret = pwrite(s->fd, refblock, s->cluster_size, refblock_offset);
-	if (ret != s->cluster_size)
-		tcmu_err("%s: error, refblock writeback failed (%zd)\n", __func__, ret);
-	fdatasync(s->fd);
-	return ret;
+	/* written back when evicted, or ahead of any L2 table or image flush */
+	meta_cache_dirty(&s->rc_cache, refblock);
+	return 0;
 }
 
-/* qcow 2 uses the refcount table to find free clusters */
+/* qcow 2 uses the refcount table to find free clusters
+ *
+ * Clusters are handed out from a run of contiguous free clusters found and zeroed ahead of
+ * time with a single fallocate(), so that consecutive allocations are contiguous in the
+ * file.  The run's clusters get their refcounts as they are handed out (by the caller), so
+ * any left over at close are simply free again.
+ */
 static uint64_t qcow2_block_alloc(struct qcow_state *s, size_t size)
 {
 	uint64_t cluster;
+	uint64_t start = 0;
 	uint64_t count;
+	unsigned int n = 0;
+	unsigned int run = QCOW_PREALLOC_BYTES >> s->cluster_bits ?: 1;
 	int ret;
 
 	tcmu_dbg("  %s %zx\n", __func__, size);
@@ -990,44 +1391,50 @@ static uint64_t qcow2_block_alloc(struct qcow_state *s, size_t size)
 	/* all allocations for qcow2 should be of the same size */
 	assert(size == s->cluster_size);
 
-	for (cluster = s->first_free_cluster; cluster < s->size; cluster += s->cluster_size) {
+	if (s->prealloc_next < s->prealloc_end)
+		goto out;
+
+	for (cluster = s->first_free_cluster; cluster < s->size && n < run; cluster += s->cluster_size) {
 		count = qcow2_get_refcount(s, cluster);
 		if (count == 0) {
-			ret = fallocate(s->fd, FALLOC_FL_ZERO_RANGE, cluster, s->cluster_size);
-			if (ret) {
-				tcmu_err("fallocate failed: %m\n");
-				return 0;
-			}
-			s->first_free_cluster = cluster + s->cluster_size;
-			// this causes a nasty loop
-			// qcow2_set_refcount(s, cluster, 1);
-			tcmu_dbg("  allocating cluster %d\n", cluster / s->cluster_size);
-			return cluster;
+			if (!n)
+				start = cluster;
+			n++;
+		} else if (n) {
+			break;
 		}
 	}
-	tcmu_err("no more free clusters in image file\n");
-	return 0;
+	if (!n) {
+		tcmu_err("no more free clusters in image file\n");
+		return 0;
+	}
+
+	ret = fallocate(s->fd, FALLOC_FL_ZERO_RANGE, start, (uint64_t)n << s->cluster_bits);
+	if (ret) {
+		tcmu_err("fallocate failed: %m\n");
+		return 0;
+	}
+	s->prealloc_next = start;
+	s->prealloc_end = start + ((uint64_t)n << s->cluster_bits);
+	s->first_free_cluster = s->prealloc_end;
+out:
+	cluster = s->prealloc_next;
+	s->prealloc_next += s->cluster_size;
+	// setting the refcount here causes a nasty loop -- the caller does it
+	tcmu_dbg("  allocating cluster %d\n", cluster / s->cluster_size);
+	return cluster;
 }
 
 static int l2_table_update(struct qcow_state *s,
 			   uint64_t *l2_table, uint64_t l2_table_offset,
 			   unsigned int l2_index, uint64_t cluster_offset)
 {
-	ssize_t ret;
-
 	tcmu_dbg("%s: setting %llx[%d] to %llx\n", __func__, l2_table_offset, l2_index, cluster_offset);
 	l2_table[l2_index] = htobe64(cluster_offset);
 
-	ret = pwrite(s->fd,
-		&(l2_table[l2_index]),
-		sizeof(uint64_t),
-		l2_table_offset + (l2_index * sizeof(uint64_t)));
-
-	if (ret != sizeof(uint64_t))
-		tcmu_err("%s: error, L2 writeback failed (%zd)\n", __func__, ret);
-
-	fdatasync(s->fd);
-	return ret;
+	/* written back (after the refcounts) when evicted or flushed */
+	meta_cache_dirty(&s->l2_cache, l2_table);
+	return 0;
 }
 
 static int decompress_buffer(uint8_t *dst, size_t dst_size, const uint8_t *src, size_t src_size)
@@ -1106,11 +1513,13 @@ static uint64_t get_cluster_offset(struct qcow_state *s, const uint64_t offset,
 	if (!l2_offset) {
 		if (!allocate || !(l2_offset = l2_table_alloc(s)))
 			return 0;
-		l1_table_update(s, l1_index, l2_offset | s->cluster_copied);
 		s->set_refcount(s, l2_offset, 1);
+		l1_table_update(s, l1_index, l2_offset | s->cluster_copied);
+		/* newly allocated L2 table is zeroed on disk */
+		l2_table = meta_cache_get(s, &s->l2_cache, l2_offset, true);
+	} else {
+		l2_table = l2_cache_lookup(s, l2_offset);
 	}
-
-	l2_table = l2_cache_lookup(s, l2_offset);
 	if (!l2_table)
 		return 0;
 
@@ -1164,6 +1573,99 @@ out:
 	return cluster_offset & ~(s->cluster_copied);
 }
 
+/* Hint the kernel to read in the L2 table following the one mapping offset, if it isn't
+ * cached already, so that a sequential read crossing into it doesn't stall on the miss */
+static void l2_readahead(struct qcow_state *s, uint64_t offset)
+{
+	unsigned int l1_index = (offset >> (s->l2_bits + s->cluster_bits)) + 1;
+	uint64_t l2_offset;
+
+	if (l1_index >= s->l1_size)
+		return;
+	l2_offset = be64toh(s->l1_table[l1_index]) & s->cluster_mask;
+	if (l2_offset && !meta_cache_present(&s->l2_cache, l2_offset))
+		posix_fadvise(s->fd, l2_offset, s->l2_cache.table_size, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * get_cluster_run()
+ * maps the sector at offset like get_cluster_offset(), then looks ahead at the L2 entries
+ * of the following clusters, and returns in *len how many of the bytes from offset map
+ * the same way, so that they can be transferred with a single call: clusters contiguous
+ * in the image file, or all unallocated, or all reading as zeroes
+ *
+ * len: bytes remaining in the request, at least up to the end of the cluster
+ * allocate: as for get_cluster_offset(), the clusters looked ahead at are allocated too
+ */
+static uint64_t get_cluster_run(struct qcow_state *s, const uint64_t offset, uint64_t *len,
+				bool allocate)
+{
+	uint64_t cluster_offset, next;
+	uint64_t in_cluster = offset & (s->cluster_size - 1);
+	uint64_t run = s->cluster_size - in_cluster;
+	unsigned int l2_shift = s->l2_bits + s->cluster_bits;
+
+	cluster_offset = get_cluster_offset(s, offset, allocate);
+
+	/* compressed clusters are transferred one at a time */
+	if (!(cluster_offset & s->cluster_compressed)) {
+		while (run < *len) {
+			next = get_cluster_offset(s, offset + run, allocate);
+			if (!cluster_offset || cluster_offset == QCOW2_OFLAG_ZERO) {
+				if (next != cluster_offset)
+					break;
+			} else if (next != cluster_offset + in_cluster + run) {
+				break;
+			}
+			run += s->cluster_size;
+		}
+	}
+
+	/* a read mapped in one run is likely sequential: if another like it would run past
+	 * the clusters this L2 table maps, get the next table coming */
+	if (!allocate && run >= *len &&
+	    ((offset + 2 * *len - 1) >> l2_shift) != (offset >> l2_shift))
+		l2_readahead(s, offset);
+
+	if (run < *len)
+		*len = run;
+	return cluster_offset;
+}
+
+/**
+ * qcow_lba_status()
+ * trims *len to the run of bytes from offset whose clusters are all allocated or all not
+ * (*mapped), looking no further than the end of the L2 table mapping offset. Clusters not
+ * allocated in an image with a backing file read from it, so they count as mapped; clusters
+ * discarded to QCOW2_OFLAG_ZERO never do.
+ */
+static int qcow_lba_status(struct bdev *bdev, off_t offset, uint64_t *len, bool *mapped)
+{
+	struct qcow_state *s = bdev->private;
+	unsigned int l2_shift = s->l2_bits + s->cluster_bits;
+	uint64_t end = (((uint64_t)offset >> l2_shift) + 1) << l2_shift;
+	uint64_t next, cluster_offset;
+
+	if (end > offset + *len)
+		end = offset + *len;
+
+	pthread_mutex_lock(&s->lock);
+	cluster_offset = get_cluster_offset(s, offset, false);
+	*mapped = cluster_offset ? cluster_offset != QCOW2_OFLAG_ZERO : !!s->backing_image;
+	for (next = (offset | (s->cluster_size - 1)) + 1; next < end; next += s->cluster_size) {
+		cluster_offset = get_cluster_offset(s, next, false);
+		if ((cluster_offset ? cluster_offset != QCOW2_OFLAG_ZERO : !!s->backing_image)
+		    != *mapped)
+			break;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	if (next < end)
+		end = next;
+	*len = end - offset;
+	return 0;
+}
+
 /* returns number of iovs initialized in seg */
 static size_t iovec_segment(struct iovec *iov, struct iovec *seg, size_t off, size_t len)
 {
@@ -1210,6 +1712,7 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 	uint64_t sector_index;
 	uint64_t sector_count;
 	uint64_t sector_num, n;
+	uint64_t len;
 	ssize_t read;
 
 	struct qcow_state *s = bdev->private;
@@ -1226,11 +1729,24 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 
 	while (sector_count) {
 		sector_index = sector_num & (s->cluster_sectors - 1);
-		n = min(sector_count, (s->cluster_sectors - sector_index));
+		len = sector_count * 512;
 
+		/* only the mapping is done under the lock, data is transferred outside of it */
+		pthread_mutex_lock(&s->lock);
+		cluster_offset = get_cluster_run(s, sector_num << 9, &len, false);
+		n = len / 512;
 		_cnt = iovec_segment(iov, _iov, _off, n * 512);
+		if (cluster_offset & s->cluster_compressed) {
+			/* the decompression buffer is shared, copy out of it under the lock */
+			if (decompress_cluster(s, cluster_offset) < 0) {
+				pthread_mutex_unlock(&s->lock);
+				tcmu_err("decompression failure\n");
+				return -1;
+			}
+			tcmu_memcpy_into_iovec(_iov, _cnt, s->cluster_cache + sector_index * 512, 512 * n);
+		}
+		pthread_mutex_unlock(&s->lock);
 
-		cluster_offset = get_cluster_offset(s, sector_num << 9, false);
 		if (!cluster_offset) {
 			if (!s->backing_image) {
 				/* read unallocated sectors as 0s */
@@ -1247,11 +1763,7 @@ static ssize_t qcow_preadv(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 			/* cluster discarded, read as 0s */
 			iovec_memset(_iov, _cnt, 0, 512 * n);
 		} else if (cluster_offset & s->cluster_compressed) {
-			if (decompress_cluster(s, cluster_offset) < 0) {
-				tcmu_err("decompression failure\n");
-				return -1;
-			}
-			tcmu_memcpy_into_iovec(_iov, _cnt, s->cluster_cache + sector_index * 512, 512 * n);
+			/* copied out of the decompression buffer above */
 		} else {
 			read = preadv(bdev->fd, _iov, _cnt, cluster_offset + (sector_index * 512));
 			if (read != n * 512)
@@ -1270,6 +1782,7 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 	uint64_t sector_index;
 	uint64_t sector_count;
 	uint64_t sector_num, n;
+	uint64_t len;
 	ssize_t written;
 
 	struct qcow_state *s = bdev->private;
@@ -1286,11 +1799,14 @@ static ssize_t qcow_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, of
 
 	while (sector_count) {
 		sector_index = sector_num & (s->cluster_sectors - 1);
-		n = min(sector_count, (s->cluster_sectors - sector_index));
+		len = sector_count * 512;
 
+		/* allocation and CoW are done under the lock, the data write outside of it */
+		pthread_mutex_lock(&s->lock);
+		cluster_offset = get_cluster_run(s, sector_num << 9, &len, true);
+		pthread_mutex_unlock(&s->lock);
+		n = len / 512;
 		_cnt = iovec_segment(iov, _iov, _off, n * 512);
-
-		cluster_offset = get_cluster_offset(s, sector_num << 9, true);
 		if (!cluster_offset) {
 			tcmu_err("cluster not allocated for writes\n");
 			return -1;
@@ -1317,6 +1833,8 @@ static struct bdev_ops qcow_ops = {
 	.close = qcow_image_close,
 	.preadv = qcow_preadv,
 	.pwritev = qcow_pwritev,
+	.flush = qcow_image_flush,
+	.lba_status = qcow_lba_status,
 };
 
 static struct bdev_ops qcow2_ops = {
@@ -1325,6 +1843,8 @@ static struct bdev_ops qcow2_ops = {
 	.close = qcow_image_close,
 	.preadv = qcow_preadv,
 	.pwritev = qcow_pwritev,
+	.flush = qcow_image_flush,
+	.lba_status = qcow_lba_status,
 };
 
 /* raw image support for backing files */
@@ -1367,19 +1887,86 @@ static ssize_t raw_pwritev(struct bdev *bdev, struct iovec *iov, int iovcnt, off
 	return pwritev(bdev->fd, iov, iovcnt, offset);
 }
 
+static int raw_flush(struct bdev *bdev)
+{
+	return fdatasync(bdev->fd);
+}
+
 static struct bdev_ops raw_ops = {
 	.probe = raw_probe,
 	.open = raw_image_open,
 	.close = raw_image_close,
 	.preadv = raw_preadv,
 	.pwritev = raw_pwritev,
+	.flush = raw_flush,
 };
 
 /* TCMU QCOW Handler */
 
+/* Parse a size with an optional K, M or G suffix */
+static int qcow_parse_size(const char *str, uint64_t *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoull(str, &end, 0);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G': case 'g':
+		*size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		*size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		*size <<= 10;
+		end++;
+		break;
+	}
+	return *end ? -1 : 0;
+}
+
+/* Parse the comma-separated options following the image path in the config string */
+static int qcow_parse_options(struct bdev *bdev, char *options)
+{
+	char *opt, *saveptr;
+
+	for (opt = strtok_r(options, ",", &saveptr); opt; opt = strtok_r(NULL, ",", &saveptr)) {
+		char *val = strchr(opt, '=');
+		uint64_t *target;
+
+		if (!val) {
+			tcmu_err("option '%s' has no value\n", opt);
+			return -1;
+		}
+		*val++ = '\0';
+
+		if (!strcmp(opt, QCOW2_OPT_L2_CACHE_SIZE))
+			target = &bdev->l2_cache_bytes;
+		else if (!strcmp(opt, QCOW2_OPT_REFCOUNT_CACHE_SIZE))
+			target = &bdev->rc_cache_bytes;
+		else if (!strcmp(opt, QCOW_OPT_FLUSH_INTERVAL))
+			target = &bdev->flush_interval_ms;
+		else if (!strcmp(opt, QCOW_OPT_THREADS))
+			target = &bdev->nr_threads;
+		else {
+			tcmu_err("unknown option '%s'\n", opt);
+			return -1;
+		}
+
+		if (qcow_parse_size(val, target) < 0) {
+			tcmu_err("bad value '%s' for option '%s'\n", val, opt);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static bool qcow_check_config(const char *cfgstring, char **reason)
 {
-	char *path;
+	char *path, *options;
 
 	path = strchr(cfgstring, '/');
 	if (!path) {
@@ -1387,7 +1974,11 @@ static bool qcow_check_config(const char *cfgstring, char **reason)
 			*reason = NULL;
 		return false;
 	}
-	path += 1; /* get past '/' */
+	path = strdupa(path + 1); /* get past '/' */
+
+	options = strchr(path, ',');
+	if (options)
+		*options = '\0';
 
 	if (access(path, R_OK|W_OK) == -1) {
 		if (asprintf(reason, "File not present, or not writable") == -1)
@@ -1398,10 +1989,144 @@ static bool qcow_check_config(const char *cfgstring, char **reason)
 	return true; /* File exists and is writable */
 }
 
+/* I/O worker threads
+ *
+ * Reads and writes are queued to a pool of threads per device rather than run in the
+ * calling thread, which would make each command wait for the one before it. The threads
+ * serialize only on the image lock while mapping clusters, see qcow_preadv().
+ */
+
+struct qcow_io {
+	struct qcow_io *next;
+	struct tcmu_device *dev;
+	struct tcmulib_cmd *cmd;
+	struct iovec *iovec;
+	size_t iov_cnt;
+	size_t length;
+	off_t offset;
+	bool is_write;
+};
+
+struct qcow_workers {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct qcow_io *head;
+	struct qcow_io **tail;
+	bool stop;
+	unsigned int nr_threads;
+	pthread_t threads[];
+};
+
+static int qcow_do_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			struct iovec *iovec, size_t iov_cnt, size_t length,
+			off_t offset);
+static int qcow_do_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 struct iovec *iovec, size_t iov_cnt, size_t length,
+			 off_t offset);
+
+static void *qcow_worker(void *arg)
+{
+	struct qcow_workers *w = arg;
+	struct qcow_io *io;
+
+	pthread_setname_np(pthread_self(), "qcow_io");
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->head && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		io = w->head;
+		if (!io)
+			break;		/* stopping, and the queue is drained */
+		w->head = io->next;
+		if (!w->head)
+			w->tail = &w->head;
+		pthread_mutex_unlock(&w->lock);
+
+		if (io->is_write)
+			qcow_do_write(io->dev, io->cmd, io->iovec, io->iov_cnt, io->length, io->offset);
+		else
+			qcow_do_read(io->dev, io->cmd, io->iovec, io->iov_cnt, io->length, io->offset);
+		free(io);
+
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Stop the threads once they have run the commands still queued */
+static void qcow_workers_stop(struct qcow_workers *w)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < w->nr_threads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+static struct qcow_workers *qcow_workers_start(unsigned int nr_threads)
+{
+	struct qcow_workers *w;
+
+	w = calloc(1, sizeof(*w) + nr_threads * sizeof(w->threads[0]));
+	if (!w)
+		return NULL;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->tail = &w->head;
+
+	for (w->nr_threads = 0; w->nr_threads < nr_threads; w->nr_threads++) {
+		if (pthread_create(&w->threads[w->nr_threads], NULL, qcow_worker, w)) {
+			tcmu_err("Failed to start I/O thread %u\n", w->nr_threads);
+			qcow_workers_stop(w);
+			return NULL;
+		}
+	}
+	tcmu_dbg("%u I/O threads\n", nr_threads);
+	return w;
+}
+
+/* returns -1 if the command could not be queued, for the caller to run it itself */
+static int qcow_queue_io(struct qcow_workers *w, struct tcmu_device *dev,
+			 struct tcmulib_cmd *cmd, struct iovec *iovec, size_t iov_cnt,
+			 size_t length, off_t offset, bool is_write)
+{
+	struct qcow_io *io;
+
+	io = malloc(sizeof(*io));
+	if (!io)
+		return -1;
+	io->next = NULL;
+	io->dev = dev;
+	io->cmd = cmd;
+	io->iovec = iovec;
+	io->iov_cnt = iov_cnt;
+	io->length = length;
+	io->offset = offset;
+	io->is_write = is_write;
+
+	pthread_mutex_lock(&w->lock);
+	*w->tail = io;
+	w->tail = &io->next;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
 static int qcow_open(struct tcmu_device *dev)
 {
 	struct bdev *bdev;
 	char *config;
+	char *options;
 
 	bdev = calloc(1, sizeof(*bdev));
 	if (!bdev)
@@ -1426,8 +2151,32 @@ static int qcow_open(struct tcmu_device *dev)
 	tcmu_dbg("%s\n", tcmu_get_dev_cfgstring(dev));
 	tcmu_dbg("%s\n", config);
 
+	bdev->flush_interval_ms = QCOW_DEFAULT_FLUSH_INTERVAL_MS;
+	bdev->nr_threads = QCOW_DEFAULT_THREADS;
+
+	/* "<path>[,option=value]..." */
+	options = strchr(config, ',');
+	if (options) {
+		*options++ = '\0';
+		if (qcow_parse_options(bdev, options) < 0)
+			goto err;
+	}
+	if (bdev->nr_threads > QCOW_MAX_THREADS) {
+		tcmu_err("too many threads (%"PRIu64"), at most %d\n",
+			 bdev->nr_threads, QCOW_MAX_THREADS);
+		goto err;
+	}
+
 	if (bdev_open(bdev, AT_FDCWD, config, O_RDWR) == -1)
 		goto err;
+
+	if (bdev->nr_threads) {
+		bdev->workers = qcow_workers_start(bdev->nr_threads);
+		if (!bdev->workers) {
+			bdev->ops->close(bdev);
+			goto err;
+		}
+	}
 	return 0;
 err:
 	free(bdev);
@@ -1438,13 +2187,16 @@ static void qcow_close(struct tcmu_device *dev)
 {
 	struct bdev *bdev = tcmu_get_dev_private(dev);
 
+	/* complete queued commands before the image goes away */
+	if (bdev->workers)
+		qcow_workers_stop(bdev->workers);
 	bdev->ops->close(bdev);
 	free(bdev);
 }
 
-static int qcow_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
-		     struct iovec *iovec, size_t iov_cnt, size_t length,
-		     off_t offset)
+static int qcow_do_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			struct iovec *iovec, size_t iov_cnt, size_t length,
+			off_t offset)
 {
 	struct bdev *bdev = tcmu_get_dev_private(dev);
 	size_t remaining = length;
@@ -1468,9 +2220,9 @@ done:
 	return 0;
 }
 
-static int qcow_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
-		      struct iovec *iovec, size_t iov_cnt, size_t length,
-		      off_t offset)
+static int qcow_do_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+			 struct iovec *iovec, size_t iov_cnt, size_t length,
+			 off_t offset)
 {
 	struct bdev *bdev = tcmu_get_dev_private(dev);
 	size_t remaining = length;
@@ -1494,7 +2246,63 @@ done:
 	return 0;
 }
 
-static const char qcow_cfg_desc[] = "The path to the QEMU QCOW image file.";
+static int qcow_read(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		     struct iovec *iovec, size_t iov_cnt, size_t length,
+		     off_t offset)
+{
+	struct bdev *bdev = tcmu_get_dev_private(dev);
+
+	if (bdev->workers &&
+	    qcow_queue_io(bdev->workers, dev, cmd, iovec, iov_cnt, length, offset, false) == 0)
+		return 0;
+	return qcow_do_read(dev, cmd, iovec, iov_cnt, length, offset);
+}
+
+static int qcow_write(struct tcmu_device *dev, struct tcmulib_cmd *cmd,
+		      struct iovec *iovec, size_t iov_cnt, size_t length,
+		      off_t offset)
+{
+	struct bdev *bdev = tcmu_get_dev_private(dev);
+
+	if (bdev->workers &&
+	    qcow_queue_io(bdev->workers, dev, cmd, iovec, iov_cnt, length, offset, true) == 0)
+		return 0;
+	return qcow_do_write(dev, cmd, iovec, iov_cnt, length, offset);
+}
+
+/* SYNCHRONIZE CACHE covers the writes completed before it, so it need not be queued */
+static int qcow_flush(struct tcmu_device *dev, struct tcmulib_cmd *cmd)
+{
+	struct bdev *bdev = tcmu_get_dev_private(dev);
+	int ret = SAM_STAT_GOOD;
+
+	if (bdev->ops->flush(bdev) < 0) {
+		tcmu_err("flush failed: %m\n");
+		ret = tcmu_set_sense_data(cmd->sense_buf, MEDIUM_ERROR,
+					  ASC_WRITE_ERROR, NULL);
+	}
+	cmd->done(dev, cmd, ret);
+	return 0;
+}
+
+/* GET LBA STATUS maps are answered from the L2 tables, without touching any data */
+static int qcow_get_lba_status(struct tcmu_device *dev, off_t offset, uint64_t *len,
+			       bool *mapped)
+{
+	struct bdev *bdev = tcmu_get_dev_private(dev);
+
+	if (!bdev->ops->lba_status) {
+		*mapped = true;
+		return 0;
+	}
+	return bdev->ops->lba_status(bdev, offset, len, mapped);
+}
+
+static const char qcow_cfg_desc[] =
+	"The path to the QEMU QCOW image file, optionally followed by "
+	"\",l2-cache-size=<bytes>\", \",refcount-cache-size=<bytes>\" and/or "
+	"\",flush-interval=<ms>\" (0 for metadata write-back only on SYNCHRONIZE CACHE) and/or "
+	"\",threads=<n>\" (0 to run reads and writes in the caller).";
 
 static struct tcmur_handler qcow_handler = {
 	.name = "QEMU Copy-On-Write image file",
@@ -1507,7 +2315,9 @@ static struct tcmur_handler qcow_handler = {
 	.close = qcow_close,
 	.write = qcow_write,
 	.read = qcow_read,
-	.nr_threads = 1,
+	.flush = qcow_flush,
+	.get_lba_status = qcow_get_lba_status,
+	.nr_threads = 1,	/* the handler runs its own I/O threads, see qcow_read() */
 };
 
 /* Entry point must be named "handler_init". */
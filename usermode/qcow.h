@@ -27,6 +27,24 @@ struct qcow_header
     uint64_t l1_table_offset;
 } __attribute__((__packed__));
 
-#define L2_CACHE_SIZE 16
+/* Default per-image metadata cache budgets, in bytes; override in the config string with
+ * "<path>,l2-cache-size=<bytes>,refcount-cache-size=<bytes>" (K, M and G suffixes allowed) */
+#define QCOW_DEFAULT_L2_CACHE_BYTES	(32 * 1024 * 1024)
+#define QCOW_DEFAULT_RC_CACHE_BYTES	(QCOW_DEFAULT_L2_CACHE_BYTES / 4)
+
+/* Period of the timer writing back metadata updates, unless SYNCHRONIZE CACHE does first;
+ * override with "<path>,flush-interval=<ms>" (0 for none) */
+#define QCOW_OPT_FLUSH_INTERVAL		"flush-interval"
+#define QCOW_DEFAULT_FLUSH_INTERVAL_MS	5000
+
+/* Bytes of contiguous free clusters zeroed at a time for allocation (qcow2) */
+#define QCOW_PREALLOC_BYTES		(2 * 1024 * 1024)
+
+/* Threads running reads and writes for each device, so that commands mapping to different
+ * clusters proceed concurrently; override with "<path>,threads=<n>" (0 to run them
+ * synchronously in the caller) */
+#define QCOW_OPT_THREADS		"threads"
+#define QCOW_DEFAULT_THREADS		4
+#define QCOW_MAX_THREADS		64
 
 #endif /* _QCOW_H_ */
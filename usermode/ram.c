@@ -108,6 +108,55 @@ static int tcmu_ram_write(struct tcmu_device *td, struct tcmulib_cmd *op,
 	return 0;
 }
 
+static int tcmu_ram_write_zeroes(struct tcmu_device *td, struct tcmulib_cmd *op,
+		 off_t seekpos, size_t size)
+{
+	state_t s = tcmu_get_dev_private(td);
+	int sam_stat = SAM_STAT_GOOD;
+
+	if (seekpos < 0 || seekpos + size > s->size)
+		sam_stat = tcmu_set_sense_data(op->sense_buf,
+				 ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE, NULL);
+	else
+		memset(s->ram + seekpos, 0, size);
+
+	op->done(td, op, sam_stat);
+	return 0;
+}
+
+/* Anonymous memory is all mapped; a backing file reports its holes */
+static int tcmu_ram_get_lba_status(struct tcmu_device *td, off_t seekpos,
+		 uint64_t *size, bool *mapped)
+{
+	state_t s = tcmu_get_dev_private(td);
+	off_t data, hole;
+
+	*mapped = true;
+	if (s->fd < 0)
+		return 0;
+
+	data = lseek(s->fd, seekpos, SEEK_DATA);
+	if (data < 0 && errno == ENXIO) {
+		*mapped = false;	/* hole up to EOF */
+		return 0;
+	}
+	if (data < 0)
+		return -errno;
+	if (data > seekpos) {
+		*mapped = false;
+		if ((uint64_t)(data - seekpos) < *size)
+			*size = data - seekpos;
+		return 0;
+	}
+
+	hole = lseek(s->fd, seekpos, SEEK_HOLE);
+	if (hole < 0)
+		return -errno;
+	if ((uint64_t)(hole - seekpos) < *size)
+		*size = hole - seekpos;
+	return 0;
+}
+
 static int tcmu_ram_flush(struct tcmu_device *td, struct tcmulib_cmd *op)
 {
 	state_t s = tcmu_get_dev_private(td);
@@ -276,6 +325,8 @@ struct tcmur_handler tcmu_ram_handler = {
 	.read	       = tcmu_ram_read,
 	.write	       = tcmu_ram_write,
 	.flush	       = tcmu_ram_flush,
+	.write_zeroes  = tcmu_ram_write_zeroes,
+	.get_lba_status = tcmu_ram_get_lba_status,
 };
 
 int handler_init(void)
@@ -58,6 +58,41 @@ struct hash_desc {
 #define crypto_hash_final(hash, id)			E_OK
 #define crypto_free_hash(tfm)				DO_NOTHING()
 
+/* Describe a page of memory not obtained from alloc_pages(), e.g. of the SGV
+ * arena (scst_mem.c); such a page must never be passed to __free_pages() */
+#define scstu_page_init(page, addr) \
+	    do { memset((page), 0, sizeof(*(page))); \
+		 (page)->vaddr = (addr); } while (0)
+
+/* Host NUMA topology, learned from sysfs by scstu_numa_init() (scst_main.c),
+ * so that the NUMA placement of SGV pools, threads and sessions works in
+ * usermode as it does in the kernel.  Node ids are the host's node ids. */
+#define SCSTU_MAX_NODES					64
+#define SCSTU_MAX_CPUS					1024
+
+extern int scstu_nr_node_ids;		/* highest online node id + 1 */
+extern int scstu_num_online_nodes;
+extern int scstu_cpu_node[SCSTU_MAX_CPUS];
+extern bool scstu_node_online[SCSTU_MAX_NODES];
+extern cpumask_t scstu_node_cpumask[SCSTU_MAX_NODES];
+
+#undef nr_node_ids
+#undef cpu_to_node
+#undef num_online_nodes
+#undef cpumask_of_node
+#undef node_online
+#undef for_each_online_node
+#define nr_node_ids					scstu_nr_node_ids
+#define cpu_to_node(cpu) \
+	    ((unsigned int)(cpu) < SCSTU_MAX_CPUS ? scstu_cpu_node[(cpu)] : 0)
+#define num_online_nodes()				scstu_num_online_nodes
+#define cpumask_of_node(node)				(&scstu_node_cpumask[(node)])
+#define node_online(node) \
+	    ((unsigned int)(node) < SCSTU_MAX_NODES && scstu_node_online[(node)])
+#define for_each_online_node(node) \
+	    for ((node) = 0; (node) < scstu_nr_node_ids; (node)++) \
+		if (!scstu_node_online[(node)]) { } else
+
 /*** UNUSED ***/
 
 struct Scsi_Host;
@@ -0,0 +1,907 @@
+/*
+ *  scstu_loop.c
+ *
+ *  In-process loopback target driver for the SCST_USERMODE build.
+ *
+ *  Each "scstu_loop" target has one session, fed by a built-in load
+ *  generator instead of a fabric: the generator thread keeps a configured
+ *  number of READ(16)/WRITE(16) commands outstanding through scst_rx_cmd(),
+ *  and xmit_response() hands each completion back to it through an
+ *  in-memory completion ring, so no socket and no iSCSI PDU is involved.
+ *  This measures what the SCST core, vdisk and the backstore (aio, io_uring
+ *  or a tcmu handler) cost per command, without the network path.
+ *
+ *  Usage, with LUNs assigned to the target like to any other target:
+ *
+ *	echo "add_target loop0" >/sys/kernel/scst_tgt/targets/scstu_loop/mgmt
+ *	echo "add disk1 0" >/sys/kernel/scst_tgt/targets/scstu_loop/loop0/luns/mgmt
+ *	echo "qd=32 bs=4096 read=70 seconds=10" \
+ *		>/sys/kernel/scst_tgt/targets/scstu_loop/loop0/run
+ *	cat /sys/kernel/scst_tgt/targets/scstu_loop/loop0/results
+ *
+ *  A run first takes the block size of the LUN from its SCST device and
+ *  its capacity from READ CAPACITY(16), and keeps its LBAs within both the
+ *  LUN and span_mb. The LBAs and the READ/WRITE mix come from a generator
+ *  seeded with the run's seed, 1 by default, so runs with the same
+ *  parameters issue the same commands in the same order.
+ *
+ *  Data is neither generated nor checked: WRITEs carry whatever the buffer
+ *  SCST allocated for them holds, as if the initiator had already placed
+ *  its data there.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation, version 2
+ *  of the License.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/types.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+
+#define LOG_PREFIX "scstu_loop"
+
+#include <scst.h>
+#include <scst_debug.h>
+
+#define SCSTU_LOOP_NAME			"scstu_loop"
+
+#define SCSTU_LOOP_DEFAULT_LOG_FLAGS (TRACE_OUT_OF_MEM | TRACE_MGMT | \
+	TRACE_MINOR | TRACE_SPECIAL)
+
+#if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
+#define trace_flag scstu_loop_trace_flag
+static unsigned long scstu_loop_trace_flag = SCSTU_LOOP_DEFAULT_LOG_FLAGS;
+#endif
+
+/* Limits on the parameters of a run */
+#define SCSTU_LOOP_MAX_QD		1024
+#define SCSTU_LOOP_MAX_BS		(8*1024*1024)
+#define SCSTU_LOOP_MAX_LUN		16383
+
+#define SCSTU_LOOP_CAP_LEN		32	/* READ CAPACITY(16) data */
+
+/* One slot per command the generator may have outstanding */
+struct scstu_loop_io {
+	struct scstu_loop_tgt *tgt;
+	int slot;
+	bool write;
+	bool failed;
+	bool probe;		/* READ CAPACITY(16) at the start of a run */
+	uint64_t start_us;
+};
+
+struct scstu_loop_tgt {
+	struct list_head tgts_list_entry;
+	struct scst_tgt *scst_tgt;
+	struct scst_session *scst_sess;
+
+	/* Protects the parameters and results below against sysfs */
+	struct mutex run_mutex;
+	bool running;
+	bool stop;
+	struct completion gen_done;	/* completed_all while not running */
+
+	/* Parameters of the current or last run */
+	int qd;
+	int bs;
+	int read_pct;
+	int seconds;
+	uint64_t lun;
+	uint64_t span_mb;	/* LBAs are chosen within the first span_mb */
+	uint64_t seed;		/* of the LBA and READ/WRITE sequence */
+
+	/* Generator state, owned by the generator thread */
+	struct scstu_loop_io *ios;
+	uint64_t rand_state;
+	int outstanding;
+	int lbs;		/* logical block size of the LUN */
+	uint64_t lun_blocks;	/* capacity of the LUN */
+	uint8_t cap_data[SCSTU_LOOP_CAP_LEN];	/* set by xmit_response() */
+
+	/*
+	 * Completion ring: slots are put by xmit_response() and taken by the
+	 * generator.  It never holds more than qd entries, one per slot, so
+	 * qd + 1 entries tell full from empty.
+	 */
+	spinlock_t ring_lock;
+	wait_queue_head_t ring_waitQ;
+	int *ring;
+	unsigned int ring_head, ring_tail;
+
+	/* Results of the current or last run */
+	uint64_t res_reads, res_writes, res_errors;
+	uint64_t res_lat_sum_us, res_lat_max_us;
+	uint64_t res_start_us, res_elapsed_us;
+};
+
+static DEFINE_MUTEX(scstu_loop_mutex);
+static LIST_HEAD(scstu_loop_tgts_list);
+
+static struct scst_tgt_template scstu_loop_tgt_template;
+
+static inline uint64_t scstu_loop_time_us(void)
+{
+	return ktime_to_us(ktime_get());
+}
+
+/* xorshift64*: good enough to spread LBAs and pick READ vs WRITE */
+static inline uint64_t scstu_loop_random(struct scstu_loop_tgt *tgt)
+{
+	uint64_t x = tgt->rand_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	tgt->rand_state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static void scstu_loop_ring_put(struct scstu_loop_tgt *tgt, int slot)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tgt->ring_lock, flags);
+	tgt->ring[tgt->ring_tail] = slot;
+	tgt->ring_tail = (tgt->ring_tail + 1) % (tgt->qd + 1);
+	spin_unlock_irqrestore(&tgt->ring_lock, flags);
+
+	wake_up(&tgt->ring_waitQ);
+}
+
+static bool scstu_loop_ring_ready(struct scstu_loop_tgt *tgt)
+{
+	bool res;
+
+	spin_lock_irq(&tgt->ring_lock);
+	res = (tgt->ring_head != tgt->ring_tail);
+	spin_unlock_irq(&tgt->ring_lock);
+	return res;
+}
+
+/*
+ * Take everything on the ring at once, so the lock is taken once per batch
+ * of completions rather than once per command. Returns the number taken.
+ */
+static int scstu_loop_ring_get(struct scstu_loop_tgt *tgt, int *slots)
+{
+	int n = 0;
+
+	spin_lock_irq(&tgt->ring_lock);
+	while (tgt->ring_head != tgt->ring_tail) {
+		slots[n++] = tgt->ring[tgt->ring_head];
+		tgt->ring_head = (tgt->ring_head + 1) % (tgt->qd + 1);
+	}
+	spin_unlock_irq(&tgt->ring_lock);
+	return n;
+}
+
+static int scstu_loop_submit(struct scstu_loop_tgt *tgt,
+	struct scstu_loop_io *io, const uint8_t *cdb, int data_len)
+{
+	int res = 0;
+	struct scst_cmd *cmd;
+	uint8_t lun[8] = { 0 };
+
+	TRACE_ENTRY();
+
+	io->failed = false;
+
+	/* SAM-2 single level LUN, peripheral or flat space addressing */
+	if (tgt->lun < 256) {
+		lun[1] = tgt->lun;
+	} else {
+		lun[0] = 0x40 | (tgt->lun >> 8);
+		lun[1] = tgt->lun & 0xff;
+	}
+
+	cmd = scst_rx_cmd(tgt->scst_sess, lun, sizeof(lun), cdb, 16, false);
+	if (cmd == NULL) {
+		PRINT_ERROR("%s", "scst_rx_cmd() failed");
+		res = -ENOMEM;
+		goto out;
+	}
+
+	scst_cmd_set_tag(cmd, io->slot);
+	scst_cmd_set_queue_type(cmd, SCST_CMD_QUEUE_SIMPLE);
+	scst_cmd_set_expected(cmd, io->write ? SCST_DATA_WRITE : SCST_DATA_READ,
+			      data_len);
+	scst_cmd_set_tgt_priv(cmd, io);
+
+	tgt->outstanding++;
+	io->start_us = scstu_loop_time_us();
+
+	scst_cmd_init_done(cmd, SCST_CONTEXT_THREAD);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static int scstu_loop_issue(struct scstu_loop_tgt *tgt, struct scstu_loop_io *io)
+{
+	uint8_t cdb[16] = { 0 };
+	uint64_t nblocks = tgt->bs / tgt->lbs;
+	uint64_t span = min_t(uint64_t, (tgt->span_mb << 20) / tgt->lbs,
+			      tgt->lun_blocks);
+	uint64_t lba;
+
+	io->write = (scstu_loop_random(tgt) % 100) >= tgt->read_pct;
+
+	lba = span > nblocks ? scstu_loop_random(tgt) % (span - nblocks + 1) : 0;
+	lba -= lba % nblocks;		/* keep the I/O aligned to its size */
+
+	cdb[0] = io->write ? WRITE_16 : READ_16;
+	put_unaligned_be64(lba, &cdb[2]);
+	put_unaligned_be32(nblocks, &cdb[10]);
+
+	return scstu_loop_submit(tgt, io, cdb, tgt->bs);
+}
+
+/*
+ * Learns the geometry of the LUN of the run: the block size from its SCST
+ * device and the capacity, which the device doesn't keep, from a READ
+ * CAPACITY(16) sent through slot 0. Returns 0 if a run can go on.
+ */
+static int scstu_loop_probe(struct scstu_loop_tgt *tgt)
+{
+	struct scstu_loop_io *io = &tgt->ios[0];
+	struct scst_tgt_dev *tgt_dev;
+	struct list_head *head;
+	uint8_t cdb[16] = { 0 };
+	int slot, res = -ENOENT;
+
+	TRACE_ENTRY();
+
+	tgt->lbs = 0;
+	mutex_lock(&scst_mutex);
+	head = &tgt->scst_sess->sess_tgt_dev_list[
+			SESS_TGT_DEV_LIST_HASH_FN(tgt->lun)];
+	list_for_each_entry(tgt_dev, head, sess_tgt_dev_list_entry) {
+		if (tgt_dev->lun == tgt->lun) {
+			tgt->lbs = tgt_dev->dev->block_size;
+			break;
+		}
+	}
+	mutex_unlock(&scst_mutex);
+
+	if (tgt->lbs <= 0) {
+		PRINT_ERROR("Target %s: no LUN %lld", tgt->scst_tgt->tgt_name,
+			(unsigned long long)tgt->lun);
+		goto out;
+	}
+
+	res = -EINVAL;
+	if ((tgt->bs % tgt->lbs) != 0) {
+		PRINT_ERROR("bs %d is not a multiple of the LUN's block size "
+			"%d", tgt->bs, tgt->lbs);
+		goto out;
+	}
+
+	cdb[0] = SERVICE_ACTION_IN_16;
+	cdb[1] = SAI_READ_CAPACITY_16;
+	put_unaligned_be32(SCSTU_LOOP_CAP_LEN, &cdb[10]);
+
+	io->write = false;
+	io->probe = true;
+	memset(tgt->cap_data, 0, sizeof(tgt->cap_data));
+	res = scstu_loop_submit(tgt, io, cdb, SCSTU_LOOP_CAP_LEN);
+	if (res != 0)
+		goto out_probe;
+
+	wait_event(tgt->ring_waitQ, scstu_loop_ring_ready(tgt));
+	scstu_loop_ring_get(tgt, &slot);
+	tgt->outstanding--;
+
+	res = -EIO;
+	if (io->failed) {
+		PRINT_ERROR("Target %s: READ CAPACITY(16) of LUN %lld failed",
+			tgt->scst_tgt->tgt_name, (unsigned long long)tgt->lun);
+		goto out_probe;
+	}
+
+	if (get_unaligned_be32(&tgt->cap_data[8]) != tgt->lbs) {
+		PRINT_ERROR("Target %s: LUN %lld block size %d, but READ "
+			"CAPACITY(16) says %d", tgt->scst_tgt->tgt_name,
+			(unsigned long long)tgt->lun, tgt->lbs,
+			get_unaligned_be32(&tgt->cap_data[8]));
+		goto out_probe;
+	}
+
+	tgt->lun_blocks = get_unaligned_be64(&tgt->cap_data[0]) + 1;
+
+	res = -EINVAL;
+	if (tgt->lun_blocks < tgt->bs / tgt->lbs) {
+		PRINT_ERROR("Target %s: bs %d exceeds LUN %lld",
+			tgt->scst_tgt->tgt_name, tgt->bs,
+			(unsigned long long)tgt->lun);
+		goto out_probe;
+	}
+
+	res = 0;
+
+out_probe:
+	io->probe = false;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void scstu_loop_account(struct scstu_loop_tgt *tgt,
+	struct scstu_loop_io *io, uint64_t now)
+{
+	uint64_t lat = now - io->start_us;
+
+	if (unlikely(io->failed))
+		tgt->res_errors++;
+	else if (io->write)
+		tgt->res_writes++;
+	else
+		tgt->res_reads++;
+
+	tgt->res_lat_sum_us += lat;
+	if (lat > tgt->res_lat_max_us)
+		tgt->res_lat_max_us = lat;
+}
+
+static int scstu_loop_gen_thread(void *arg)
+{
+	struct scstu_loop_tgt *tgt = arg;
+	uint64_t end_us, now;
+	int *slots;
+	int i, n;
+
+	TRACE_ENTRY();
+
+	slots = kmalloc_array(tgt->qd, sizeof(*slots), GFP_KERNEL);
+	if (slots == NULL) {
+		PRINT_ERROR("%s", "Unable to alloc completion slots");
+		goto out;
+	}
+
+	if (scstu_loop_probe(tgt) != 0) {
+		kfree(slots);
+		goto out;
+	}
+
+	PRINT_INFO("Target %s: run qd %d bs %d read %d%% for %d s on LUN %lld "
+		"(%lld blocks of %d), seed %lld", tgt->scst_tgt->tgt_name,
+		tgt->qd, tgt->bs, tgt->read_pct, tgt->seconds,
+		(unsigned long long)tgt->lun,
+		(unsigned long long)tgt->lun_blocks, tgt->lbs,
+		(unsigned long long)tgt->seed);
+
+	tgt->res_start_us = scstu_loop_time_us();
+	end_us = tgt->res_start_us + (uint64_t)tgt->seconds * 1000000;
+
+	for (i = 0; i < tgt->qd; i++) {
+		if (scstu_loop_issue(tgt, &tgt->ios[i]) != 0)
+			break;
+	}
+
+	while (tgt->outstanding != 0) {
+		wait_event(tgt->ring_waitQ, scstu_loop_ring_ready(tgt));
+
+		n = scstu_loop_ring_get(tgt, slots);
+		now = scstu_loop_time_us();
+
+		for (i = 0; i < n; i++) {
+			struct scstu_loop_io *io = &tgt->ios[slots[i]];
+
+			tgt->outstanding--;
+			scstu_loop_account(tgt, io, now);
+
+			if (unlikely(READ_ONCE(tgt->stop) || now >= end_us))
+				continue;
+
+			if (unlikely(scstu_loop_issue(tgt, io) != 0))
+				tgt->stop = true;
+		}
+	}
+
+	tgt->res_elapsed_us = scstu_loop_time_us() - tgt->res_start_us;
+
+	kfree(slots);
+
+out:
+	PRINT_INFO("Target %s: run done, %lld reads %lld writes %lld errors",
+		tgt->scst_tgt->tgt_name, (unsigned long long)tgt->res_reads,
+		(unsigned long long)tgt->res_writes,
+		(unsigned long long)tgt->res_errors);
+
+	mutex_lock(&tgt->run_mutex);
+	kfree(tgt->ios);
+	tgt->ios = NULL;
+	kfree(tgt->ring);
+	tgt->ring = NULL;
+	tgt->running = false;
+	mutex_unlock(&tgt->run_mutex);
+
+	complete_all(&tgt->gen_done);
+
+	TRACE_EXIT();
+	return 0;
+}
+
+/* Called under tgt->run_mutex */
+static int scstu_loop_start(struct scstu_loop_tgt *tgt)
+{
+	struct task_struct *t;
+	int res, i;
+
+	TRACE_ENTRY();
+
+	tgt->ios = kcalloc(tgt->qd, sizeof(*tgt->ios), GFP_KERNEL);
+	tgt->ring = kmalloc_array(tgt->qd + 1, sizeof(*tgt->ring), GFP_KERNEL);
+	if ((tgt->ios == NULL) || (tgt->ring == NULL)) {
+		PRINT_ERROR("Unable to alloc %d generator slots", tgt->qd);
+		res = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < tgt->qd; i++) {
+		tgt->ios[i].tgt = tgt;
+		tgt->ios[i].slot = i;
+	}
+
+	tgt->ring_head = tgt->ring_tail = 0;
+	tgt->outstanding = 0;
+	tgt->rand_state = tgt->seed;	/* never 0, which xorshift keeps */
+	tgt->stop = false;
+	tgt->res_reads = tgt->res_writes = tgt->res_errors = 0;
+	tgt->res_lat_sum_us = tgt->res_lat_max_us = 0;
+	tgt->res_elapsed_us = 0;
+	init_completion(&tgt->gen_done);
+
+	tgt->running = true;
+	t = kthread_run(scstu_loop_gen_thread, tgt, "%s_gen",
+			tgt->scst_tgt->tgt_name);
+	if (IS_ERR(t)) {
+		res = PTR_ERR(t);
+		PRINT_ERROR("kthread_run() failed: %d", res);
+		tgt->running = false;
+		complete_all(&tgt->gen_done);
+		goto out_free;
+	}
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_free:
+	kfree(tgt->ios);
+	tgt->ios = NULL;
+	kfree(tgt->ring);
+	tgt->ring = NULL;
+	goto out;
+}
+
+/* Stops the generator, if running, and waits for it to drain */
+static void scstu_loop_stop(struct scstu_loop_tgt *tgt)
+{
+	TRACE_ENTRY();
+
+	WRITE_ONCE(tgt->stop, true);
+	wait_for_completion(&tgt->gen_done);
+
+	TRACE_EXIT();
+	return;
+}
+
+/**
+ ** Tgt attributes
+ **/
+
+static ssize_t scstu_loop_run_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt *scst_tgt;
+	struct scstu_loop_tgt *tgt;
+	ssize_t res;
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (tgt == NULL)
+		return -E_TGT_PRIV_NOT_YET_SET;
+
+	mutex_lock(&tgt->run_mutex);
+	res = sprintf(buf, "qd=%d bs=%d read=%d seconds=%d lun=%lld "
+		"span_mb=%lld seed=%lld\n", tgt->qd, tgt->bs, tgt->read_pct,
+		tgt->seconds, (unsigned long long)tgt->lun,
+		(unsigned long long)tgt->span_mb,
+		(unsigned long long)tgt->seed);
+	mutex_unlock(&tgt->run_mutex);
+
+	return res;
+}
+
+/*
+ * Accepts "stop", or a list of "name=value" parameters, each of which
+ * defaults to its value in the previous run, to start a run.
+ */
+static ssize_t scstu_loop_run_store(struct kobject *kobj,
+	struct kobj_attribute *attr, const char *buffer, size_t size)
+{
+	struct scst_tgt *scst_tgt;
+	struct scstu_loop_tgt *tgt;
+	char *buf, *p, *pp, *name;
+	unsigned long long val;
+	ssize_t res;
+
+	TRACE_ENTRY();
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (tgt == NULL) {
+		res = -E_TGT_PRIV_NOT_YET_SET;
+		goto out;
+	}
+
+	buf = kasprintf(GFP_KERNEL, "%.*s", (int)size, buffer);
+	if (buf == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+
+	if (strncasecmp(buf, "stop", 4) == 0) {
+		WRITE_ONCE(tgt->stop, true);
+		res = size;
+		goto out_free;
+	}
+	pp = buf;
+
+	mutex_lock(&tgt->run_mutex);
+
+	if (tgt->running) {
+		PRINT_ERROR("Target %s: a run is already in progress",
+			scst_tgt->tgt_name);
+		res = -EBUSY;
+		goto out_unlock;
+	}
+
+	while (1) {
+		name = scst_get_next_lexem(&pp);
+		if (*name == '\0')
+			break;
+
+		p = scst_get_next_lexem(&pp);
+		res = kstrtoull(p, 0, &val);
+		if (res != 0) {
+			PRINT_ERROR("Bad value \"%s\" for %s", p, name);
+			goto out_unlock;
+		}
+
+		res = -EINVAL;
+		if (strcasecmp(name, "qd") == 0) {
+			if ((val == 0) || (val > SCSTU_LOOP_MAX_QD))
+				goto out_bad;
+			tgt->qd = val;
+		} else if (strcasecmp(name, "bs") == 0) {
+			if ((val == 0) || (val > SCSTU_LOOP_MAX_BS))
+				goto out_bad;
+			tgt->bs = val;
+		} else if (strcasecmp(name, "read") == 0) {
+			if (val > 100)
+				goto out_bad;
+			tgt->read_pct = val;
+		} else if (strcasecmp(name, "seconds") == 0) {
+			if ((val == 0) || (val > INT_MAX))
+				goto out_bad;
+			tgt->seconds = val;
+		} else if (strcasecmp(name, "lun") == 0) {
+			if (val > SCSTU_LOOP_MAX_LUN)
+				goto out_bad;
+			tgt->lun = val;
+		} else if (strcasecmp(name, "span_mb") == 0) {
+			if (val == 0)
+				goto out_bad;
+			tgt->span_mb = val;
+		} else if (strcasecmp(name, "seed") == 0) {
+			if (val == 0)
+				goto out_bad;
+			tgt->seed = val;
+		} else {
+			PRINT_ERROR("Unknown parameter %s", name);
+			goto out_unlock;
+		}
+	}
+
+	res = scstu_loop_start(tgt);
+	if (res == 0)
+		res = size;
+
+out_unlock:
+	mutex_unlock(&tgt->run_mutex);
+
+out_free:
+	kfree(buf);
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_bad:
+	PRINT_ERROR("Value %lld out of range for %s", val, name);
+	goto out_unlock;
+}
+
+static struct kobj_attribute scstu_loop_run_attr =
+	__ATTR(run, S_IRUGO | S_IWUSR, scstu_loop_run_show,
+	       scstu_loop_run_store);
+
+static ssize_t scstu_loop_results_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	struct scst_tgt *scst_tgt;
+	struct scstu_loop_tgt *tgt;
+	uint64_t ios, elapsed, iops, kbps, lat_avg;
+
+	scst_tgt = container_of(kobj, struct scst_tgt, tgt_kobj);
+	tgt = scst_tgt_get_tgt_priv(scst_tgt);
+	if (tgt == NULL)
+		return -E_TGT_PRIV_NOT_YET_SET;
+
+	/* Figures of a run in progress are racy, but good enough to watch */
+	ios = tgt->res_reads + tgt->res_writes + tgt->res_errors;
+	elapsed = READ_ONCE(tgt->running) ?
+		  scstu_loop_time_us() - tgt->res_start_us : tgt->res_elapsed_us;
+	iops = elapsed ? ios * 1000000 / elapsed : 0;
+	kbps = iops * tgt->bs / 1024;
+	lat_avg = ios ? tgt->res_lat_sum_us / ios : 0;
+
+	return sprintf(buf, "%s\n"
+		"reads %lld writes %lld errors %lld elapsed_ms %lld\n"
+		"iops %lld KB/s %lld lat_avg_us %lld lat_max_us %lld\n",
+		READ_ONCE(tgt->running) ? "running" : "idle",
+		(unsigned long long)tgt->res_reads,
+		(unsigned long long)tgt->res_writes,
+		(unsigned long long)tgt->res_errors,
+		(unsigned long long)elapsed / 1000,
+		(unsigned long long)iops, (unsigned long long)kbps,
+		(unsigned long long)lat_avg,
+		(unsigned long long)tgt->res_lat_max_us);
+}
+
+static struct kobj_attribute scstu_loop_results_attr =
+	__ATTR(results, S_IRUGO, scstu_loop_results_show, NULL);
+
+static const struct attribute *scstu_loop_tgt_attrs[] = {
+	&scstu_loop_run_attr.attr,
+	&scstu_loop_results_attr.attr,
+	NULL,
+};
+
+/**
+ ** Targets
+ **/
+
+static ssize_t scstu_loop_add_target(const char *target_name, char *params)
+{
+	struct scstu_loop_tgt *tgt;
+	ssize_t res;
+
+	TRACE_ENTRY();
+
+	tgt = kzalloc(sizeof(*tgt), GFP_KERNEL);
+	if (tgt == NULL) {
+		PRINT_ERROR("Unable to alloc tgt (size %zu)", sizeof(*tgt));
+		res = -ENOMEM;
+		goto out;
+	}
+
+	mutex_init(&tgt->run_mutex);
+	init_completion(&tgt->gen_done);
+	complete_all(&tgt->gen_done);	/* nothing to wait for until a run */
+	spin_lock_init(&tgt->ring_lock);
+	init_waitqueue_head(&tgt->ring_waitQ);
+
+	tgt->qd = 32;
+	tgt->bs = 4096;
+	tgt->read_pct = 100;
+	tgt->seconds = 10;
+	tgt->span_mb = 1024;
+	tgt->seed = 1;
+
+	tgt->scst_tgt = scst_register_target(&scstu_loop_tgt_template,
+					     target_name);
+	if (tgt->scst_tgt == NULL) {
+		res = -EFAULT;
+		goto out_free;
+	}
+
+	tgt->scst_sess = scst_register_session(tgt->scst_tgt, 0, target_name,
+					       tgt, NULL, NULL);
+	if (tgt->scst_sess == NULL) {
+		PRINT_ERROR("%s", "scst_register_session() failed");
+		res = -EFAULT;
+		goto out_unreg_tgt;
+	}
+
+	scst_tgt_set_tgt_priv(tgt->scst_tgt, tgt);
+
+	mutex_lock(&scstu_loop_mutex);
+	list_add_tail(&tgt->tgts_list_entry, &scstu_loop_tgts_list);
+	mutex_unlock(&scstu_loop_mutex);
+
+	res = 0;
+
+out:
+	TRACE_EXIT_RES(res);
+	return res;
+
+out_unreg_tgt:
+	scst_unregister_target(tgt->scst_tgt);
+
+out_free:
+	kfree(tgt);
+	goto out;
+}
+
+/* Must be called under scstu_loop_mutex */
+static void __scstu_loop_remove_target(struct scstu_loop_tgt *tgt)
+{
+	TRACE_ENTRY();
+
+	scstu_loop_stop(tgt);
+
+	list_del(&tgt->tgts_list_entry);
+
+	scst_unregister_session(tgt->scst_sess, 1, NULL);
+	scst_unregister_target(tgt->scst_tgt);
+
+	kfree(tgt);
+
+	TRACE_EXIT();
+	return;
+}
+
+static ssize_t scstu_loop_del_target(const char *target_name)
+{
+	struct scstu_loop_tgt *tgt;
+	ssize_t res = -ENOENT;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&scstu_loop_mutex);
+	list_for_each_entry(tgt, &scstu_loop_tgts_list, tgts_list_entry) {
+		if (strcmp(target_name, tgt->scst_tgt->tgt_name) == 0) {
+			__scstu_loop_remove_target(tgt);
+			res = 0;
+			break;
+		}
+	}
+	mutex_unlock(&scstu_loop_mutex);
+
+	if (res != 0)
+		PRINT_ERROR("Target %s not found", target_name);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+/**
+ ** Target template callbacks
+ **/
+
+static int scstu_loop_release(struct scst_tgt *scst_tgt)
+{
+	TRACE_ENTRY();
+
+	TRACE_EXIT();
+	return 0;
+}
+
+static int scstu_loop_xmit_response(struct scst_cmd *cmd)
+{
+	struct scstu_loop_io *io = scst_cmd_get_tgt_priv(cmd);
+
+	TRACE_ENTRY();
+
+	if (unlikely(scst_cmd_aborted_on_xmit(cmd))) {
+		scst_set_delivery_status(cmd, SCST_CMD_DELIVERY_ABORTED);
+		io->failed = true;
+	} else if (unlikely(scst_cmd_get_status(cmd) != SAM_STAT_GOOD)) {
+		TRACE(TRACE_MINOR, "Loop cmd %p (op %s) status %x", cmd,
+			scst_get_opcode_name(cmd), scst_cmd_get_status(cmd));
+		io->failed = true;
+	}
+
+	if (unlikely(io->probe) && !io->failed) {
+		uint8_t *buf;
+		int len = scst_get_buf_first(cmd, &buf);
+
+		/* Only the first 12 bytes are needed, all in the first page */
+		if (len >= 12) {
+			memcpy(io->tgt->cap_data, buf,
+			       min_t(int, len, SCSTU_LOOP_CAP_LEN));
+		} else
+			io->failed = true;
+		if (len > 0)
+			scst_put_buf(cmd, buf);
+	}
+
+	scstu_loop_ring_put(io->tgt, io->slot);
+
+	scst_tgt_cmd_done(cmd, SCST_CONTEXT_SAME);
+
+	TRACE_EXIT();
+	return SCST_TGT_RES_SUCCESS;
+}
+
+static void scstu_loop_task_mgmt_fn_done(struct scst_mgmt_cmd *mcmd)
+{
+	TRACE_ENTRY();
+
+	TRACE_EXIT();
+	return;
+}
+
+static struct scst_tgt_template scstu_loop_tgt_template = {
+	.name			= SCSTU_LOOP_NAME,
+	.sg_tablesize		= 0xffff,
+	.xmit_response_atomic	= 1,
+	.multithreaded_init_done = 1,
+	.enabled_attr_not_needed = 1,
+	.tgt_attrs		= scstu_loop_tgt_attrs,
+	.add_target		= scstu_loop_add_target,
+	.del_target		= scstu_loop_del_target,
+	.release		= scstu_loop_release,
+	.xmit_response		= scstu_loop_xmit_response,
+	.task_mgmt_fn_done	= scstu_loop_task_mgmt_fn_done,
+#if defined(CONFIG_SCST_DEBUG) || defined(CONFIG_SCST_TRACING)
+	.default_trace_flags	= SCSTU_LOOP_DEFAULT_LOG_FLAGS,
+	.trace_flags		= &trace_flag,
+#endif
+};
+
+static int __init scstu_loop_init(void)
+{
+	int res;
+
+	TRACE_ENTRY();
+
+	res = scst_register_target_template(&scstu_loop_tgt_template);
+	if (res != 0)
+		PRINT_ERROR("Unable to register target template: %d", res);
+
+	TRACE_EXIT_RES(res);
+	return res;
+}
+
+static void __exit scstu_loop_exit(void)
+{
+	struct scstu_loop_tgt *tgt, *t;
+
+	TRACE_ENTRY();
+
+	mutex_lock(&scstu_loop_mutex);
+	list_for_each_entry_safe(tgt, t, &scstu_loop_tgts_list,
+				 tgts_list_entry)
+		__scstu_loop_remove_target(tgt);
+	mutex_unlock(&scstu_loop_mutex);
+
+	scst_unregister_target_template(&scstu_loop_tgt_template);
+
+	TRACE_EXIT();
+	return;
+}
+
+module_init(scstu_loop_init);
+module_exit(scstu_loop_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("SCST usermode in-process loopback target with load generator");
@@ -11,7 +11,9 @@ typedef int sam_stat_t;			    /* SAM status type */
 
 /* These compatibility symbols are named as expected by tcmu-runner plugins */
 
-extern int handler_init(void);		    /* Plugin provides this symbol */
+/* Plugin provides this symbol -- weak in the executable, where it is present only if a plugin
+ * is linked statically; plugins built as shared objects are found by dlsym(3) instead */
+extern int handler_init(void) __attribute__((__weak__));
 
 #define tcmu_err(fmtargs...)		    sys_error(fmtargs)
 #define tcmu_warn(fmtargs...)		    sys_warning(fmtargs)
@@ -39,6 +41,8 @@ struct tgt_port_grp;
 
 typedef sam_stat_t (*rw_fn_t)(struct tcmu_device *, struct tcmulib_cmd *, struct iovec *, size_t niov, size_t nbytes, off_t);
 typedef int (*flush_fn_t)(struct tcmu_device *, struct tcmulib_cmd *);
+typedef int (*zero_fn_t)(struct tcmu_device *, struct tcmulib_cmd *, off_t, size_t nbytes);
+typedef int (*lba_status_fn_t)(struct tcmu_device *, off_t, uint64_t * nbytes, bool * mapped);
 typedef void (*cmd_done_t)(struct tcmu_device *, struct tcmulib_cmd *, sam_stat_t);
 
 /* State for one Read/Write/Flush operation */
@@ -50,7 +54,9 @@ struct tcmulib_cmd {
     cmd_done_t			done;		/* completion handler */
     struct scst_cmd	      * scst_cmd;
     struct scst_blockio_work  * blockio_work;   /* read and write */
-    struct completion         * sync_done;	/* for synchronous flush */
+    struct completion         * sync_done;	/* for synchronous flush/zero */
+    sam_stat_t			sync_stat;	/* completion status of synchronous op */
+    uint64_t			t_submit;	/* clock ticks at submission */
     struct iovec		iov_space[MAX_FAST_IOV];
     uint8_t			sense_buf[SENSE_BUFFERSIZE];
 };
@@ -70,6 +76,10 @@ struct tcmur_handler {
     void		     (* close)(struct tcmu_device *dev);
     bool		     (* check_config)(const char *cfgstring, char **reason);
     bool		     (* handler_exit)(void);	/* optional */
+    zero_fn_t			write_zeroes;	/* optional: zero a byte range in place */
+    /* optional, synchronous: trim *nbytes to the run from off that is all mapped or all
+     * deallocated, setting *mapped accordingly; returns 0 or -errno */
+    lba_status_fn_t		get_lba_status;
     /* BELOW ENTRY POINTS ARE NOT USED AND NEVER CALLED */
     void		      * handle_cmd;
     void		      * transition_state;
@@ -82,6 +92,27 @@ struct tcmur_handler {
 extern int	    tcmur_register_handler(struct tcmur_handler *handler);
 extern bool	    tcmur_unregister_handler(struct tcmur_handler *handler);
 
+/* Per-device latency histograms, one for each phase of an OP on each CPU:
+ *   REQ - time spent in the handler's read/write entry point (on the submitting thread)
+ *   SVC - time from submission until the handler calls back with completion
+ *   RSP - time spent in the completion callback delivering the OP back into SCST
+ * Bucket 0 counts latencies under 128 ns; bucket i counts [2^(i+6), 2^(i+7)) ns; the last
+ * bucket also counts everything longer.  Each CPU updates its own copy with plain stores
+ * (racy, a sample may rarely be lost), and readers sum them.
+ */
+#define SCSTU_LAT_BUCKETS		    24
+enum { SCSTU_LAT_REQ, SCSTU_LAT_SVC, SCSTU_LAT_RSP, SCSTU_LAT_NPHASE };
+
+struct scstu_lat_hist {
+    uint64_t			count;
+    uint64_t			sum_ns;
+    uint64_t			bucket[SCSTU_LAT_BUCKETS];
+};
+
+struct scstu_lat_cpu {
+    struct scstu_lat_hist	hist[SCSTU_LAT_NPHASE];
+} ____cacheline_aligned_in_smp;
+
 /* scstu_tcmu private structure -- handlers should use accessors */
 struct tcmu_device {
     void		      * hm_private;		/* owned by handler */
@@ -94,17 +125,8 @@ struct tcmu_device {
     char			cfgstring_orig[256];
     char			cfgstring[256];
 
-    struct timeval		req_utime;		/* request CPU time */
-    struct timeval		req_stime;		/* accumulated from ops */
-    struct timeval		rsp_utime;		/* response CPU time */
-    struct timeval		rsp_stime;		/* accumulated from ops */
-    uint64_t			nreq;			/* requests to handler */
-    uint64_t			nrsp;			/* completions to scst */
-
-    struct timeval		last_req_utime;		/* XXX dodgy */
-    struct timeval		last_req_stime;
-    struct timeval		last_rsp_utime;
-    struct timeval		last_rsp_stime;
+    bool			timing;			/* per-op latency sampling on */
+    struct scstu_lat_cpu      * lat;			/* [nr_cpu_ids] histograms */
 };
 
 #define tcmu_set_dev_private(tcmu_dev, priv)		((tcmu_dev)->hm_private = (priv))